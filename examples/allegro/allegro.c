@@ -85,37 +85,30 @@ int gid_extract_flags(unsigned int gid) {
 	return res;
 }
 
-unsigned int gid_clear_flags(unsigned int gid) {
-	return gid & TMX_FLIP_BITS_REMOVAL;
-}
-
 void draw_layer(tmx_map *map, tmx_layer *layer) {
-	unsigned long i, j;
-	unsigned int gid, x, y, w, h, flags;
+	unsigned int i, j;
 	float op;
-	tmx_tileset *ts;
-	tmx_image *im;
+	tmx_layer_quads *quads;
+	tmx_quad_batch *batch;
+	tmx_quad *q;
 	ALLEGRO_BITMAP *tileset;
 	op = layer->opacity;
-	for (i=0; i<map->height; i++) {
-		for (j=0; j<map->width; j++) {
-			gid = gid_clear_flags(layer->content.gids[(i*map->width)+j]);
-			ts = map->tiles[gid]->tileset;
-			im = map->tiles[gid]->image; 
-			x  = map->tiles[gid]->ul_x;
-			y  = map->tiles[gid]->ul_y;
-			w  = ts->tile_width;
-			h  = ts->tile_height;
-			if (im) {
-				tileset = (ALLEGRO_BITMAP*)im->resource_image;
-			}
-			else {
-				tileset = (ALLEGRO_BITMAP*)ts->image->resource_image;
-			}
-			flags = gid_extract_flags(layer->content.gids[(i*map->width)+j]);
-			al_draw_tinted_bitmap_region(tileset, al_map_rgba_f(op, op, op, op), x, y, w, h, j*ts->tile_width, i*ts->tile_height, flags);
+	if (!(quads = tmx_layer_build_quads(map, layer))) {
+		tmx_perror("tmx_layer_build_quads");
+		return;
+	}
+	/* one texture per batch, allegro draws held bitmaps in one go */
+	for (i=0; i<quads->batch_count; i++) {
+		batch = quads->batches + i;
+		tileset = (ALLEGRO_BITMAP*)batch->texture->resource_image;
+		al_hold_bitmap_drawing(true);
+		for (j=0; j<batch->count; j++) {
+			q = batch->quads + j;
+			al_draw_tinted_bitmap_region(tileset, al_map_rgba_f(op, op, op, op), q->src_x, q->src_y, q->src_w, q->src_h, q->x, q->y, gid_extract_flags(q->flips));
 		}
+		al_hold_bitmap_drawing(false);
 	}
+	tmx_layer_quads_free(quads);
 }
 
 /*
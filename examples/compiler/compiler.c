@@ -0,0 +1,29 @@
+/*
+	Compiles .tmx maps to the binary format loaded by tmx_load_compiled()
+	usage: tmxc <map.tmx> <map.tmxb>
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <tmx.h>
+
+int main(int argc, char *argv[]) {
+	tmx_map *m;
+	int ret;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <map.tmx> <map.tmxb>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	m = tmx_load(argv[1]);
+	if (!m) {
+		tmx_perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	ret = tmx_compile(m, argv[2]);
+	if (!ret) tmx_perror(argv[2]);
+	tmx_map_free(m);
+
+	return ret? EXIT_SUCCESS: EXIT_FAILURE;
+}
@@ -60,16 +60,25 @@ void mk_padding(char pad[11], int depth) {
 	pad[depth] = '\0';
 }
 
-void dump_prop(tmx_property *p, int depth) {
+void dump_prop(tmx_properties *props, int depth) {
+	tmx_property *p;
 	char padding[11]; mk_padding(padding, depth);
 
 	printf("\n%s" "properties={", padding);
-	if (!p) {
+	if (!props) {
 		printf(" (NULL) }");
 	} else {
-		while (p) {
-			printf("\n%s\t" "'%s'='%s'", padding, p->name, p->value);
-			p = p->next;
+		for (p = props->head; p; p = p->next) {
+			printf("\n%s\t" "'%s'=", padding, p->name);
+			switch (p->type) {
+				case PT_INT:    printf("(int)%d", p->parsed.integer); break;
+				case PT_FLOAT:  printf("(float)%f", p->parsed.decimal); break;
+				case PT_BOOL:   printf("(bool)%s", p->parsed.boolean? "true": "false"); break;
+				case PT_COLOR:  printf("(color)#%.8X", p->parsed.color); break;
+				case PT_FILE:   printf("(file)'%s'", p->value); break;
+				case PT_OBJECT: printf("(object)%u", p->parsed.object_id); break;
+				default:        printf("'%s'", p->value);
+			}
 		}
 		printf("\n" "%s}", padding);
 	}
@@ -160,15 +169,16 @@ void dump_tile(tmx_tile *t, unsigned int tilecount) {
 	}
 }
 
-void dump_tileset(tmx_tileset *t) {
+void dump_tileset(tmx_tileset_list *tsl) {
+	tmx_tileset *t = tsl? tsl->tileset: NULL;
 	printf("\ntileset={");
 	if (t) {
 		printf("\n\t" "name=%s", t->name);
 		printf("\n\t" "tilecount=%u", t->tilecount);
-		printf("\n\t" "firstgid=%u", t->firstgid);
+		printf("\n\t" "firstgid=%u", tsl->firstgid);
 		printf("\n\t" "tile_height=%u", t->tile_height);
 		printf("\n\t" "tile_width=%u", t->tile_width);
-		printf("\n\t" "firstgid=%u", t->firstgid);
+		printf("\n\t" "firstgid=%u", tsl->firstgid);
 		printf("\n\t" "margin=%u", t->margin);
 		printf("\n\t" "spacing=%u", t->spacing);
 		printf("\n\t" "x_offset=%d", t->x_offset);
@@ -181,8 +191,8 @@ void dump_tileset(tmx_tileset *t) {
 		printf(" (NULL) }");
 	}
 
-	if (t && t->next) {
-		dump_tileset(t->next);
+	if (tsl && tsl->next) {
+		dump_tileset(tsl->next);
 	}
 }
 
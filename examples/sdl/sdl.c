@@ -69,41 +69,31 @@ void draw_objects(tmx_object_group *objgr) {
 	}
 }
 
-unsigned int gid_clear_flags(unsigned int gid) {
-	return gid & TMX_FLIP_BITS_REMOVAL;
-}
-
 void draw_layer(tmx_map *map, tmx_layer *layer) {
-	unsigned long i, j;
-	unsigned int gid;
-	float op;
-	tmx_tileset *ts;
-	tmx_image *im;
+	unsigned int i, j;
+	tmx_layer_quads *quads;
+	tmx_quad_batch *batch;
+	tmx_quad *q;
 	SDL_Rect srcrect, dstrect;
 	SDL_Texture* tileset;
-	op = layer->opacity;
-	for (i=0; i<map->height; i++) {
-		for (j=0; j<map->width; j++) {
-			gid = gid_clear_flags(layer->content.gids[(i*map->width)+j]);
-			if (map->tiles[gid] != NULL) {
-				ts = map->tiles[gid]->tileset;
-				im = map->tiles[gid]->image;
-				srcrect.x = map->tiles[gid]->ul_x;
-				srcrect.y = map->tiles[gid]->ul_y;
-				srcrect.w = dstrect.w = ts->tile_width;
-				srcrect.h = dstrect.h = ts->tile_height;
-				dstrect.x = j*ts->tile_width;  dstrect.y = i*ts->tile_height;
-				/* TODO Opacity and Flips */
-				if (im) {
-					tileset = (SDL_Texture*)im->resource_image;
-				}
-				else {
-					tileset = (SDL_Texture*)ts->image->resource_image;
-				}
-				SDL_RenderCopy(ren, tileset, &srcrect, &dstrect);
-			}
+	if (!(quads = tmx_layer_build_quads(map, layer))) {
+		tmx_perror("tmx_layer_build_quads");
+		return;
+	}
+	for (i=0; i<quads->batch_count; i++) {
+		batch = quads->batches + i;
+		tileset = (SDL_Texture*)batch->texture->resource_image;
+		for (j=0; j<batch->count; j++) {
+			q = batch->quads + j;
+			srcrect.x = q->src_x;  srcrect.y = q->src_y;
+			srcrect.w = q->src_w;  srcrect.h = q->src_h;
+			dstrect.x = q->x;      dstrect.y = q->y;
+			dstrect.w = q->w;      dstrect.h = q->h;
+			/* TODO Opacity and Flips */
+			SDL_RenderCopy(ren, tileset, &srcrect, &dstrect);
 		}
 	}
+	tmx_layer_quads_free(quads);
 }
 
 void draw_image_layer(tmx_image *img) {
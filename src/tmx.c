@@ -20,120 +20,537 @@ void  (*tmx_img_free_func) (void *address) = NULL;
 	Public functions
 */
 
-tmx_map* tmx_load(const char *path) {
-	tmx_map *map = NULL;
+void tmx_loader_init(tmx_loader *ctx) {
+	memset(ctx, 0, sizeof(tmx_loader));
+	ctx->alloc_func = realloc;
+	ctx->free_func = free;
+	init_xml_parser();
+}
+
+/* loader configured with the globals, used by the non _ex functions */
+static void global_loader(tmx_loader *ctx) {
+	tmx_loader_init(ctx);
+	if (tmx_alloc_func) ctx->alloc_func = tmx_alloc_func;
+	if (tmx_free_func) ctx->free_func = tmx_free_func;
+	ctx->img_load_func = tmx_img_load_func;
+	ctx->img_free_func = tmx_img_free_func;
+}
+
+/* reports the error of a failed call on the globals */
+static tmx_map* global_result(tmx_loader *ctx, tmx_map *map) {
+	if (!map) {
+		tmx_errno = ctx->err;
+		memcpy(custom_msg, ctx->errmsg, sizeof(custom_msg));
+	}
+	return map;
+}
 
-	if (!tmx_alloc_func) tmx_alloc_func = realloc;
-	if (!tmx_free_func) tmx_free_func = free;
+static int check_loader(tmx_loader *ctx) {
+	if (!ctx) {
+		tmx_err_global(E_INVAL, "tmx_load_ex: invalid argument: ctx is NULL");
+		return 0;
+	}
+	if (!ctx->alloc_func) ctx->alloc_func = realloc;
+	if (!ctx->free_func) ctx->free_func = free;
+	ctx->err = E_NONE;
+	ctx->arena = NULL;
+	ctx->images = NULL;
+	ctx->pool = NULL;
+	ctx->strings = NULL;
+	return 1;
+}
+
+/* builds the spatial index of all the object groups */
+static int index_objgrs(tmx_loader *ctx, tmx_map *map) {
+	tmx_layer *l;
+	for (l = map->ly_head; l; l = l->next) {
+		if (l->type == L_OBJGR && !objgr_index_build(ctx, l->content.objgr)) {
+			tmx_err(ctx, E_ALLOC, "objgr_index_build: could not build the index of layer '%s'", l->name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* copies the objects of all the object groups in contiguous arrays */
+static int flatten_objgrs(tmx_loader *ctx, tmx_map *map) {
+	tmx_layer *l;
+	for (l = map->ly_head; l; l = l->next) {
+		if (l->type == L_OBJGR && !objgr_arrays_build(ctx, l->content.objgr)) {
+			if (ctx->err == E_ALLOC) tmx_err(ctx, E_ALLOC, "objgr_arrays_build: could not copy the objects of layer '%s'", l->name);
+			return 0;
+		}
+	}
+	return 1;
+}
 
-	map = parse_xml(path);
+/* stores all the tile layers as planes */
+static int plane_layers(tmx_loader *ctx, tmx_map *map) {
+	tmx_layer *l;
+	for (l = map->ly_head; l; l = l->next) {
+		if (l->type == L_LAYER && !l->lazy && !layer_planes_build(ctx, map, l)) {
+			if (ctx->err == E_ALLOC) tmx_err(ctx, E_ALLOC, "layer_planes_build: could not build the planes of layer '%s'", l->name);
+			return 0;
+		}
+	}
+	return 1;
+}
 
+/* runtime properties computed once the whole map is parsed */
+static tmx_map* finish_map(tmx_loader *ctx, tmx_map *map) {
 	if (map) {
-		if (!mk_map_tile_array(map)) {
+		if (!mk_map_tile_array(ctx, map) ||
+		    ((ctx->flags & TMX_LOAD_TILE_PLANES) && !plane_layers(ctx, map)) ||
+		    ((ctx->flags & TMX_LOAD_OBJECT_ARRAYS) && !flatten_objgrs(ctx, map)) ||
+		    ((ctx->flags & TMX_LOAD_OBJECT_INDEX) && !index_objgrs(ctx, map))) {
 			tmx_map_free(map);
 			map = NULL;
 		}
 	}
-
+	if (map && !map->arena) {
+		map->strings = ctx->strings;
+	} else { /* strings in the arena, or the map failed to load */
+		str_pool_free(ctx->strings, ctx->free_func, !ctx->arena);
+	}
+	ctx->arena = NULL; /* owned by the map */
+	ctx->images = NULL;
+	ctx->strings = NULL;
 	return map;
 }
 
-static void free_props(tmx_property *p) {
-	if (p) {
-		free_props(p->next);
-		tmx_free_func(p->name);
-		tmx_free_func(p->value);
-		tmx_free_func(p);
+tmx_map* tmx_load_ex(tmx_loader *ctx, const char *path) {
+	if (!check_loader(ctx)) return NULL;
+	if (!path) {
+		tmx_err(ctx, E_INVAL, "tmx_load: invalid argument: path is NULL");
+		return NULL;
 	}
+	return finish_map(ctx, parse_xml(ctx, path));
 }
 
-static void free_obj(tmx_object *o) {
-	if (o) {
-		free_obj(o->next);
-		tmx_free_func(o->name);
-		if (o->points) tmx_free_func(*(o->points));
-		tmx_free_func(o->type);
-		tmx_free_func(o->points);
-		tmx_free_func(o);
+tmx_map* tmx_load_buffer_ex(tmx_loader *ctx, const void *buffer, size_t len, const char *base_path) {
+	if (!check_loader(ctx)) return NULL;
+	if (!buffer) {
+		tmx_err(ctx, E_INVAL, "tmx_load_buffer: invalid argument: buffer is NULL");
+		return NULL;
+	}
+	return finish_map(ctx, parse_xml_buffer(ctx, (const char*)buffer, len, base_path? base_path: ""));
+}
+
+tmx_map* tmx_load_mapped_ex(tmx_loader *ctx, const char *path) {
+	tmx_map *map;
+	mapped_file mf;
+
+	if (!check_loader(ctx)) return NULL;
+	if (!path) {
+		tmx_err(ctx, E_INVAL, "tmx_load_mapped: invalid argument: path is NULL");
+		return NULL;
 	}
+	if (!map_file(ctx, path, &mf)) return NULL;
+	map = parse_xml_buffer(ctx, mf.data, mf.len, path);
+	unmap_file(&mf);
+	return finish_map(ctx, map);
 }
 
-static void free_objgr(tmx_object_group *o) {
+tmx_map* tmx_load_compiled_ex(tmx_loader *ctx, const char *path) {
+	if (!check_loader(ctx)) return NULL;
+	if (!path) {
+		tmx_err(ctx, E_INVAL, "tmx_load_compiled: invalid argument: path is NULL");
+		return NULL;
+	}
+	return finish_map(ctx, load_compiled(ctx, path));
+}
+
+int tmx_compile_ex(tmx_loader *ctx, const tmx_map *map, const char *path) {
+	if (!check_loader(ctx)) return 0;
+	if (!map || !path) {
+		tmx_err(ctx, E_INVAL, "tmx_compile: invalid argument: %s is NULL", map? "path": "map");
+		return 0;
+	}
+	return compile_map(ctx, map, path);
+}
+
+tmx_map* tmx_load(const char *path) {
+	tmx_loader ctx;
+	global_loader(&ctx);
+	return global_result(&ctx, tmx_load_ex(&ctx, path));
+}
+
+tmx_map* tmx_load_buffer(const void *buffer, size_t len, const char *base_path) {
+	tmx_loader ctx;
+	global_loader(&ctx);
+	return global_result(&ctx, tmx_load_buffer_ex(&ctx, buffer, len, base_path));
+}
+
+tmx_map* tmx_load_mapped(const char *path) {
+	tmx_loader ctx;
+	global_loader(&ctx);
+	return global_result(&ctx, tmx_load_mapped_ex(&ctx, path));
+}
+
+tmx_map* tmx_load_compiled(const char *path) {
+	tmx_loader ctx;
+	global_loader(&ctx);
+	return global_result(&ctx, tmx_load_compiled_ex(&ctx, path));
+}
+
+int tmx_compile(const tmx_map *map, const char *path) {
+	tmx_loader ctx;
+	global_loader(&ctx);
+	if (!tmx_compile_ex(&ctx, map, path)) {
+		global_result(&ctx, NULL);
+		return 0;
+	}
+	return 1;
+}
+
+static void free_props(tmx_map *m, tmx_properties *props) {
+	tmx_property *p, *next;
+	if (props) {
+		for (p = props->head; p; p = next) {
+			next = p->next;
+			m->free_func(p->value); /* the name is in m->strings */
+			m->free_func(p);
+		}
+		m->free_func(props->table);
+		m->free_func(props);
+	}
+}
+
+static void free_obj(tmx_map *m, tmx_object *o) {
+	tmx_object *next;
+	for (; o; o = next) { /* iterative, groups may hold a lot of objects */
+		next = o->next; /* name and type are in m->strings */
+		if (o->points) m->free_func(*(o->points));
+		m->free_func(o->points);
+		free_props(m, o->properties);
+		m->free_func(o);
+	}
+}
+
+static void free_objgr(tmx_map *m, tmx_object_group *o) {
 	if (o) {
-		free_obj(o->head);
-		tmx_free_func(o);
+		objgr_index_free(o);
+		free_obj(m, o->head);
+		m->free_func(o->arrays);
+		m->free_func(o);
+	}
+}
+
+static void free_image(tmx_map *m, tmx_image *i) {
+	if (i) { /* i->resource_image is in m->images */
+		m->free_func(i->source);
+		m->free_func(i);
 	}
 }
 
-static void free_image(tmx_image *i) {
-	if (i) {
-		tmx_free_func(i->source);
-		if (tmx_img_free_func) {
-			tmx_img_free_func(i->resource_image);
+/* frees the gids or chunks of a tile layer */
+void free_layer_data(tmx_layer *l, void (*free_func)(void*)) {
+	tmx_layer_chunks *c = l->chunks;
+	size_t i;
+	if (c) {
+		for (i=0; c->chunks && i<(size_t)c->cols*c->rows; i++) {
+			free_func(c->chunks[i]);
 		}
-		tmx_free_func(i);
+		free_func(c->chunks);
+		free_func(c);
 	}
+	free_func(l->content.gids);
+	l->content.gids = NULL;
+	l->chunks = NULL;
 }
 
-static void free_layers(tmx_layer *l) {
+static void free_layers(tmx_map *m, tmx_layer *l) {
 	if (l) {
-		free_layers(l->next);
-		tmx_free_func(l->name);
-		if (l->type == L_LAYER)
-			tmx_free_func(l->content.gids);
+		free_layers(m, l->next);
+		m->free_func(l->name);
+		if (l->type == L_LAYER) {
+			free_layer_data(l, m->free_func);
+			if (l->lazy && l->lazy->own_text) l->lazy->free_func(l->lazy->text);
+			m->free_func(l->lazy);
+			m->free_func(l->planes);
+		}
 		else if (l->type == L_OBJGR)
-			free_objgr(l->content.objgr);
+			free_objgr(m, l->content.objgr);
 		else if (l->type == L_IMAGE) {
-			free_image(l->content.image);
+			free_image(m, l->content.image);
 		}
-		free_props(l->properties);
-		tmx_free_func(l);
+		free_props(m, l->properties);
+		m->free_func(l);
 	}
 }
 
-static void free_tiles(tmx_tile *t, int tilecount) {
+static void free_tiles(tmx_map *m, tmx_tile *t, int tilecount) {
 	int i;
 	if (t) {
 		for (i=0; i<tilecount; i++) {
-			free_props(t[i].properties);
-			free_image(t[i].image);
-			free_obj(t[i].collision);
-			tmx_free_func(t[i].animation);
+			free_props(m, t[i].properties);
+			free_image(m, t[i].image);
+			free_obj(m, t[i].collision);
+			m->free_func(t[i].animation);
 		}
 	}
 }
 
-static void free_ts(tmx_tileset *ts) {
+static void free_ts(tmx_map *m, tmx_tileset *ts) {
 	if (ts) {
-		free_ts(ts->next);
-		tmx_free_func(ts->name);
-		free_image(ts->image);
-		free_props(ts->properties);
-		free_tiles(ts->tiles, ts->tilecount);
-		tmx_free_func(ts->tiles);
-		tmx_free_func(ts);
+		m->free_func(ts->name);
+		free_image(m, ts->image);
+		free_props(m, ts->properties);
+		free_tiles(m, ts->tiles, ts->tilecount);
+		m->free_func(ts->tiles);
+		m->free_func(ts);
+	}
+}
+
+static void free_ts_list(tmx_map *m, tmx_tileset_list *tsl) {
+	if (tsl) {
+		free_ts_list(m, tsl->next);
+		if (tsl->cache_ref) {
+			ts_cache_release((ts_cache_entry*)tsl->cache_ref);
+		} else {
+			free_ts(m, tsl->tileset);
+		}
+		m->free_func(tsl->source);
+		m->free_func(tsl);
+	}
+}
+
+/* arena maps: only the cached tilesets, the lazy layers and the indexes need to be released */
+static void free_arena_map(tmx_map *map) {
+	tmx_tileset_list *tsl;
+	tmx_layer *l;
+
+	for (tsl = map->ts_head; tsl; tsl = tsl->next) {
+		if (tsl->cache_ref) {
+			ts_cache_release((ts_cache_entry*)tsl->cache_ref);
+		}
+	}
+	for (l = map->ly_head; l; l = l->next) {
+		tmx_layer_release(l);
+		if (l->type == L_LAYER && l->lazy && l->lazy->own_text) l->lazy->free_func(l->lazy->text);
+		if (l->type == L_OBJGR) objgr_index_free(l->content.objgr);
 	}
+	image_res_free(map->images, NULL, map->img_free_func);
+	/* the map itself lives in the arena */
+	arena_free(map->arena, map->free_func);
 }
 
 void tmx_map_free(tmx_map *map) {
-	if (map) {
-		free_ts(map->ts_head);
-		free_props(map->properties);
-		free_layers(map->ly_head);
-		tmx_free_func(map->tiles);
-		tmx_free_func(map);
+	if (map && map->arena) {
+		free_arena_map(map);
+	}
+	else if (map) {
+		free_ts_list(map, map->ts_head);
+		free_props(map, map->properties);
+		free_layers(map, map->ly_head);
+		image_res_free(map->images, map->free_func, map->img_free_func);
+		str_pool_free(map->strings, map->free_func, 1);
+		map->free_func(map->tile_dirs);
+		map->free_func(map->anim_gids);
+		map->free_func(map);
 	}
 }
 
 tmx_tile* tmx_get_tile(tmx_map *map, unsigned int gid) {
 	if (!map) {
-		tmx_err(E_INVAL, "tmx_get_tile: invalid argument: map is NULL");
+		tmx_err_global(E_INVAL, "tmx_get_tile: invalid argument: map is NULL");
 		return NULL;
 	}
 
 	gid &= TMX_FLIP_BITS_REMOVAL;
 
-	if (gid < map->tilecount) return map->tiles[gid];
+	if (gid < map->tilecount) return TMX_GID_TILE(map, gid);
 
 	return NULL;
 }
+
+tmx_anim_frame* tmx_tile_anim_frame_at(const tmx_tile *tile, unsigned long time_ms) {
+	unsigned int lo, hi, mid, t;
+
+	if (!tile || !tile->animation || !tile->animation_len) return NULL;
+	if (!tile->animation_duration) return tile->animation;
+
+	/* last frame starting at or before t, frames lasting 0ms are never returned */
+	t = (unsigned int)(time_ms % tile->animation_duration);
+	lo = 0;
+	hi = tile->animation_len;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (tile->animation[mid].start <= t) lo = mid;
+		else hi = mid;
+	}
+	return tile->animation + lo;
+}
+
+/* gid of the tile displayed for the animated tile at `gid` at `time_ms` */
+static unsigned int anim_frame_gid(const tmx_map *map, unsigned int gid, unsigned long time_ms, tmx_anim_frame **frame) {
+	tmx_tile *tile = TMX_GID_TILE(map, gid);
+	*frame = tmx_tile_anim_frame_at(tile, time_ms);
+	/* the frame is in the same tileset: same firstgid */
+	return gid - tile->id + (*frame)->tile_id;
+}
+
+unsigned int tmx_map_anim_tiles(const tmx_map *map, unsigned long time_ms, tmx_tile **out) {
+	unsigned int i, frame_gid;
+	tmx_anim_frame *frame;
+
+	if (!map || !out) {
+		tmx_err_global(E_INVAL, "tmx_map_anim_tiles: invalid argument: map or out is NULL");
+		return 0;
+	}
+
+	for (i=0; i<map->anim_count; i++) {
+		frame_gid = anim_frame_gid(map, map->anim_gids[i], time_ms, &frame);
+		out[i] = frame_gid < map->tilecount? TMX_GID_TILE(map, frame_gid): NULL;
+		if (!out[i]) out[i] = TMX_GID_TILE(map, map->anim_gids[i]); /* frame out of the tileset */
+	}
+	return map->anim_count;
+}
+
+unsigned int tmx_map_anim_changes(const tmx_map *map, unsigned long time_ms, unsigned int *frames, unsigned int *changed) {
+	unsigned int i, index, res = 0;
+	tmx_tile *tile;
+
+	if (!map || !frames || !changed) {
+		tmx_err_global(E_INVAL, "tmx_map_anim_changes: invalid argument: map, frames or changed is NULL");
+		return 0;
+	}
+
+	for (i=0; i<map->anim_count; i++) {
+		tile = TMX_GID_TILE(map, map->anim_gids[i]);
+		index = (unsigned int)(tmx_tile_anim_frame_at(tile, time_ms) - tile->animation);
+		if (frames[i] != index) {
+			frames[i] = index;
+			changed[res++] = map->anim_gids[i];
+		}
+	}
+	return res;
+}
+
+tmx_property* tmx_get_property(const tmx_properties *props, const char *name) {
+	if (!props || !props->table || !name) return NULL;
+	return props->table[props_slot(props, name)];
+}
+
+int32_t tmx_layer_get_gid(const tmx_layer *layer, unsigned int x, unsigned int y) {
+	const int32_t *chunk;
+
+	if (!layer || layer->type != L_LAYER || x >= layer->width || y >= layer->height) return 0;
+
+	if (layer->chunks) {
+		chunk = layer->chunks->chunks[(size_t)(y / TMX_CHUNK_SIZE) * layer->chunks->cols + x / TMX_CHUNK_SIZE];
+		return chunk? chunk[(y % TMX_CHUNK_SIZE) * TMX_CHUNK_SIZE + x % TMX_CHUNK_SIZE]: 0;
+	}
+	if (layer->content.gids) {
+		return layer->content.gids[(size_t)y * layer->width + x];
+	}
+	return 0;
+}
+
+int32_t* tmx_layer_gids(tmx_layer *layer) {
+	tmx_loader ctx;
+
+	if (!layer || layer->type != L_LAYER) {
+		tmx_err_global(E_INVAL, "tmx_layer_gids: invalid argument: not a tile layer");
+		return NULL;
+	}
+
+	if (layer->lazy && !layer->content.gids && !layer->chunks) {
+		/* the decoded data does not go in the arena of the map, see tmx_layer_release */
+		memset(&ctx, 0, sizeof(tmx_loader));
+		ctx.alloc_func = layer->lazy->alloc_func;
+		ctx.free_func = layer->lazy->free_func;
+		ctx.flags = layer->lazy->flags;
+		if (!lazy_decode(&ctx, layer)) {
+			global_result(&ctx, NULL);
+			return NULL;
+		}
+	}
+	return layer->content.gids;
+}
+
+void tmx_layer_release(tmx_layer *layer) {
+	if (layer && layer->type == L_LAYER && layer->lazy) {
+		free_layer_data(layer, layer->lazy->free_func);
+	}
+}
+
+int tmx_layer_decode_region(tmx_layer *layer, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int32_t *out) {
+	tmx_loader ctx;
+	const int32_t *chunk;
+	unsigned int i, j, cx, span;
+
+	if (!layer || layer->type != L_LAYER || !out) {
+		tmx_err_global(E_INVAL, "tmx_layer_decode_region: invalid argument: layer is not a tile layer or out is NULL");
+		return 0;
+	}
+	if (x > layer->width || w > layer->width - x || y > layer->height || h > layer->height - y) {
+		tmx_err_global(E_INVAL, "tmx_layer_decode_region: invalid argument: region out of the layer");
+		return 0;
+	}
+
+	if (layer->content.gids) {
+		for (j=0; j<h; j++) {
+			memcpy(out + (size_t)j * w, layer->content.gids + (size_t)(y + j) * layer->width + x, w * sizeof(int32_t));
+		}
+	}
+	else if (layer->chunks) {
+		for (j=0; j<h; j++) {
+			for (i=0; i<w; i+=span) { /* the row, chunk by chunk */
+				cx = (x + i) % TMX_CHUNK_SIZE;
+				span = TMX_CHUNK_SIZE - cx < w - i? TMX_CHUNK_SIZE - cx: w - i;
+				chunk = layer->chunks->chunks[(size_t)((y + j) / TMX_CHUNK_SIZE) * layer->chunks->cols + (x + i) / TMX_CHUNK_SIZE];
+				if (chunk) {
+					memcpy(out + (size_t)j * w + i, chunk + ((y + j) % TMX_CHUNK_SIZE) * TMX_CHUNK_SIZE + cx, span * sizeof(int32_t));
+				} else {
+					memset(out + (size_t)j * w + i, 0, span * sizeof(int32_t));
+				}
+			}
+		}
+	}
+	else if (layer->lazy) { /* decodes the region only */
+		memset(&ctx, 0, sizeof(tmx_loader));
+		ctx.alloc_func = layer->lazy->alloc_func;
+		ctx.free_func = layer->lazy->free_func;
+		if (!lazy_decode_region(&ctx, layer, x, y, w, h, out)) {
+			global_result(&ctx, NULL);
+			return 0;
+		}
+	}
+	else {
+		memset(out, 0, (size_t)w * h * sizeof(int32_t)); /* layer without data */
+	}
+	return 1;
+}
+
+int tmx_layer_next_chunk(const tmx_layer *layer, tmx_chunk *chunk) {
+	unsigned int cols, rows, i, x, y;
+
+	if (!layer || !chunk || layer->type != L_LAYER) return 0;
+	if (!layer->chunks && !layer->content.gids) return 0;
+
+	cols = (layer->width + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE;
+	rows = (layer->height + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE;
+
+	for (i = chunk->index; i < cols * rows; i++) {
+		if (layer->chunks && !layer->chunks->chunks[i]) continue; /* empty */
+
+		x = (i % cols) * TMX_CHUNK_SIZE;
+		y = (i / cols) * TMX_CHUNK_SIZE;
+		chunk->x = x;
+		chunk->y = y;
+		chunk->width = layer->width - x < TMX_CHUNK_SIZE? layer->width - x: TMX_CHUNK_SIZE;
+		chunk->height = layer->height - y < TMX_CHUNK_SIZE? layer->height - y: TMX_CHUNK_SIZE;
+		if (layer->chunks) {
+			chunk->stride = TMX_CHUNK_SIZE;
+			chunk->gids = layer->chunks->chunks[i];
+		} else {
+			chunk->stride = layer->width;
+			chunk->gids = layer->content.gids + (size_t)y * layer->width + x;
+		}
+		chunk->index = i + 1;
+		return 1;
+	}
+	chunk->index = i;
+	return 0;
+}
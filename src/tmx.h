@@ -28,12 +28,30 @@ extern "C" {
 #define TMX_FLIPPED_VERTICALLY   0x40000000
 #define TMX_FLIPPED_DIAGONALLY   0x20000000
 #define TMX_FLIP_BITS_REMOVAL    0x1FFFFFFF
+/* the flip bits of a gid shifted by TMX_FLIP_SHIFT, see tmx_tile_planes */
+#define TMX_FLIP_SHIFT 29
+
+/* the tiles of a map are looked up in pages of TMX_GID_PAGE_SIZE gids, themselves in
+   directories of TMX_GID_DIR_SIZE pages, see map->tile_dirs. Only the pages and the
+   directories holding tiles are allocated, the others are the same page (or directory) of NULLs */
+#define TMX_GID_PAGE_BITS 8
+#define TMX_GID_PAGE_SIZE (1U << TMX_GID_PAGE_BITS)
+#define TMX_GID_DIR_BITS 10
+#define TMX_GID_DIR_SIZE (1U << TMX_GID_DIR_BITS)
+/* the tile of `gid` (without the flip bits, lower than map->tilecount), NULL if there is none */
+#define TMX_GID_TILE(map, gid) ((map)->tile_dirs[(gid) >> (TMX_GID_PAGE_BITS + TMX_GID_DIR_BITS)] \
+                                                [((gid) >> TMX_GID_PAGE_BITS) & (TMX_GID_DIR_SIZE - 1)] \
+                                                [(gid) & (TMX_GID_PAGE_SIZE - 1)])
+
+/* width and height (in tiles) of the chunks of sparse layers, see TMX_LOAD_CHUNKED */
+#define TMX_CHUNK_SIZE 16
 
 /*
 	Configuration
 */
 /* Custom realloc and free function, for memalloc debugging purposes
-   Please modify these values if once before you use tmx_load */
+   Please modify these values if once before you use tmx_load
+   These globals are only used by tmx_load*, see tmx_loader for tmx_load*_ex */
 TMXEXPORT extern void* (*tmx_alloc_func) (void *address, size_t len); /* realloc */
 TMXEXPORT extern void  (*tmx_free_func ) (void *address);             /* free */
 
@@ -53,17 +71,27 @@ enum tmx_stagger_axis {SA_NONE, SA_X, SA_Y};
 enum tmx_layer_type {L_NONE, L_LAYER, L_OBJGR, L_IMAGE};
 enum tmx_objgr_draworder {G_NONE, G_INDEX, G_TOPDOWN};
 enum tmx_shape {S_NONE, S_SQUARE, S_POLYGON, S_POLYLINE, S_ELLIPSE, S_TILE};
+enum tmx_property_type {PT_NONE, PT_INT, PT_FLOAT, PT_BOOL, PT_STRING, PT_COLOR, PT_FILE, PT_OBJECT};
 
 /* typedefs of the structures below */
 typedef struct _tmx_prop tmx_property;
+typedef struct _tmx_props tmx_properties;
 typedef struct _tmx_img tmx_image;
 typedef struct _tmx_frame tmx_anim_frame;
 typedef struct _tmx_tile tmx_tile;
 typedef struct _tmx_ts tmx_tileset;
+typedef struct _tmx_ts_list tmx_tileset_list;
 typedef struct _tmx_obj tmx_object;
 typedef struct _tmx_objgr tmx_object_group;
+typedef struct _tmx_obj_arrays tmx_object_arrays;
 typedef struct _tmx_layer tmx_layer;
+typedef struct _tmx_chunks tmx_layer_chunks;
+typedef struct _tmx_planes tmx_tile_planes;
 typedef struct _tmx_map tmx_map;
+typedef struct _tmx_loader tmx_loader;
+typedef struct _tmx_arena tmx_arena; /* opaque */
+typedef struct _tmx_ts_cache tmx_tileset_cache; /* opaque */
+typedef struct _tmx_img_cache tmx_image_cache; /* opaque */
 
 typedef union {
 	int integer;
@@ -71,12 +99,34 @@ typedef union {
 	void *pointer;
 } tmx_user_data;
 
-struct _tmx_prop { /* <properties> and <property> */
-	char *name;
-	char *value;
+union tmx_property_value { /* value of a property, parsed according to its type */
+	int integer; /* PT_INT */
+	double decimal; /* PT_FLOAT */
+	int boolean; /* PT_BOOL, 0 == false */
+	unsigned int color; /* PT_COLOR, bytes : ARGB (alpha is 0xFF if not written) */
+	unsigned int object_id; /* PT_OBJECT, 0 if no object is referenced */
+};
+
+/* object names and types and property names are interned: equal strings of a
+   map (or of a cached tileset) are the same pointer and can be compared with ==
+   they are shared, must not be modified nor freed */
+
+struct _tmx_prop { /* <property> */
+	char *name; /* interned */
+	char *value; /* as written in the file (text content of multi-line strings), also for PT_STRING and PT_FILE */
+	enum tmx_property_type type; /* PT_STRING if the type is not written, or if the value does not match it */
+	union tmx_property_value parsed; /* see type, unused for PT_STRING and PT_FILE */
 	tmx_property *next;
 };
 
+struct _tmx_props { /* <properties> */
+	unsigned int count;
+	tmx_property *head; /* in document order */
+	/* hash table of the properties by name, see tmx_get_property */
+	unsigned int table_mask; /* length of table - 1, length is a power of 2 */
+	tmx_property **table;
+};
+
 struct _tmx_img { /* <image> */
 	char *source;
 	unsigned int trans; /* bytes : RGB */
@@ -84,12 +134,13 @@ struct _tmx_img { /* <image> */
 	unsigned long width, height;
 	/*char *format; Not currently implemented in QtTiled
 	char *data;*/
-	void *resource_image;
+	void *resource_image; /* shared by all the images of the map with the same source */
 };
 
 struct _tmx_frame { /* <frame> */
 	unsigned int tile_id;
 	unsigned int duration;
+	unsigned int start; /* time of the frame in the animation, sum of the durations of the previous frames */
 };
 
 struct _tmx_tile { /* <tile> */
@@ -102,14 +153,14 @@ struct _tmx_tile { /* <tile> */
 
 	unsigned int animation_len;
 	tmx_anim_frame *animation;
+	unsigned int animation_duration; /* length of a cycle of the animation (sum of the durations) */
 
-	tmx_property *properties;
+	tmx_properties *properties;
 
 	tmx_user_data user_data;
 };
 
 struct _tmx_ts { /* <tileset> and <tileoffset> */
-	unsigned int firstgid;
 	char *name;
 
 	unsigned int tile_width, tile_height;
@@ -120,9 +171,17 @@ struct _tmx_ts { /* <tileset> and <tileoffset> */
 	tmx_image *image;
 
 	tmx_user_data user_data;
-	tmx_property *properties;
-	tmx_tile *tiles;
-	tmx_tileset *next;
+	tmx_properties *properties;
+	tmx_tile *tiles; /* tiles[id] if the tileset has an image, sorted by id for image collections */
+};
+
+struct _tmx_ts_list { /* <tileset> element of a map */
+	unsigned int firstgid;
+	int is_embedded; /* 0 if the tileset is loaded from a tsx file */
+	char *source; /* path of the tsx file, as written in the map (NULL if embedded) */
+	tmx_tileset *tileset; /* may be shared by several maps, see tmx_tileset_cache */
+	tmx_tileset_list *next;
+	void *cache_ref; /* private */
 };
 
 struct _tmx_obj { /* <object> */
@@ -140,8 +199,8 @@ struct _tmx_obj { /* <object> */
 	int visible; /* 0 == false */
 	double rotation;
 
-	char *name, *type;
-	tmx_property *properties;
+	char *name, *type; /* interned */
+	tmx_properties *properties;
 	tmx_object *next;
 };
 
@@ -149,6 +208,44 @@ struct _tmx_objgr { /* <objectgroup> */
 	unsigned int color; /* bytes : RGB */
 	enum tmx_objgr_draworder draworder;
 	tmx_object *head;
+	tmx_object_arrays *arrays; /* NULL unless loaded with TMX_LOAD_OBJECT_ARRAYS */
+	struct _tmx_obj_index *index; /* private, see tmx_objgr_query_rect */
+
+	/* set by the loader, used to build the index on demand */
+	void* (*alloc_func) (void *address, size_t len);
+	void  (*free_func) (void *address);
+};
+
+struct _tmx_obj_arrays { /* objects of a group in contiguous arrays (a single allocation) */
+	unsigned int count; /* entry i of each array is the i-th object of the list objgr->head */
+	tmx_object **objects; /* the nodes, for the names, types and properties */
+	unsigned int *ids;
+	enum tmx_shape *shapes;
+	int *gids;
+	int *visible;
+	double *x, *y;
+	double *width, *height;
+	double *rotation;
+	/* points of all the polygons and polylines, (x, y) pairs relative to their object
+	   the points of object i are points[2*points_start[i]] to points[2*points_start[i+1]] (excluded) */
+	unsigned int *points_start; /* count+1 entries */
+	double *points;
+};
+
+struct _tmx_chunks { /* sparse storage of a tile layer */
+	unsigned int cols, rows; /* number of chunks on each axis */
+	unsigned int count; /* number of non-empty chunks */
+	/* cols*rows chunks, row by row, each chunk is TMX_CHUNK_SIZE rows of TMX_CHUNK_SIZE gids
+	   chunks without any tile are not stored (NULL), they all read as 0 */
+	int32_t **chunks;
+};
+
+struct _tmx_planes { /* a tile layer as planes of width*height cells, row by row */
+	uint16_t *tiles; /* index of the tile of each cell in `palette`, 0 for empty cells */
+	uint8_t *flips; /* flip bits of each cell, TMX_FLIPPED_* >> TMX_FLIP_SHIFT */
+	unsigned int palette_len;
+	tmx_tile **palette; /* the tiles used by the layer, palette[0] is NULL */
+	uint32_t *palette_gids; /* gid of each tile of the palette (0 for palette[0]) */
 };
 
 struct _tmx_layer { /* <layer> or <imagelayer> or <objectgroup> */
@@ -156,16 +253,20 @@ struct _tmx_layer { /* <layer> or <imagelayer> or <objectgroup> */
 	double opacity;
 	int visible; /* 0 == false */
 	int offsetx, offsety;
+	unsigned int width, height; /* in tiles, tile layers only */
 
 	enum tmx_layer_type type;
 	union layer_content {
-		int32_t *gids;
+		int32_t *gids; /* NULL if the layer is chunked */
 		tmx_object_group *objgr;
 		tmx_image *image;
 	} content;
+	tmx_layer_chunks *chunks; /* tile layers loaded with TMX_LOAD_CHUNKED, NULL otherwise */
+	tmx_tile_planes *planes; /* tile layers loaded with TMX_LOAD_TILE_PLANES, NULL otherwise */
+	struct _tmx_lazy_data *lazy; /* private, encoded data of a layer loaded with TMX_LOAD_LAZY */
 
 	tmx_user_data user_data;
-	tmx_property *properties;
+	tmx_properties *properties;
 	tmx_layer *next;
 };
 
@@ -182,14 +283,26 @@ struct _tmx_map { /* <map> (Head of the data structure) */
 	unsigned int backgroundcolor; /* bytes : RGB */
 	enum tmx_map_renderorder renderorder;
 
-	tmx_property *properties;
-	tmx_tileset *ts_head;
+	tmx_properties *properties;
+	tmx_tileset_list *ts_head;
 	tmx_layer *ly_head;
 
-	unsigned int tilecount; /* length of map->tiles */
-	tmx_tile **tiles; /* GID indexed tile array (array of pointers to tmx_tile) */
+	unsigned int tilecount; /* highest gid + 1 */
+	unsigned int dir_count; /* length of map->tile_dirs (at most 2048) */
+	tmx_tile ****tile_dirs; /* GID indexed tiles, by directories of pages, see TMX_GID_TILE */
+
+	unsigned int anim_count; /* length of map->anim_gids */
+	unsigned int *anim_gids; /* gids of the animated tiles, in increasing order (built with map->tile_dirs) */
 
 	tmx_user_data user_data;
+
+	/* set by the loader, used by tmx_map_free and by the structures built on demand */
+	void* (*alloc_func) (void *address, size_t len);
+	void  (*free_func) (void *address);
+	void  (*img_free_func) (void *address);
+	tmx_arena *arena; /* NULL unless loaded with TMX_LOAD_ARENA */
+	struct _tmx_img_res *images; /* private, image resources loaded for this map */
+	struct _tmx_str_pool *strings; /* private, interned strings, NULL with TMX_LOAD_ARENA (they are in the arena) */
 };
 
 /*
@@ -200,12 +313,162 @@ struct _tmx_map { /* <map> (Head of the data structure) */
    returns NULL if an error occured and set tmx_errno */
 TMXEXPORT tmx_map *tmx_load(const char *path);
 
+/* Same as tmx_load, parses the map from a buffer holding the content of a tmx file
+   the buffer is not copied and can be released as soon as this function returns
+   `base_path` is the path of the map (or of its directory, with a trailing path separator)
+   used to resolve external tilesets and images, NULL means the current directory */
+TMXEXPORT tmx_map *tmx_load_buffer(const void *buffer, size_t len, const char *base_path);
+
+/* Same as tmx_load, maps the file in memory instead of reading it */
+TMXEXPORT tmx_map *tmx_load_mapped(const char *path);
+
+/* Writes the map in a compiled map file, that tmx_load_compiled loads
+   without parsing anything. The file can only be loaded by a build of the
+   library for the same platform (pointer size, byte order, version)
+   User data and image resources are not saved
+   returns 0 if an error occured and set tmx_errno */
+TMXEXPORT int tmx_compile(const tmx_map *map, const char *path);
+
+/* Same as tmx_load, loads a map written by tmx_compile
+   images are resolved relatively to the compiled file, those of external
+   tilesets relatively to their tsx file (its source, relative to the compiled file) */
+TMXEXPORT tmx_map *tmx_load_compiled(const char *path);
+
 /* Free the map data structure */
 TMXEXPORT void tmx_map_free(tmx_map *map);
 
 /* returns the tile associated with this gid, returns NULL if it fails */
 TMXEXPORT tmx_tile* tmx_get_tile(tmx_map *map, unsigned int gid);
 
+/* returns the frame of the animation of `tile` displayed at `time_ms` (looping from time 0)
+   found by binary search on the start of the frames, returns NULL if the tile is not animated */
+TMXEXPORT tmx_anim_frame* tmx_tile_anim_frame_at(const tmx_tile *tile, unsigned long time_ms);
+
+/* evaluates the animations of all the animated tiles of a map at `time_ms`, in a single pass
+   `out` receives map->anim_count tiles, in the order of map->anim_gids: the tile of the
+   current frame of each animated tile (the other gids are drawn as themselves)
+   returns the number of animated tiles */
+TMXEXPORT unsigned int tmx_map_anim_tiles(const tmx_map *map, unsigned long time_ms, tmx_tile **out);
+
+/* finds the animated tiles whose displayed frame changed since the previous call
+   `frames` holds the index of the displayed frame of each animated tile (map->anim_count
+   entries, in the order of map->anim_gids), it must be zeroed before the first call
+   (all the animations start on their first frame) and is updated
+   the gids that changed are written in `changed` (up to map->anim_count entries)
+   returns the number of gids written in `changed` */
+TMXEXPORT unsigned int tmx_map_anim_changes(const tmx_map *map, unsigned long time_ms, unsigned int *frames, unsigned int *changed);
+
+/* returns the property named `name` (if there are several, the last one), NULL if there is none
+   `props` may be NULL (elements without properties), the lookup does not walk the list */
+TMXEXPORT tmx_property* tmx_get_property(const tmx_properties *props, const char *name);
+
+/* returns the gid (with its flip bits) of the cell (x, y) of a tile layer, dense or chunked
+   returns 0 if the cell is empty, out of the layer, or if the layer is not a tile layer
+   layers loaded with TMX_LOAD_LAZY must be decoded first, see tmx_layer_gids */
+TMXEXPORT int32_t tmx_layer_get_gid(const tmx_layer *layer, unsigned int x, unsigned int y);
+
+/* returns the gid array of a tile layer, decodes it first if the layer was
+   loaded with TMX_LOAD_LAZY and has not been decoded yet
+   returns NULL if an error occured and set tmx_errno, or if the layer is
+   chunked (its chunks are decoded, see layer->chunks)
+   Not thread-safe: a layer may only be decoded by one thread at a time */
+TMXEXPORT int32_t* tmx_layer_gids(tmx_layer *layer);
+
+/* releases the decoded data of a layer loaded with TMX_LOAD_LAZY, the next
+   call to tmx_layer_gids decodes it again; does nothing on other layers */
+TMXEXPORT void tmx_layer_release(tmx_layer *layer);
+
+/* copies the gids of the w*h cells from (x, y) of a tile layer into `out`, row by row
+   a layer loaded with TMX_LOAD_LAZY that is not decoded is not decoded as a
+   whole: only the rows up to the region are read (CSV values before the region
+   are skipped without being parsed), `out` is the only buffer of the size of the region
+   returns 0 if an error occured (region out of the layer, invalid data) and set tmx_errno */
+TMXEXPORT int tmx_layer_decode_region(tmx_layer *layer, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int32_t *out);
+
+/* finds the objects of a group whose shape intersects the rectangle (x, y, w, h), in pixels
+   the rotation of the objects, the points of polygons and polylines and
+   ellipses are taken into account
+   up to `out_len` objects are written in `out`, in no particular order
+   returns the number of objects found (may be greater than `out_len`),
+   returns -1 if an error occured and set tmx_errno
+   The spatial index of the group is built by the first query (see tmx_objgr_index) */
+TMXEXPORT int tmx_objgr_query_rect(tmx_object_group *objgr, double x, double y, double w, double h, tmx_object **out, int out_len);
+
+/* same as tmx_objgr_query_rect, finds the objects containing the point (x, y) */
+TMXEXPORT int tmx_objgr_query_point(tmx_object_group *objgr, double x, double y, tmx_object **out, int out_len);
+
+/* (re)builds the spatial index of an object group, call it after the objects
+   of the group were changed, or to build the index before querying the group
+   from several threads (queries are thread-safe once the index exists)
+   uses the allocator of the loader of the map (objgr->alloc_func), see TMX_LOAD_OBJECT_INDEX to build it while loading
+   returns 0 if an error occured and set tmx_errno */
+TMXEXPORT int tmx_objgr_index(tmx_object_group *objgr);
+
+/* a rectangle of cells of a tile layer, see tmx_layer_next_chunk */
+typedef struct {
+	unsigned int x, y; /* position of the first cell, in tiles */
+	unsigned int width, height; /* at most TMX_CHUNK_SIZE (smaller on the right and bottom edges) */
+	unsigned int stride; /* distance between the first cells of two rows in `gids` */
+	const int32_t *gids; /* gid of cell (x+i, y+j) is gids[j*stride + i] */
+	unsigned int index; /* private, position of the iterator */
+} tmx_chunk;
+
+/* iterates over the chunks of a tile layer, in row order
+   `chunk` must be zeroed before the first call, returns 0 when there are no more chunks
+   only the non-empty chunks of a chunked layer are visited, all the chunks of a dense layer are */
+TMXEXPORT int tmx_layer_next_chunk(const tmx_layer *layer, tmx_chunk *chunk);
+
+/* a tile of a layer to draw, see tmx_layer_build_quads */
+typedef struct {
+	unsigned int cell_x, cell_y; /* cell of the layer */
+	unsigned int order; /* position of the quad in the render order of the layer (for depth sorting) */
+	uint32_t gid; /* without the flip bits */
+	uint32_t flips; /* TMX_FLIPPED_* bits of the gid, not applied to the rectangles below */
+	float x, y, w, h; /* destination rectangle in pixels, tile offset of the tileset and offset of the layer included */
+	unsigned int src_x, src_y, src_w, src_h; /* source rectangle in the texture, in pixels */
+	float u0, v0, u1, v1; /* source rectangle normalized by the size of the texture (0 if its size is unknown) */
+	tmx_tile *tile;
+} tmx_quad;
+
+/* the quads of a layer using the same texture */
+typedef struct {
+	tmx_image *texture; /* image of the tileset, or of the tile for image collection tilesets */
+	tmx_tileset *tileset;
+	unsigned int count;
+	tmx_quad *quads; /* in render order */
+} tmx_quad_batch;
+
+typedef struct {
+	unsigned int batch_count, quad_count;
+	tmx_quad_batch *batches; /* in the order of their first quad */
+	void (*free_func) (void *address); /* private, used by tmx_layer_quads_free */
+} tmx_layer_quads;
+
+/* builds the quads of all the non-empty cells of a tile layer, batched by texture
+   so that each batch can be drawn with a single call, for all the orientations
+   (positions as drawn by Tiled) and render orders (order of the quads in the batches)
+   Tiles that overlap cells of other batches (isometric maps, tiles larger than the
+   cells) are only drawn in the right order across batches when sorted on tmx_quad.order
+   a layer loaded with TMX_LOAD_LAZY is decoded, the result is a single block allocated
+   with the allocator of the loader of the map, released with tmx_layer_quads_free
+   returns NULL if an error occured and set tmx_errno */
+TMXEXPORT tmx_layer_quads* tmx_layer_build_quads(const tmx_map *map, tmx_layer *layer);
+
+TMXEXPORT void tmx_layer_quads_free(tmx_layer_quads *quads);
+
+/* called for each visible cell by tmx_layer_visible_cells, `quad` is only valid during
+   the call and its `order` is the position of the cell in the visit, return 0 to stop */
+typedef int (*tmx_cell_func)(const tmx_quad *quad, void *userdata);
+
+/* calls `func` on the non-empty cells of a tile layer whose tile intersects the
+   viewport (x, y, w, h) in pixels, in the render order of the map, with the quad
+   of the cell (see tmx_quad)
+   only the rows and columns around the viewport are checked, for all the orientations,
+   tile offsets, tiles larger than the cells and layer offsets are taken into account
+   a layer loaded with TMX_LOAD_LAZY is decoded
+   returns the number of cells passed to `func`, -1 if an error occured and set tmx_errno */
+TMXEXPORT int tmx_layer_visible_cells(const tmx_map *map, tmx_layer *layer, double x, double y, double w, double h, tmx_cell_func func, void *userdata);
+
 /*
 	Error handling
 	each time a function fails, tmx_errno is set
@@ -238,6 +501,120 @@ TMXEXPORT void tmx_perror(const char*);
 /* return the error message for the current value of `tmx_errno` */
 TMXEXPORT const char* tmx_strerr(void); /* FIXME errno parameter ? (as strerror) */
 
+/*
+	Loader context
+	Holds the configuration and the error state of a load, instead of the
+	globals above. Loaders are not shared: as long as each thread uses its own
+	loader, maps can be loaded concurrently with tmx_load*_ex.
+*/
+
+struct _tmx_loader {
+	void* (*alloc_func) (void *address, size_t len); /* realloc */
+	void  (*free_func ) (void *address);             /* free */
+
+	void* (*img_load_func) (const char *path); /* optional */
+	void  (*img_free_func) (void *address);
+
+	unsigned int flags; /* TMX_LOAD_* */
+	unsigned int threads; /* decoding threads used with TMX_LOAD_PARALLEL, 0 means one per CPU */
+
+	tmx_error_codes err; /* set when a call using this loader fails */
+	char errmsg[256];
+
+	tmx_arena *arena; /* private, arena of the map being loaded */
+
+	tmx_tileset_cache *ts_cache; /* optional, see tmx_tileset_cache_create */
+	tmx_image_cache *img_cache; /* optional, see tmx_image_cache_create */
+
+	struct _tmx_img_res **images; /* private, image resources of the map or tileset being loaded */
+	struct _tmx_pool *pool; /* private, see TMX_LOAD_PARALLEL */
+	struct _tmx_str_pool *strings; /* private, interned strings of the map being loaded */
+};
+
+/* Allocates all the nodes, strings and arrays of a map from a single growing
+   arena owned by the map, tmx_map_free then only releases a few blocks */
+#define TMX_LOAD_ARENA 0x0001
+
+/* Decodes the layer data (CSV, base64 + zlib/gzip) in worker threads while
+   the rest of the file is parsed, all the layers are decoded when the
+   tmx_load*_ex function returns. alloc_func and free_func must be thread-safe */
+#define TMX_LOAD_PARALLEL 0x0002
+
+/* Stores tile layers by chunks of TMX_CHUNK_SIZE x TMX_CHUNK_SIZE cells,
+   chunks without any tile are not allocated: memory use follows the content
+   of the layers instead of their area. `layer->content.gids` is NULL, use
+   `layer->chunks`, tmx_layer_get_gid or tmx_layer_next_chunk */
+#define TMX_LOAD_CHUNKED 0x0004
+
+/* Keeps the encoded payload of the tile layers instead of decoding it, each
+   layer is decoded by the first call to tmx_layer_gids on it, and can be
+   released again with tmx_layer_release. `layer->content.gids` (or
+   `layer->chunks`) is NULL until then. TMX_LOAD_PARALLEL has no effect */
+#define TMX_LOAD_LAZY 0x0008
+
+/* Builds the spatial index of every object group while loading, see tmx_objgr_query_rect */
+#define TMX_LOAD_OBJECT_INDEX 0x0010
+
+/* Copies the objects of every object group in contiguous arrays after loading
+   (see tmx_object_arrays), the linked lists are kept: systems processing all
+   the objects of a group (physics, rendering) should iterate on the arrays */
+#define TMX_LOAD_OBJECT_ARRAYS 0x0020
+
+/* Also stores each tile layer as planes after loading (see tmx_tile_planes): the
+   tile of a cell is `palette[tiles[i]]` and its flips are `flips[i]`, without any
+   check nor mask, using 3 bytes per cell. Layers with more than 65535 different tiles
+   fail to load, layers loaded with TMX_LOAD_LAZY are not converted */
+#define TMX_LOAD_TILE_PLANES 0x0040
+
+/* Initialises a loader with realloc/free and no image loading
+   Call it at least once from the main thread before loading in workers */
+TMXEXPORT void tmx_loader_init(tmx_loader *ctx);
+
+/* Same as tmx_load, tmx_load_buffer, tmx_load_mapped and tmx_load_compiled
+   return NULL if an error occured and set ctx->err */
+TMXEXPORT tmx_map *tmx_load_ex(tmx_loader *ctx, const char *path);
+TMXEXPORT tmx_map *tmx_load_buffer_ex(tmx_loader *ctx, const void *buffer, size_t len, const char *base_path);
+TMXEXPORT tmx_map *tmx_load_mapped_ex(tmx_loader *ctx, const char *path);
+TMXEXPORT tmx_map *tmx_load_compiled_ex(tmx_loader *ctx, const char *path);
+
+/* Same as tmx_compile, returns 0 if an error occured and set ctx->err */
+TMXEXPORT int tmx_compile_ex(tmx_loader *ctx, const tmx_map *map, const char *path);
+
+/* return the error message for the current value of `ctx->err` */
+TMXEXPORT const char* tmx_loader_strerr(tmx_loader *ctx);
+
+/*
+	Tileset cache
+	Set `ctx->ts_cache` to share the external tilesets (tsx files) and their
+	images between all the maps loaded with that loader (or with any loader
+	using the same cache). A tsx file is parsed again if its modification time
+	or size changed. The cache may be used by several threads at once.
+	Shared tilesets are read-only: do not set their user_data from one map only.
+*/
+
+/* Creates an empty cache, using the allocation functions of `ctx`
+   returns NULL if an error occured and set ctx->err */
+TMXEXPORT tmx_tileset_cache* tmx_tileset_cache_create(tmx_loader *ctx);
+
+/* Releases the cache, tilesets still used by maps are freed with the last of these maps */
+TMXEXPORT void tmx_tileset_cache_free(tmx_tileset_cache *cache);
+
+/*
+	Image cache
+	A map calls img_load_func only once per image file, whatever the number
+	of <image> elements using it. Set `ctx->img_cache` to also share the image
+	resources between all the maps loaded with that loader (or with any loader
+	using the same cache). The cache may be used by several threads at once,
+	img_load_func is called outside of its lock.
+*/
+
+/* Creates an empty cache, using the allocation functions of `ctx`
+   returns NULL if an error occured and set ctx->err */
+TMXEXPORT tmx_image_cache* tmx_image_cache_create(tmx_loader *ctx);
+
+/* Releases the cache, images still used by maps are freed with the last of these maps */
+TMXEXPORT void tmx_image_cache_free(tmx_image_cache *cache);
+
 #ifdef __cplusplus
 }
 #endif
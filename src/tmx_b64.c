@@ -0,0 +1,348 @@
+/*
+	Base64 encoding and decoding
+
+	The decoder is table driven, with SIMD kernels selected at runtime
+	(SSSE3 and AVX2 on x86, NEON on AArch64) for the bulk of the data,
+	the kernels fall back on the scalar loop for the block where they meet a
+	character they cannot handle (padding or invalid character).
+	All paths produce the same output and the same errors.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#if defined(WANT_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define B64_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#elif defined(WANT_SIMD) && (defined(__aarch64__) || defined(_M_ARM64))
+#define B64_NEON
+#include <arm_neon.h>
+#endif
+
+/* GCC and CLANG need to be told which functions may use which instruction set */
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+static const char b64enc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" "abcdefghijklmnopqrstuvwxyz" "0123456789" "+/";
+
+char* b64_encode(tmx_loader *ctx, const char *source, unsigned int length) {
+	unsigned int i, mlen, r_pos;
+	unsigned short dif, j;
+	unsigned int frame = 0;
+	char out[5];
+	char *res;
+
+	mlen = 4 * length/3 + 1; /* +1 : returns a null-terminated string */
+	if (length%3) {
+		mlen += 4;
+	}
+
+	res = (char*) ctx->alloc_func(NULL, mlen);
+	if (!res) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	res[mlen-1] = '\0';
+	out[4] = '\0';
+
+	for (i=0; i<length; i+=3) {
+		/*frame = 0; clean frame not needed because '>>' inserts '0' */
+		dif = (length-i)/3 ? 3 : (length-i)%3; /* number of byte to read */
+		for (j=0; j<dif; j++) {
+			memcpy(((char*)&frame)+2-j, source+i+j, 1); /* copy 3 bytes in reverse order */
+		}
+		/*
+		now 3 cases :
+		. 3B red => 4chars
+		. 2B red => 3chars + "="
+		. 1B red => 2chars + "=="
+		*/
+		for (j=0; j<dif+1; j++) {
+			out[j] = (char)((frame & 0xFC0000) >> 18); /* first 6 bits */
+			out[j] = b64enc[(int)out[j]];
+			frame = frame << 6; /* next 6b word */
+		}
+		if (dif == 1) {
+			out[2] = out [3] = '=';
+		} else if (dif == 2) {
+			out [3] = '=';
+		}
+		r_pos = (i/3)*4;
+		strcpy(res+r_pos, out);
+	}
+	return res;
+}
+
+/*
+	Scalar decoder
+*/
+
+/* 6 bits value of each character, -1 if invalid, padding ('=') decodes as 0 */
+static const signed char b64dec[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1,  0, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* decodes `len` (multiple of 4) characters, returns 0 on invalid character */
+static int b64_dec_scalar(tmx_loader *ctx, const unsigned char *src, size_t len, unsigned char *dst) {
+	size_t i;
+	int a, b, c, d, j;
+	unsigned long v;
+
+	for (i=0; i<len; i+=4, dst+=3) {
+		a = b64dec[src[i]];
+		b = b64dec[src[i+1]];
+		c = b64dec[src[i+2]];
+		d = b64dec[src[i+3]];
+		if ((a | b | c | d) < 0) {
+			for (j=0; b64dec[src[i+j]] >= 0; j++);
+			tmx_err(ctx, E_BDATA, "Base64: invalid char '%c' in source", src[i+j]);
+			return 0;
+		}
+		v = ((unsigned long)a << 18) | ((unsigned long)b << 12) | ((unsigned long)c << 6) | (unsigned long)d;
+		dst[0] = (unsigned char)(v >> 16);
+		dst[1] = (unsigned char)(v >>  8);
+		dst[2] = (unsigned char)(v);
+	}
+	return 1;
+}
+
+/*
+	SIMD decoders
+	Each kernel decodes as many blocks as it can and returns the number of
+	characters consumed, ASCII is translated to 6 bits values with two
+	nibble-indexed lookup tables (validation) and a third one (offset),
+	see "Faster Base64 Encoding and Decoding Using AVX2 Instructions"
+	by Wojciech Muła and Daniel Lemire.
+*/
+
+#ifdef B64_X86
+
+/* in bytes: 00dddddd 00cccccc 00bbbbbb 00aaaaaa (a: first char) -> aaaaaabb bbbbcccc ccdddddd 00000000 */
+TARGET("ssse3")
+static __m128i b64_pack_ssse3(__m128i in) {
+	const __m128i ab_bc = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	const __m128i abc = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(abc, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+/* 16 characters -> 12 bytes, writes 16 bytes */
+TARGET("ssse3")
+static size_t b64_dec_ssse3(const unsigned char *src, size_t len, unsigned char *dst) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                     0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                     0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2F);
+	__m128i in, hi_nibbles, lo_nibbles, roll;
+	size_t i = 0;
+
+	/* 32: keeps the 4 extra bytes written and the padding out of reach */
+	for (; len - i >= 32; i += 16, dst += 12) {
+		in = _mm_loadu_si128((const __m128i*)(src + i));
+		hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+		lo_nibbles = _mm_and_si128(in, mask_2f);
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nibbles),
+		                                                   _mm_shuffle_epi8(lut_hi, hi_nibbles)),
+		                                     _mm_setzero_si128()))) {
+			break;
+		}
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		_mm_storeu_si128((__m128i*)dst, b64_pack_ssse3(_mm_add_epi8(in, roll)));
+	}
+	return i;
+}
+
+/* 32 characters -> 24 bytes, writes 32 bytes */
+TARGET("avx2")
+static size_t b64_dec_avx2(const unsigned char *src, size_t len, unsigned char *dst) {
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+	                                        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	                                        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                          0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+	const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+	                                      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	__m256i in, hi_nibbles, lo_nibbles, roll, out;
+	size_t i = 0;
+
+	/* 48: keeps the 8 extra bytes written and the padding out of reach */
+	for (; len - i >= 48; i += 32, dst += 24) {
+		in = _mm256_loadu_si256((const __m256i*)(src + i));
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+		lo_nibbles = _mm256_and_si256(in, mask_2f);
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles), _mm256_shuffle_epi8(lut_hi, hi_nibbles))) {
+			break;
+		}
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+		out = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+		out = _mm256_shuffle_epi8(out, shuf);
+		out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((__m256i*)dst, out);
+	}
+	return i;
+}
+
+enum b64_isa {ISA_NONE, ISA_SSSE3, ISA_AVX2};
+
+static enum b64_isa b64_detect(void) {
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] >= 7) {
+		__cpuidex(regs, 7, 0);
+		if (regs[1] & (1 << 5)) { /* AVX2, usable if the OS saves the YMM registers */
+			__cpuid(regs, 1);
+			if ((regs[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) return ISA_AVX2;
+		}
+	}
+	__cpuid(regs, 1);
+	if (regs[2] & (1 << 9)) return ISA_SSSE3;
+	return ISA_NONE;
+#elif defined(__GNUC__) || defined(__clang__)
+	if (__builtin_cpu_supports("avx2")) return ISA_AVX2;
+	if (__builtin_cpu_supports("ssse3")) return ISA_SSSE3;
+	return ISA_NONE;
+#else
+	return ISA_NONE;
+#endif
+}
+
+#endif /* B64_X86 */
+
+#ifdef B64_NEON
+
+/* translates ASCII to 6 bits values, returns 0 if `*v` contains an unhandled character */
+static int b64_translate_neon(uint8x16_t *v) {
+	static const uint8_t lo[16] = {0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+	                               0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A};
+	static const uint8_t hi[16] = {0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+	                               0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10};
+	static const uint8_t roll[16] = {0, 16, 19, 4, 191, 191, 185, 185, 0, 0, 0, 0, 0, 0, 0, 0};
+	const uint8x16_t hi_nibbles = vshrq_n_u8(*v, 4);
+	const uint8x16_t lo_nibbles = vandq_u8(*v, vdupq_n_u8(0x0F));
+
+	if (vmaxvq_u8(vandq_u8(vqtbl1q_u8(vld1q_u8(lo), lo_nibbles), vqtbl1q_u8(vld1q_u8(hi), hi_nibbles)))) {
+		return 0;
+	}
+	*v = vaddq_u8(*v, vqtbl1q_u8(vld1q_u8(roll), vaddq_u8(vceqq_u8(*v, vdupq_n_u8('/')), hi_nibbles)));
+	return 1;
+}
+
+/* 64 characters -> 48 bytes, vld4 deinterleaves the 4 characters of each group */
+static size_t b64_dec_neon(const unsigned char *src, size_t len, unsigned char *dst) {
+	uint8x16x4_t in;
+	uint8x16x3_t out;
+	size_t i = 0;
+
+	/* 68: keeps the padding out of reach */
+	for (; len - i >= 68; i += 64, dst += 48) {
+		in = vld4q_u8(src + i);
+		if (!b64_translate_neon(in.val) || !b64_translate_neon(in.val+1) ||
+		    !b64_translate_neon(in.val+2) || !b64_translate_neon(in.val+3)) {
+			break;
+		}
+		out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+		out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+		out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+		vst3q_u8(dst, out);
+	}
+	return i;
+}
+
+#endif /* B64_NEON */
+
+/* decodes `len` characters (multiple of 4) into (len/4)*3 bytes, padding included */
+int b64_decode_into(tmx_loader *ctx, const char *source, size_t len, char *dest) {
+	const unsigned char *src = (const unsigned char*)source;
+	unsigned char *dst = (unsigned char*)dest;
+	size_t done = 0;
+
+	if (len%4) {
+		tmx_err(ctx, E_BDATA, "Base64: invalid source");
+		return 0;
+	}
+
+#if defined(B64_X86)
+	switch (b64_detect()) {
+		case ISA_AVX2:  done = b64_dec_avx2(src, len, dst); /* and finishes with SSSE3 */
+		                done += b64_dec_ssse3(src+done, len-done, dst+(done/4)*3); break;
+		case ISA_SSSE3: done = b64_dec_ssse3(src, len, dst); break;
+		default: break;
+	}
+#elif defined(B64_NEON)
+	done = b64_dec_neon(src, len, dst);
+#endif
+
+	return b64_dec_scalar(ctx, src+done, len-done, dst+(done/4)*3);
+}
+
+char* b64_decode(tmx_loader *ctx, const char *source, unsigned int *rlength) { /* NULL terminated string */
+	char *res;
+	unsigned int src_len;
+
+	if (!source) {
+		tmx_err(ctx, E_INVAL, "Base64: invalid argument: source is NULL");
+		return NULL;
+	}
+
+	src_len = (unsigned int)(strlen(source));
+	if (src_len%4) {
+		tmx_err(ctx, E_BDATA, "Base64: invalid source");
+		return NULL; /* invalid source */
+	}
+
+	*rlength = (src_len/4)*3;
+	res = (char*) ctx->alloc_func(NULL, *rlength);
+	if (!res) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+
+	if (!b64_decode_into(ctx, source, src_len, res)) {
+		ctx->free_func(res);
+		return NULL;
+	}
+
+	if (src_len >= 1 && source[src_len-1] == '=') {
+		(*rlength)--;
+	}
+	if (src_len >= 2 && source[src_len-2] == '=') {
+		(*rlength)--;
+	}
+
+	return res;
+}
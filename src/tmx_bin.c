@@ -0,0 +1,669 @@
+/*
+	Compiled maps
+
+	tmx_compile writes the data structure of a map in a single flat image:
+	every node is copied as is, its pointers replaced by the offset of the
+	pointed node from the start of the image (0 is NULL, the header is at 0).
+	tmx_load_compiled copies the image in a block of a new arena and turns
+	the offsets back into pointers, then the images are loaded and the
+	derived structures (map->tile_dirs) are built as for a parsed map.
+
+	The image is bound to the ABI of the library that wrote it (pointer size,
+	byte order, layout of the structures), the header records these and the
+	loader rejects files written by a different build.
+	Offsets are bounds-checked, but the content of the nodes is trusted.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define BIN_MAGIC "TMXBIN\r\n"
+#define BIN_VERSION 2
+#define BIN_ALIGN 8
+#define BIN_ROUND(s) (((s) + (BIN_ALIGN-1)) & ~(size_t)(BIN_ALIGN-1))
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order; /* 0x01020304 written in the native byte order */
+	uint32_t abi[12];    /* pointer size and sizes of the structures */
+	uint64_t size;       /* of the whole image */
+	uint64_t map;        /* offset of the tmx_map */
+} bin_header;
+
+static void bin_abi(uint32_t abi[12]) {
+	memset(abi, 0, 12 * sizeof(uint32_t));
+	abi[0] = sizeof(void*);
+	abi[1] = sizeof(tmx_map);
+	abi[2] = sizeof(tmx_tileset_list);
+	abi[3] = sizeof(tmx_tileset);
+	abi[4] = sizeof(tmx_tile);
+	abi[5] = sizeof(tmx_anim_frame);
+	abi[6] = sizeof(tmx_image);
+	abi[7] = sizeof(tmx_layer);
+	abi[8] = sizeof(tmx_object_group);
+	abi[9] = sizeof(tmx_object);
+	abi[10] = sizeof(tmx_property) | sizeof(tmx_properties) << 16;
+	abi[11] = sizeof(tmx_layer_chunks) | sizeof(lazy_data) << 16;
+}
+
+/*
+	Writer
+*/
+
+typedef struct {
+	tmx_loader *ctx;
+	char *buf;
+	size_t len, cap;
+	int failed;
+	/* offsets of the strings already written, each string is written once */
+	size_t *strs;
+	unsigned int strs_mask, strs_count;
+} bin_writer;
+
+#define AT(w, type, off) ((type*)((w)->buf + (off)))
+#define OFF(type, off) ((type*)(uintptr_t)(off))
+
+/* reserves `len` zeroed bytes, returns their offset or 0 on failure */
+static size_t w_reserve(bin_writer *w, size_t len) {
+	size_t res = w->len, cap;
+	char *tmp;
+
+	if (w->failed) return 0;
+	len = BIN_ROUND(len);
+	if (w->len + len > w->cap) {
+		cap = w->cap? w->cap: 64 * 1024;
+		while (cap < w->len + len) cap *= 2;
+		if (!(tmp = (char*)w->ctx->alloc_func(w->buf, cap))) {
+			w->ctx->err = E_ALLOC;
+			w->failed = 1;
+			return 0;
+		}
+		w->buf = tmp;
+		w->cap = cap;
+	}
+	memset(w->buf + res, 0, len);
+	w->len += len;
+	return res;
+}
+
+static size_t w_data(bin_writer *w, const void *data, size_t len) {
+	size_t res;
+	if (!data || !(res = w_reserve(w, len))) return 0;
+	memcpy(w->buf + res, data, len);
+	return res;
+}
+
+static unsigned int w_str_slot(const bin_writer *w, size_t *table, unsigned int mask, const char *str) {
+	unsigned int i = str_hash(str) & mask;
+	while (table[i] && strcmp(w->buf + table[i], str)) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+/* equal strings share their offset, interned strings stay interned in the loaded map */
+static size_t w_str(bin_writer *w, const char *str) {
+	unsigned int mask, i, slot;
+	size_t *table;
+
+	if (!str || w->failed) return 0;
+	if ((w->strs_count + 1) * 2 > (w->strs? w->strs_mask + 1: 0)) {
+		mask = w->strs? w->strs_mask * 2 + 1: 1023;
+		if (!(table = (size_t*)w->ctx->alloc_func(NULL, ((size_t)mask + 1) * sizeof(size_t)))) {
+			w->ctx->err = E_ALLOC;
+			w->failed = 1;
+			return 0;
+		}
+		memset(table, 0, ((size_t)mask + 1) * sizeof(size_t));
+		for (i=0; w->strs && i<=w->strs_mask; i++) {
+			if (w->strs[i]) table[w_str_slot(w, table, mask, w->buf + w->strs[i])] = w->strs[i];
+		}
+		w->ctx->free_func(w->strs);
+		w->strs = table;
+		w->strs_mask = mask;
+	}
+	slot = w_str_slot(w, w->strs, w->strs_mask, str);
+	if (!w->strs[slot]) {
+		w->strs[slot] = w_data(w, str, strlen(str) + 1);
+		w->strs_count++;
+	}
+	return w->strs[slot];
+}
+
+/* the properties are written one after the other, the table is rebuilt with their offsets */
+static size_t w_props(bin_writer *w, const tmx_properties *props) {
+	tmx_properties node;
+	tmx_property prop;
+	const tmx_property *p;
+	size_t res, off, next, table;
+	unsigned int slot;
+
+	if (!props || !(res = w_reserve(w, sizeof(tmx_properties)))) return 0;
+	node = *props;
+	table = props->table? w_reserve(w, ((size_t)props->table_mask + 1) * sizeof(tmx_property*)): 0;
+	node.table = OFF(tmx_property*, table);
+	off = props->head? w_reserve(w, sizeof(tmx_property)): 0;
+	node.head = OFF(tmx_property, off);
+	for (p = props->head; p && !w->failed; p = p->next) {
+		prop = *p;
+		prop.name = OFF(char, w_str(w, p->name));
+		prop.value = OFF(char, w_str(w, p->value));
+		next = p->next? w_reserve(w, sizeof(tmx_property)): 0;
+		prop.next = OFF(tmx_property, next);
+		if (!w->failed) {
+			*AT(w, tmx_property, off) = prop;
+			slot = props_slot(props, p->name);
+			if (table && props->table[slot] == p) {
+				AT(w, tmx_property*, table)[slot] = OFF(tmx_property, off);
+			}
+		}
+		off = next;
+	}
+	if (!w->failed) *AT(w, tmx_properties, res) = node;
+	return res;
+}
+
+static size_t w_image(bin_writer *w, const tmx_image *img) {
+	tmx_image node;
+	size_t res;
+
+	if (!img || !(res = w_reserve(w, sizeof(tmx_image)))) return 0;
+	node = *img;
+	node.source = OFF(char, w_str(w, img->source));
+	node.resource_image = NULL; /* loaded by tmx_load_compiled */
+	if (!w->failed) *AT(w, tmx_image, res) = node;
+	return res;
+}
+
+/* iterative, object lists can be long */
+static size_t w_objects(bin_writer *w, const tmx_object *o) {
+	tmx_object node;
+	size_t res, off, next, pts, arr;
+	int i;
+
+	if (!o || !(res = w_reserve(w, sizeof(tmx_object)))) return 0;
+	for (off = res; o && !w->failed; o = o->next, off = next) {
+		node = *o;
+		node.name = OFF(char, w_str(w, o->name));
+		node.type = OFF(char, w_str(w, o->type));
+		node.properties = OFF(tmx_properties, w_props(w, o->properties));
+		node.points = NULL;
+		if (o->points && o->points_len > 0) { /* points[i] point in a single array of coordinates */
+			pts = w_data(w, o->points[0], o->points_len * 2 * sizeof(double));
+			if ((arr = w_reserve(w, o->points_len * sizeof(double*)))) {
+				for (i=0; i<o->points_len; i++) {
+					AT(w, double*, arr)[i] = OFF(double, pts + i * 2 * sizeof(double));
+				}
+			}
+			node.points = OFF(double*, arr);
+		}
+		next = o->next? w_reserve(w, sizeof(tmx_object)): 0;
+		node.next = OFF(tmx_object, next);
+		if (!w->failed) *AT(w, tmx_object, off) = node;
+	}
+	return res;
+}
+
+static size_t w_objgr(bin_writer *w, const tmx_object_group *g) {
+	tmx_object_group node;
+	size_t res;
+
+	if (!g || !(res = w_reserve(w, sizeof(tmx_object_group)))) return 0;
+	node = *g;
+	node.head = OFF(tmx_object, w_objects(w, g->head));
+	node.index = NULL; /* built by the loader or on demand */
+	node.arrays = NULL; /* see TMX_LOAD_OBJECT_ARRAYS */
+	node.alloc_func = NULL; /* set by the loader */
+	node.free_func = NULL;
+	if (!w->failed) *AT(w, tmx_object_group, res) = node;
+	return res;
+}
+
+static size_t w_chunks(bin_writer *w, const tmx_layer_chunks *c) {
+	tmx_layer_chunks node;
+	size_t res, arr = 0, len, i;
+
+	if (!c || !(res = w_reserve(w, sizeof(tmx_layer_chunks)))) return 0;
+	node = *c;
+	len = (size_t)c->cols * c->rows;
+	if (c->chunks && len && (arr = w_reserve(w, len * sizeof(int32_t*)))) {
+		for (i=0; i<len && !w->failed; i++) {
+			AT(w, int32_t*, arr)[i] = OFF(int32_t, w_data(w, c->chunks[i], TMX_CHUNK_SIZE * TMX_CHUNK_SIZE * sizeof(int32_t)));
+		}
+	}
+	node.chunks = OFF(int32_t*, arr);
+	if (!w->failed) *AT(w, tmx_layer_chunks, res) = node;
+	return res;
+}
+
+/* lazy layers stay lazy, their decoded data is not saved */
+static size_t w_lazy(bin_writer *w, const lazy_data *lz) {
+	lazy_data node;
+	size_t res;
+
+	if (!lz || !(res = w_reserve(w, sizeof(lazy_data)))) return 0;
+	node = *lz;
+	node.alloc_func = NULL; /* set by the loader */
+	node.free_func = NULL;
+	node.text = OFF(char, w_data(w, lz->text, lz->len + 1));
+	node.own_text = 0; /* in the image of the map */
+	if (!w->failed) *AT(w, lazy_data, res) = node;
+	return res;
+}
+
+static size_t w_layers(bin_writer *w, const tmx_layer *l) {
+	tmx_layer node;
+	size_t res;
+
+	if (!l || !(res = w_reserve(w, sizeof(tmx_layer)))) return 0;
+	node = *l;
+	node.name = OFF(char, w_str(w, l->name));
+	if (l->type == L_LAYER && l->lazy) {
+		node.content.gids = NULL;
+		node.chunks = NULL;
+		node.lazy = OFF(lazy_data, w_lazy(w, l->lazy));
+	} else if (l->type == L_LAYER) {
+		node.content.gids = OFF(int32_t, w_data(w, l->content.gids, (size_t)l->width * l->height * sizeof(int32_t)));
+		node.chunks = OFF(tmx_layer_chunks, w_chunks(w, l->chunks));
+	} else if (l->type == L_OBJGR) {
+		node.content.objgr = OFF(tmx_object_group, w_objgr(w, l->content.objgr));
+	} else if (l->type == L_IMAGE) {
+		node.content.image = OFF(tmx_image, w_image(w, l->content.image));
+	}
+	node.planes = NULL; /* see TMX_LOAD_TILE_PLANES */
+	memset(&(node.user_data), 0, sizeof(tmx_user_data));
+	node.properties = OFF(tmx_properties, w_props(w, l->properties));
+	node.next = OFF(tmx_layer, w_layers(w, l->next));
+	if (!w->failed) *AT(w, tmx_layer, res) = node;
+	return res;
+}
+
+static size_t w_tileset(bin_writer *w, const tmx_tileset *ts) {
+	tmx_tileset node;
+	tmx_tile tile;
+	size_t res, tiles = 0;
+	unsigned int i;
+
+	if (!ts || !(res = w_reserve(w, sizeof(tmx_tileset)))) return 0;
+	node = *ts;
+	node.name = OFF(char, w_str(w, ts->name));
+	node.image = OFF(tmx_image, w_image(w, ts->image));
+	memset(&(node.user_data), 0, sizeof(tmx_user_data));
+	node.properties = OFF(tmx_properties, w_props(w, ts->properties));
+	if (ts->tiles && ts->tilecount) {
+		tiles = w_reserve(w, ts->tilecount * sizeof(tmx_tile));
+		for (i=0; i<ts->tilecount && !w->failed; i++) {
+			tile = ts->tiles[i];
+			tile.tileset = OFF(tmx_tileset, res);
+			tile.image = OFF(tmx_image, w_image(w, tile.image));
+			tile.collision = OFF(tmx_object, w_objects(w, tile.collision));
+			tile.animation = OFF(tmx_anim_frame, w_data(w, tile.animation, tile.animation_len * sizeof(tmx_anim_frame)));
+			tile.properties = OFF(tmx_properties, w_props(w, tile.properties));
+			memset(&(tile.user_data), 0, sizeof(tmx_user_data));
+			if (!w->failed) AT(w, tmx_tile, tiles)[i] = tile;
+		}
+	}
+	node.tiles = OFF(tmx_tile, tiles);
+	if (!w->failed) *AT(w, tmx_tileset, res) = node;
+	return res;
+}
+
+static size_t w_ts_list(bin_writer *w, const tmx_tileset_list *tsl) {
+	tmx_tileset_list node;
+	size_t res;
+
+	if (!tsl || !(res = w_reserve(w, sizeof(tmx_tileset_list)))) return 0;
+	node = *tsl;
+	node.source = OFF(char, w_str(w, tsl->source));
+	node.tileset = OFF(tmx_tileset, w_tileset(w, tsl->tileset));
+	node.cache_ref = NULL; /* compiled maps have their own copy of the tilesets */
+	node.next = OFF(tmx_tileset_list, w_ts_list(w, tsl->next));
+	if (!w->failed) *AT(w, tmx_tileset_list, res) = node;
+	return res;
+}
+
+static size_t w_map(bin_writer *w, const tmx_map *map) {
+	tmx_map node;
+	size_t res;
+
+	if (!(res = w_reserve(w, sizeof(tmx_map)))) return 0;
+	node = *map;
+	node.properties = OFF(tmx_properties, w_props(w, map->properties));
+	node.ts_head = OFF(tmx_tileset_list, w_ts_list(w, map->ts_head));
+	node.ly_head = OFF(tmx_layer, w_layers(w, map->ly_head));
+	node.tilecount = 0;
+	node.dir_count = 0;
+	node.tile_dirs = NULL; /* rebuilt by the loader */
+	node.anim_count = 0;
+	node.anim_gids = NULL;
+	memset(&(node.user_data), 0, sizeof(tmx_user_data));
+	node.alloc_func = NULL;
+	node.free_func = NULL;
+	node.img_free_func = NULL;
+	node.arena = NULL;
+	node.images = NULL;
+	node.strings = NULL;
+	if (!w->failed) *AT(w, tmx_map, res) = node;
+	return res;
+}
+
+int compile_map(tmx_loader *ctx, const tmx_map *map, const char *path) {
+	bin_writer w;
+	bin_header header;
+	size_t map_off;
+	FILE *file;
+	int ret;
+
+	memset(&w, 0, sizeof(bin_writer));
+	w.ctx = ctx;
+
+	w_reserve(&w, sizeof(bin_header));
+	map_off = w_map(&w, map);
+	ctx->free_func(w.strs);
+	if (w.failed) {
+		ctx->free_func(w.buf);
+		return 0;
+	}
+
+	memset(&header, 0, sizeof(bin_header));
+	memcpy(header.magic, BIN_MAGIC, 8);
+	header.version = BIN_VERSION;
+	header.byte_order = 0x01020304;
+	bin_abi(header.abi);
+	header.size = w.len;
+	header.map = map_off;
+	memcpy(w.buf, &header, sizeof(bin_header));
+
+	if (!(file = fopen(path, "wb"))) {
+		tmx_err(ctx, errno == EACCES? E_ACCESS: E_UNKN, "tmx_compile: cannot open %s: %s", path, strerror(errno));
+		ctx->free_func(w.buf);
+		return 0;
+	}
+	ret = fwrite(w.buf, 1, w.len, file) == w.len;
+	ret = (fclose(file) == 0) && ret;
+	if (!ret) {
+		tmx_err(ctx, E_UNKN, "tmx_compile: cannot write %s", path);
+	}
+	ctx->free_func(w.buf);
+	return ret;
+}
+
+/*
+	Loader
+*/
+
+typedef struct {
+	tmx_loader *ctx;
+	char *base;
+	size_t size;
+	const char *path; /* the images are relative to this file */
+	int failed;
+} bin_reader;
+
+/* turns an offset into a pointer to `len` bytes in the image */
+static void* r_ptr(bin_reader *r, const void *off_ptr, size_t len) {
+	uintptr_t off = (uintptr_t)off_ptr;
+	if (!off) return NULL;
+	if (off >= r->size || r->size - off < len || off % BIN_ALIGN) {
+		r->failed = 1;
+		return NULL;
+	}
+	return r->base + off;
+}
+
+static char* r_str(bin_reader *r, const char *off_ptr) {
+	char *res = (char*)r_ptr(r, off_ptr, 1);
+	if (res && !memchr(res, '\0', r->size - (size_t)(res - r->base))) {
+		r->failed = 1;
+		return NULL;
+	}
+	return res;
+}
+
+#define RELOC(r, ptr) ((ptr) = r_ptr((r), (ptr), sizeof(*(ptr))))
+#define RELOC_ARRAY(r, ptr, count) ((ptr) = r_ptr((r), (ptr), (count) * sizeof(*(ptr))))
+#define RELOC_STR(r, ptr) ((ptr) = r_str((r), (ptr)))
+
+static void r_props(bin_reader *r, tmx_properties *props) {
+	tmx_property *p;
+	unsigned int i;
+
+	if (!props) return;
+	RELOC(r, props->head);
+	RELOC_ARRAY(r, props->table, (size_t)props->table_mask + 1);
+	for (i = 0; props->table && !r->failed && i <= props->table_mask; i++) {
+		RELOC(r, props->table[i]);
+	}
+	for (p = props->head; p && !r->failed; p = p->next) {
+		RELOC_STR(r, p->name);
+		RELOC_STR(r, p->value);
+		RELOC(r, p->next);
+	}
+}
+
+static void r_image(bin_reader *r, tmx_image *img) {
+	if (img) {
+		RELOC_STR(r, img->source);
+		img->resource_image = NULL;
+		if (!r->failed && img->source && !load_image(r->ctx, &(img->resource_image), r->path, img->source)) {
+			tmx_err(r->ctx, E_UNKN, "tmx_load_compiled: an error occured in the delegated image loading function");
+			r->failed = 1;
+		}
+	}
+}
+
+static void r_objects(bin_reader *r, tmx_object *o) {
+	int i;
+	for (; o && !r->failed; o = o->next) {
+		RELOC_STR(r, o->name);
+		RELOC_STR(r, o->type);
+		RELOC(r, o->properties);
+		r_props(r, o->properties);
+		if (o->points_len < 0) r->failed = 1;
+		else if (RELOC_ARRAY(r, o->points, o->points_len)) {
+			for (i=0; i<o->points_len; i++) {
+				RELOC_ARRAY(r, o->points[i], 2);
+			}
+		}
+		RELOC(r, o->next);
+	}
+}
+
+static void r_chunks(bin_reader *r, tmx_layer *l) {
+	tmx_layer_chunks *c = l->chunks;
+	size_t i, len;
+
+	if (c->cols != (l->width + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE ||
+	    c->rows != (l->height + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE) {
+		r->failed = 1;
+		return;
+	}
+	len = (size_t)c->cols * c->rows;
+	if (!RELOC_ARRAY(r, c->chunks, len) && len) {
+		r->failed = 1;
+		return;
+	}
+	for (i=0; i<len && !r->failed; i++) {
+		RELOC_ARRAY(r, c->chunks[i], TMX_CHUNK_SIZE * TMX_CHUNK_SIZE);
+	}
+}
+
+static void r_lazy(bin_reader *r, lazy_data *lz) {
+	if ((lz->type != CSV && lz->type != B64Z) || !RELOC_ARRAY(r, lz->text, lz->len + 1) || lz->text[lz->len]) {
+		r->failed = 1;
+		return;
+	}
+	lz->alloc_func = r->ctx->alloc_func;
+	lz->free_func = r->ctx->free_func;
+	lz->own_text = 0;
+}
+
+static void r_layers(bin_reader *r, tmx_layer *l) {
+	for (; l && !r->failed; l = l->next) {
+		RELOC_STR(r, l->name);
+		l->planes = NULL;
+		if (l->type == L_LAYER) {
+			RELOC_ARRAY(r, l->content.gids, (size_t)l->width * l->height);
+			if (RELOC(r, l->chunks)) r_chunks(r, l);
+			if (RELOC(r, l->lazy)) {
+				if (l->content.gids || l->chunks) r->failed = 1;
+				else r_lazy(r, l->lazy);
+			}
+		} else {
+			l->chunks = NULL;
+			l->lazy = NULL;
+		}
+		if (l->type == L_OBJGR) {
+			if (RELOC(r, l->content.objgr)) {
+				RELOC(r, l->content.objgr->head);
+				l->content.objgr->index = NULL;
+				l->content.objgr->arrays = NULL;
+				l->content.objgr->alloc_func = r->ctx->alloc_func;
+				l->content.objgr->free_func = r->ctx->free_func;
+				r_objects(r, l->content.objgr->head);
+			}
+		} else if (l->type == L_IMAGE) {
+			RELOC(r, l->content.image);
+			r_image(r, l->content.image);
+		}
+		RELOC(r, l->properties);
+		r_props(r, l->properties);
+		RELOC(r, l->next);
+	}
+}
+
+static void r_tileset(bin_reader *r, tmx_tileset *ts) {
+	unsigned int i;
+	tmx_tile *t;
+
+	RELOC_STR(r, ts->name);
+	RELOC(r, ts->image);
+	r_image(r, ts->image);
+	RELOC(r, ts->properties);
+	r_props(r, ts->properties);
+	RELOC_ARRAY(r, ts->tiles, ts->tilecount);
+	for (i=0; ts->tiles && i<ts->tilecount && !r->failed; i++) {
+		t = ts->tiles + i;
+		t->tileset = ts;
+		RELOC(r, t->image);
+		r_image(r, t->image);
+		RELOC(r, t->collision);
+		r_objects(r, t->collision);
+		RELOC_ARRAY(r, t->animation, t->animation_len);
+		RELOC(r, t->properties);
+		r_props(r, t->properties);
+	}
+}
+
+static tmx_map* r_map(bin_reader *r, tmx_map *map) {
+	tmx_tileset_list *tsl;
+	const char *map_path = r->path;
+	char *ts_path;
+
+	RELOC(r, map->properties);
+	r_props(r, map->properties);
+	RELOC(r, map->ts_head);
+	for (tsl = map->ts_head; tsl && !r->failed; tsl = tsl->next) {
+		RELOC_STR(r, tsl->source);
+		tsl->cache_ref = NULL;
+		if (!RELOC(r, tsl->tileset)) {
+			r->failed = 1;
+		} else if (tsl->source) { /* the images of an external tileset are relative to its tsx file */
+			if (!(ts_path = mk_absolute_path(r->ctx, map_path, tsl->source))) {
+				r->failed = 1;
+			} else {
+				r->path = ts_path;
+				r_tileset(r, tsl->tileset);
+				r->path = map_path;
+				r->ctx->free_func(ts_path);
+			}
+		} else {
+			r_tileset(r, tsl->tileset);
+		}
+		RELOC(r, tsl->next);
+	}
+	RELOC(r, map->ly_head);
+	r_layers(r, map->ly_head);
+	return map;
+}
+
+static int check_header(tmx_loader *ctx, const mapped_file *mf, const char *path, bin_header *header) {
+	uint32_t abi[12];
+
+	if (mf->len < sizeof(bin_header)) {
+		tmx_err(ctx, E_FORMAT, "%s: not a compiled map", path);
+		return 0;
+	}
+	memcpy(header, mf->data, sizeof(bin_header));
+	if (memcmp(header->magic, BIN_MAGIC, 8)) {
+		tmx_err(ctx, E_FORMAT, "%s: not a compiled map", path);
+		return 0;
+	}
+	bin_abi(abi);
+	if (header->version != BIN_VERSION || header->byte_order != 0x01020304 || memcmp(header->abi, abi, sizeof(abi))) {
+		tmx_err(ctx, E_FORMAT, "%s: map compiled by an incompatible version or build of the library", path);
+		return 0;
+	}
+	if (header->size != mf->len || header->map % BIN_ALIGN || header->map < sizeof(bin_header) ||
+	    header->map > header->size - sizeof(tmx_map)) {
+		tmx_err(ctx, E_FORMAT, "%s: truncated or corrupted compiled map", path);
+		return 0;
+	}
+	return 1;
+}
+
+/* the map is returned before finish_map */
+tmx_map* load_compiled(tmx_loader *ctx, const char *path) {
+	mapped_file mf;
+	bin_header header;
+	bin_reader r;
+	tmx_arena *arena;
+	tmx_map *map;
+
+	if (!map_file(ctx, path, &mf)) return NULL;
+	if (!check_header(ctx, &mf, path, &header) || !(arena = arena_create(ctx))) {
+		unmap_file(&mf);
+		return NULL;
+	}
+
+	/* the whole image in a single block of the map's arena */
+	memset(&r, 0, sizeof(bin_reader));
+	r.ctx = ctx;
+	r.size = mf.len;
+	r.path = path;
+	if (!(r.base = (char*)arena_alloc(ctx, arena, mf.len))) {
+		arena_free(arena, ctx->free_func);
+		unmap_file(&mf);
+		return NULL;
+	}
+	memcpy(r.base, mf.data, mf.len);
+	unmap_file(&mf);
+
+	map = (tmx_map*)(r.base + header.map);
+	map->arena = arena;
+	map->alloc_func = ctx->alloc_func;
+	map->free_func = ctx->free_func;
+	map->img_free_func = ctx->img_free_func;
+	map->images = NULL;
+	map->strings = NULL;
+	map->tile_dirs = NULL;
+	ctx->arena = arena;
+	ctx->images = &(map->images);
+
+	r_map(&r, map);
+	if (r.failed) {
+		if (ctx->err == E_NONE) tmx_err(ctx, E_FORMAT, "%s: corrupted compiled map", path);
+		image_res_free(map->images, NULL, map->img_free_func);
+		arena_free(arena, ctx->free_func);
+		ctx->arena = NULL;
+		ctx->images = NULL;
+		return NULL;
+	}
+	return map;
+}
@@ -0,0 +1,439 @@
+/*
+	Tileset and image caches
+
+	Each entry of the tileset cache holds a tileset parsed from a tsx file,
+	allocated (with the entry and its key) in an arena of its own, and the
+	images it loaded.
+	Maps hold a reference on the entries they use. An entry is freed when it
+	is no longer referenced and either the cache is freed or the tsx file has
+	changed (different modification time or size).
+	The cache itself is freed when both its owner and all maps released it.
+
+	Images are loaded once per map (or cached tileset): the resources are
+	listed in the map, each record may hold a reference on an entry of the
+	image cache of the loader, which follows the same rules.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+struct _ts_cache_entry {
+	tmx_tileset_cache *cache;
+	char *path;
+	long long mtime;
+	size_t size;
+
+	unsigned int refs;
+	int listed; /* 0 once removed from the cache, freed with the last reference */
+
+	tmx_tileset *tileset;
+	tmx_arena *arena;
+	img_res *images;
+	void (*free_func) (void *address);
+	void (*img_free_func) (void *address);
+	ts_cache_entry *next;
+};
+
+struct _tmx_ts_cache {
+	tmx_mutex lock;
+	ts_cache_entry *head;
+	unsigned int refs; /* the owner + one per map reference */
+	void (*free_func) (void *address);
+};
+
+static void free_entry(ts_cache_entry *entry) {
+	image_res_free(entry->images, NULL, entry->img_free_func);
+	arena_free(entry->arena, entry->free_func);
+}
+
+static void free_cache(tmx_tileset_cache *cache) {
+	mutex_destroy(&(cache->lock));
+	cache->free_func(cache);
+}
+
+/* removes the entry from the list, the lock must be held */
+static void unlink_entry(tmx_tileset_cache *cache, ts_cache_entry *entry) {
+	ts_cache_entry **it;
+	for (it = &(cache->head); *it; it = &((*it)->next)) {
+		if (*it == entry) {
+			*it = entry->next;
+			break;
+		}
+	}
+	entry->next = NULL;
+	entry->listed = 0;
+}
+
+/* looks up `path`, drops the stale entry if the file has changed, the lock must be held */
+static ts_cache_entry* find_entry(tmx_tileset_cache *cache, const char *path, const mapped_file *mf, ts_cache_entry **stale) {
+	ts_cache_entry *entry;
+	*stale = NULL;
+	for (entry = cache->head; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path)) {
+			if (entry->mtime == mf->mtime && entry->size == mf->len) {
+				entry->refs++;
+				cache->refs++;
+				return entry;
+			}
+			unlink_entry(cache, entry);
+			if (entry->refs == 0) *stale = entry;
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+tmx_tileset_cache* tmx_tileset_cache_create(tmx_loader *ctx) {
+	tmx_tileset_cache *res;
+
+	if (!ctx) {
+		return NULL;
+	}
+	if (!ctx->alloc_func) ctx->alloc_func = realloc;
+	if (!ctx->free_func) ctx->free_func = free;
+
+	if (!(res = (tmx_tileset_cache*)ctx->alloc_func(NULL, sizeof(tmx_tileset_cache)))) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	memset(res, 0, sizeof(tmx_tileset_cache));
+	if (!mutex_init(&(res->lock))) {
+		tmx_err(ctx, E_UNKN, "tmx_tileset_cache_create: could not create a mutex");
+		ctx->free_func(res);
+		return NULL;
+	}
+	res->refs = 1;
+	res->free_func = ctx->free_func;
+	return res;
+}
+
+void tmx_tileset_cache_free(tmx_tileset_cache *cache) {
+	ts_cache_entry *entry, *next, *unused = NULL;
+	int last;
+
+	if (!cache) return;
+
+	mutex_lock(&(cache->lock));
+	for (entry = cache->head; entry; entry = next) {
+		next = entry->next;
+		entry->listed = 0;
+		if (entry->refs == 0) { /* frees it below, outside of the lock */
+			entry->next = unused;
+			unused = entry;
+		} else {
+			entry->next = NULL;
+		}
+	}
+	cache->head = NULL;
+	last = (--(cache->refs) == 0);
+	mutex_unlock(&(cache->lock));
+
+	for (entry = unused; entry; entry = next) {
+		next = entry->next;
+		free_entry(entry);
+	}
+	if (last) free_cache(cache);
+}
+
+ts_cache_entry* ts_cache_get(tmx_tileset_cache *cache, const char *path, const mapped_file *mf) {
+	ts_cache_entry *res, *stale;
+
+	mutex_lock(&(cache->lock));
+	res = find_entry(cache, path, mf, &stale);
+	mutex_unlock(&(cache->lock));
+
+	if (stale) free_entry(stale);
+	return res;
+}
+
+ts_cache_entry* ts_cache_put(tmx_loader *ctx, tmx_tileset_cache *cache, const char *path, const mapped_file *mf, tmx_tileset *ts, tmx_arena *arena, img_res *images) {
+	ts_cache_entry *res, *stale;
+	size_t path_len = strlen(path);
+
+	if (!(res = (ts_cache_entry*)arena_alloc(ctx, arena, sizeof(ts_cache_entry) + path_len + 1))) {
+		ts_cache_discard(ctx, arena, images);
+		return NULL;
+	}
+	memset(res, 0, sizeof(ts_cache_entry));
+	res->path = (char*)(res + 1);
+	memcpy(res->path, path, path_len + 1);
+	res->cache = cache;
+	res->mtime = mf->mtime;
+	res->size = mf->len;
+	res->tileset = ts;
+	res->arena = arena;
+	res->images = images;
+	res->free_func = ctx->free_func;
+	res->img_free_func = ctx->img_free_func;
+
+	mutex_lock(&(cache->lock));
+	/* another thread may have loaded the same file in the meantime */
+	if ((res->next = find_entry(cache, path, mf, &stale))) {
+		res = res->next;
+		mutex_unlock(&(cache->lock));
+		ts_cache_discard(ctx, arena, images);
+	} else {
+		res->refs = 1;
+		res->listed = 1;
+		res->next = cache->head;
+		cache->head = res;
+		cache->refs++;
+		mutex_unlock(&(cache->lock));
+	}
+
+	if (stale) free_entry(stale);
+	return res;
+}
+
+void ts_cache_release(ts_cache_entry *entry) {
+	tmx_tileset_cache *cache = entry->cache;
+	int unused, last;
+
+	mutex_lock(&(cache->lock));
+	unused = (--(entry->refs) == 0 && !entry->listed);
+	last = (--(cache->refs) == 0);
+	mutex_unlock(&(cache->lock));
+
+	if (unused) free_entry(entry);
+	if (last) free_cache(cache);
+}
+
+tmx_tileset* ts_cache_tileset(ts_cache_entry *entry) {
+	return entry->tileset;
+}
+
+void ts_cache_discard(tmx_loader *ctx, tmx_arena *arena, img_res *images) {
+	image_res_free(images, NULL, ctx->img_free_func);
+	arena_free(arena, ctx->free_func);
+}
+
+/*
+	Image resources
+*/
+
+typedef struct _img_cache_entry img_cache_entry;
+
+struct _tmx_img_res {
+	unsigned long hash;
+	char *path;
+	void *resource;
+	img_cache_entry *shared; /* NULL if the map loaded the image itself */
+	img_res *next;
+};
+
+struct _img_cache_entry {
+	tmx_image_cache *cache;
+	unsigned long hash;
+	char *path;
+	void *resource;
+
+	unsigned int refs;
+	int listed; /* 0 once removed from the cache, freed with the last reference */
+
+	void (*free_func) (void *address);
+	void (*img_free_func) (void *address);
+	img_cache_entry *next;
+};
+
+struct _tmx_img_cache {
+	tmx_mutex lock;
+	img_cache_entry *head;
+	unsigned int refs; /* the owner + one per map reference */
+	void (*free_func) (void *address);
+};
+
+/* FNV-1a, compared before the paths */
+static unsigned long path_hash(const char *path) {
+	unsigned long h = 2166136261UL;
+	while (*path) {
+		h = ((h ^ (unsigned char)*path++) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+static void free_img_entry(img_cache_entry *entry) {
+	if (entry->img_free_func) {
+		entry->img_free_func(entry->resource);
+	}
+	entry->free_func(entry);
+}
+
+static void free_img_cache(tmx_image_cache *cache) {
+	mutex_destroy(&(cache->lock));
+	cache->free_func(cache);
+}
+
+static void release_img_entry(img_cache_entry *entry) {
+	tmx_image_cache *cache = entry->cache;
+	int unused, last;
+
+	mutex_lock(&(cache->lock));
+	unused = (--(entry->refs) == 0 && !entry->listed);
+	last = (--(cache->refs) == 0);
+	mutex_unlock(&(cache->lock));
+
+	if (unused) free_img_entry(entry);
+	if (last) free_img_cache(cache);
+}
+
+/* looks up `path` and references the entry, the lock must be held */
+static img_cache_entry* find_img_entry(tmx_image_cache *cache, const char *path, unsigned long hash) {
+	img_cache_entry *entry;
+	for (entry = cache->head; entry; entry = entry->next) {
+		if (entry->hash == hash && !strcmp(entry->path, path)) {
+			entry->refs++;
+			cache->refs++;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* gets the image from the loader's cache, or loads it and adds it to the cache */
+static img_cache_entry* shared_image(tmx_loader *ctx, tmx_image_cache *cache, const char *path, unsigned long hash) {
+	img_cache_entry *res, *found;
+	size_t path_len;
+
+	mutex_lock(&(cache->lock));
+	res = find_img_entry(cache, path, hash);
+	mutex_unlock(&(cache->lock));
+	if (res) return res;
+
+	path_len = strlen(path);
+	if (!(res = (img_cache_entry*)ctx->alloc_func(NULL, sizeof(img_cache_entry) + path_len + 1))) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	memset(res, 0, sizeof(img_cache_entry));
+	res->path = (char*)(res + 1);
+	memcpy(res->path, path, path_len + 1);
+	res->cache = cache;
+	res->hash = hash;
+	res->free_func = ctx->free_func;
+	res->img_free_func = ctx->img_free_func;
+	if (!(res->resource = ctx->img_load_func(path))) {
+		ctx->free_func(res);
+		return NULL;
+	}
+
+	mutex_lock(&(cache->lock));
+	/* another thread may have loaded the same file in the meantime */
+	if ((found = find_img_entry(cache, path, hash))) {
+		mutex_unlock(&(cache->lock));
+		free_img_entry(res);
+		return found;
+	}
+	res->refs = 1;
+	res->listed = 1;
+	res->next = cache->head;
+	cache->head = res;
+	cache->refs++;
+	mutex_unlock(&(cache->lock));
+	return res;
+}
+
+void* image_res_load(tmx_loader *ctx, const char *path) {
+	img_res *res;
+	unsigned long hash = path_hash(path);
+	size_t path_len;
+
+	for (res = *(ctx->images); res; res = res->next) {
+		if (res->hash == hash && !strcmp(res->path, path)) {
+			return res->resource;
+		}
+	}
+
+	path_len = strlen(path);
+	if (!(res = (img_res*)map_alloc(ctx, sizeof(img_res) + path_len + 1))) {
+		return NULL;
+	}
+	memset(res, 0, sizeof(img_res));
+	res->path = (char*)(res + 1);
+	memcpy(res->path, path, path_len + 1);
+	res->hash = hash;
+
+	if (ctx->img_cache) {
+		if ((res->shared = shared_image(ctx, ctx->img_cache, path, hash))) {
+			res->resource = res->shared->resource;
+		}
+	} else {
+		res->resource = ctx->img_load_func(path);
+	}
+	if (!res->resource) {
+		if (!ctx->arena) ctx->free_func(res);
+		return NULL;
+	}
+
+	res->next = *(ctx->images);
+	*(ctx->images) = res;
+	return res->resource;
+}
+
+void image_res_free(img_res *list, void (*free_func)(void*), void (*img_free_func)(void*)) {
+	img_res *next;
+	for (; list; list = next) {
+		next = list->next;
+		if (list->shared) {
+			release_img_entry(list->shared);
+		} else if (img_free_func) {
+			img_free_func(list->resource);
+		}
+		if (free_func) free_func(list);
+	}
+}
+
+tmx_image_cache* tmx_image_cache_create(tmx_loader *ctx) {
+	tmx_image_cache *res;
+
+	if (!ctx) {
+		return NULL;
+	}
+	if (!ctx->alloc_func) ctx->alloc_func = realloc;
+	if (!ctx->free_func) ctx->free_func = free;
+
+	if (!(res = (tmx_image_cache*)ctx->alloc_func(NULL, sizeof(tmx_image_cache)))) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	memset(res, 0, sizeof(tmx_image_cache));
+	if (!mutex_init(&(res->lock))) {
+		tmx_err(ctx, E_UNKN, "tmx_image_cache_create: could not create a mutex");
+		ctx->free_func(res);
+		return NULL;
+	}
+	res->refs = 1;
+	res->free_func = ctx->free_func;
+	return res;
+}
+
+void tmx_image_cache_free(tmx_image_cache *cache) {
+	img_cache_entry *entry, *next, *unused = NULL;
+	int last;
+
+	if (!cache) return;
+
+	mutex_lock(&(cache->lock));
+	for (entry = cache->head; entry; entry = next) {
+		next = entry->next;
+		entry->listed = 0;
+		if (entry->refs == 0) { /* frees it below, outside of the lock */
+			entry->next = unused;
+			unused = entry;
+		} else {
+			entry->next = NULL;
+		}
+	}
+	cache->head = NULL;
+	last = (--(cache->refs) == 0);
+	mutex_unlock(&(cache->lock));
+
+	for (entry = unused; entry; entry = next) {
+		next = entry->next;
+		free_img_entry(entry);
+	}
+	if (last) free_img_cache(cache);
+}
@@ -0,0 +1,187 @@
+/*
+	CSV layer data decoder
+
+	Single pass state machine, reads unsigned 32 bits GIDs (flip flags are
+	in the high bits) separated by commas and any amount of blank characters.
+	The payload may be fed in several chunks (a number can be split between
+	two chunks).
+	Numbers are located and converted 8 characters at a time (SWAR) when the
+	chunk is long enough, the byte-by-byte loop handles the rest.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define IS_DIGIT(c)   ((unsigned char)((c) - '0') < 10)
+#define IS_BLANK(c)   ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+enum csv_state {CSV_VALUE, CSV_NUMBER, CSV_SEPARATOR};
+
+void csv_init(csv_decoder *dec, const gid_output *out, size_t count, long line) {
+	dec->out = *out;
+	dec->pos = 0;
+	dec->count = count;
+	dec->index = 0;
+	dec->line = line > 0? (unsigned long)line: 1;
+	dec->value = 0;
+	dec->state = CSV_VALUE;
+}
+
+static int csv_store(tmx_loader *ctx, csv_decoder *dec) {
+	if (dec->index >= dec->count) {
+		tmx_err(ctx, E_CDATA, "csv: layer contains too many tiles (more than %lu) at line %lu",
+		        (unsigned long)dec->count, dec->line);
+		return 0;
+	}
+	if (dec->pos == dec->out.len) { /* only with out.flush, a dense layer is full when index == count */
+		if (!dec->out.flush(ctx, dec->out.arg, dec->pos)) return 0;
+		dec->pos = 0;
+	}
+	dec->out.gids[dec->pos++] = (int32_t)dec->value;
+	dec->index++;
+	dec->value = 0;
+	dec->state = CSV_SEPARATOR;
+	return 1;
+}
+
+static int csv_char_err(tmx_loader *ctx, csv_decoder *dec, char c) {
+	if (c == ',') {
+		tmx_err(ctx, E_CDATA, "csv: missing value for tile #%lu at line %lu", (unsigned long)dec->index, dec->line);
+	} else if (IS_DIGIT(c)) {
+		tmx_err(ctx, E_CDATA, "csv: missing ',' before tile #%lu at line %lu", (unsigned long)dec->index, dec->line);
+	} else {
+		tmx_err(ctx, E_CDATA, "csv: invalid character '%c' in tile #%lu at line %lu", c, (unsigned long)dec->index, dec->line);
+	}
+	return 0;
+}
+
+#ifndef SYS_BIG_ENDIAN
+
+#define SWAR_ONES(b) (0x0101010101010101ULL * (b))
+
+/* number of leading digits (0..8) in the 8 characters loaded in `word` */
+static unsigned int swar_digit_count(uint64_t word) {
+	uint64_t v = word - SWAR_ONES('0');
+	/* high bit of each byte set if the byte is not a digit (v > 9 as unsigned) */
+	uint64_t non_digits = (((v & SWAR_ONES(0x7F)) + SWAR_ONES(0x76)) | v) & SWAR_ONES(0x80);
+	unsigned int n = 0;
+	if (!non_digits) return 8;
+	while (!(non_digits & 0x80)) { /* position of the first non digit byte */
+		non_digits >>= 8;
+		n++;
+	}
+	return n;
+}
+
+/* value of the `n` (1..8) leading digits in `word` */
+static uint32_t swar_parse(uint64_t word, unsigned int n) {
+	uint64_t v = (word - SWAR_ONES('0')) << (8 * (8 - n)); /* shifts in leading zeros */
+	v = (v * 10) + (v >> 8); /* pairs of digits */
+	v = (((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+	     (((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+	return (uint32_t)v;
+}
+
+#endif /* SYS_BIG_ENDIAN */
+
+/* number of bytes equal to `c` in `word` (in any byte order) */
+static unsigned int swar_count(uint64_t word, unsigned char c) {
+	uint64_t x = word ^ (0x0101010101010101ULL * c);
+	x = ~(((x & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | x) & 0x8080808080808080ULL;
+	return (unsigned int)(((x >> 7) * 0x0101010101010101ULL) >> 56);
+}
+
+/* offset following the `n`th comma of `text` (or `len` if there are less),
+   adds the number of lines skipped to `line`, the values are not parsed */
+size_t csv_skip(const char *text, size_t len, size_t n, long *line) {
+	size_t i = 0;
+	uint64_t word;
+	unsigned int commas;
+
+	while (n > 8 && len - i >= 8) { /* less than n commas in a word */
+		memcpy(&word, text + i, 8);
+		commas = swar_count(word, ',');
+		n -= commas;
+		*line += swar_count(word, '\n');
+		i += 8;
+	}
+	for (; i<len && n; i++) {
+		if (text[i] == ',') n--;
+		else if (text[i] == '\n') (*line)++;
+	}
+	return i;
+}
+
+int csv_feed(tmx_loader *ctx, csv_decoder *dec, const char *chunk, size_t len) {
+	const char *p = chunk, *end = chunk + len;
+	unsigned int digit;
+	char c;
+#ifndef SYS_BIG_ENDIAN
+	uint64_t word;
+	unsigned int n;
+#endif
+
+	while (p < end) {
+		c = *p;
+		switch (dec->state) {
+			case CSV_VALUE:
+				if (IS_DIGIT(c)) {
+#ifndef SYS_BIG_ENDIAN
+					if (end - p >= 8) {
+						memcpy(&word, p, 8);
+						n = swar_digit_count(word);
+						if (n < 8) { /* fits in 7 digits, the whole number is in `word` */
+							dec->value = swar_parse(word, n);
+							p += n;
+							if (!csv_store(ctx, dec)) return 0;
+							continue;
+						}
+					}
+#endif
+					dec->state = CSV_NUMBER;
+					dec->value = 0;
+					continue; /* reads the digits in CSV_NUMBER */
+				}
+				if (c == '\n') dec->line++;
+				else if (!IS_BLANK(c)) return csv_char_err(ctx, dec, c);
+				break;
+
+			case CSV_NUMBER:
+				if (IS_DIGIT(c)) {
+					digit = (unsigned int)(c - '0');
+					if (dec->value > (0xFFFFFFFFUL - digit) / 10) {
+						tmx_err(ctx, E_CDATA, "csv: tile #%lu does not fit in 32 bits at line %lu", (unsigned long)dec->index, dec->line);
+						return 0;
+					}
+					dec->value = dec->value * 10 + digit;
+					break;
+				}
+				if (!csv_store(ctx, dec)) return 0;
+				continue; /* reads the separator in CSV_SEPARATOR */
+
+			case CSV_SEPARATOR:
+				if (c == ',') dec->state = CSV_VALUE;
+				else if (c == '\n') dec->line++;
+				else if (!IS_BLANK(c)) return csv_char_err(ctx, dec, c);
+				break;
+		}
+		p++;
+	}
+	return 1;
+}
+
+int csv_finish(tmx_loader *ctx, csv_decoder *dec) {
+	if (dec->state == CSV_NUMBER && !csv_store(ctx, dec)) return 0;
+	if (dec->index != dec->count) {
+		tmx_err(ctx, E_CDATA, "csv: layer contains not enough tiles (%lu out of %lu)", (unsigned long)dec->index, (unsigned long)dec->count);
+		return 0;
+	}
+	if (dec->out.flush && dec->pos) {
+		return dec->out.flush(ctx, dec->out.arg, dec->pos);
+	}
+	return 1;
+}
@@ -16,19 +16,27 @@ static char *errmsgs[] = {
 
 char custom_msg[256];
 
-const char* tmx_strerr(void) {
-	char *msg;
-	switch(tmx_errno) {
+static const char* strerr(tmx_error_codes code, const char *custom) {
+	const char *msg;
+	switch(code) {
 		case E_NONE:   msg = errmsgs[0]; break;
 		case E_ALLOC:  msg = errmsgs[1]; break;
 		case E_ACCESS: msg = errmsgs[2]; break;
 		case E_NOENT:  msg = errmsgs[3]; break;
 		case E_FORMAT: msg = errmsgs[4]; break;
-		default: msg = custom_msg;
+		default: msg = custom;
 	}
 	return msg;
 }
 
+const char* tmx_strerr(void) {
+	return strerr(tmx_errno, custom_msg);
+}
+
+const char* tmx_loader_strerr(tmx_loader *ctx) {
+	return strerr(ctx->err, ctx->errmsg);
+}
+
 void tmx_perror(const char *pos) {
 	const char *msg = tmx_strerr();
 	fprintf(stderr, "%s: %s\n", pos, msg);
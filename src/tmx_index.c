@@ -0,0 +1,441 @@
+/*
+	Spatial index of object groups
+
+	The objects of a group are bucketed in a uniform grid covering their
+	bounding boxes, a query visits the cells overlapping the queried
+	rectangle and tests the actual shape of the objects found there.
+	An object spanning several cells is only reported by the first cell
+	shared by its cells and the query (no per-query state, queries are
+	thread-safe once the index is built).
+
+	The shapes are stored in map coordinates: rectangles, tiles and
+	polygons as (rotated) polygons, polylines as open polygons, ellipses
+	as a center, radii and angle.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define INDEX_MAX_SIDE 4096 /* cells on each axis */
+
+enum entry_kind {K_POLYGON, K_POLYLINE, K_ELLIPSE};
+
+typedef struct {
+	double x0, y0, x1, y1;
+} rect;
+
+typedef struct {
+	tmx_object *obj;
+	enum entry_kind kind;
+	rect box;
+	unsigned int cx0, cy0; /* first cell of the object */
+	double *pts; /* x,y pairs in map coordinates (polygons and polylines) */
+	int pts_len;
+	double cx, cy, rx, ry, cos_r, sin_r; /* ellipses */
+} index_entry;
+
+struct _tmx_obj_index {
+	void (*free_func)(void *address);
+	unsigned int count;
+	index_entry *entries;
+	double *points;
+	double x0, y0; /* origin of the grid */
+	double cell_w, cell_h;
+	unsigned int cols, rows;
+	unsigned int *cells; /* cols*rows+1 offsets in `refs`, cell by cell */
+	unsigned int *refs;  /* entries of the cells */
+};
+
+/*
+	Build
+*/
+
+static unsigned int cell_of(double v, double origin, double size, unsigned int n) {
+	double c = (v - origin) / size;
+	if (c <= 0.) return 0;
+	if (c >= (double)(n - 1)) return n - 1;
+	return (unsigned int)c;
+}
+
+static int shape_points(tmx_object *o) {
+	if (o->shape == S_POLYGON || o->shape == S_POLYLINE) {
+		return o->points && o->points_len > 0? o->points_len: 1;
+	}
+	return 4; /* rectangles, tiles, and ellipses if they are flat */
+}
+
+/* computes the shape of the object in map coordinates, `pts` has room for shape_points(o) */
+static void make_entry(index_entry *e, tmx_object *o, double *pts) {
+	double angle = o->rotation * 3.14159265358979323846 / 180.;
+	double c = cos(angle), s = sin(angle);
+	double lx[4], ly[4], hw, hh;
+	int i, n = 0;
+
+	e->obj = o;
+	e->pts = pts;
+	e->cos_r = c;
+	e->sin_r = s;
+
+	if (o->shape == S_ELLIPSE && o->width > 0. && o->height > 0.) {
+		e->kind = K_ELLIPSE;
+		e->rx = o->width / 2.;
+		e->ry = o->height / 2.;
+		/* rotated around the object position, like the other shapes */
+		e->cx = o->x + e->rx * c - e->ry * s;
+		e->cy = o->y + e->rx * s + e->ry * c;
+		hw = sqrt(e->rx * e->rx * c * c + e->ry * e->ry * s * s);
+		hh = sqrt(e->rx * e->rx * s * s + e->ry * e->ry * c * c);
+		e->box.x0 = e->cx - hw; e->box.x1 = e->cx + hw;
+		e->box.y0 = e->cy - hh; e->box.y1 = e->cy + hh;
+		e->pts_len = 0;
+		return;
+	}
+
+	if ((o->shape == S_POLYGON || o->shape == S_POLYLINE) && o->points && o->points_len > 0) {
+		e->kind = o->shape == S_POLYGON? K_POLYGON: K_POLYLINE;
+		n = o->points_len;
+		for (i=0; i<n; i++) {
+			pts[2*i]   = o->x + o->points[i][0] * c - o->points[i][1] * s;
+			pts[2*i+1] = o->y + o->points[i][0] * s + o->points[i][1] * c;
+		}
+	}
+	else if (o->shape == S_POLYGON || o->shape == S_POLYLINE) { /* no points: the position */
+		e->kind = K_POLYLINE;
+		n = 1;
+		pts[0] = o->x;
+		pts[1] = o->y;
+	}
+	else {
+		/* tile objects are anchored by their bottom-left corner, the others by the top-left */
+		e->kind = K_POLYGON;
+		lx[0] = 0.;       ly[0] = o->shape == S_TILE? -o->height: 0.;
+		lx[1] = o->width; ly[1] = ly[0];
+		lx[2] = o->width; ly[2] = ly[0] + o->height;
+		lx[3] = 0.;       ly[3] = ly[2];
+		n = 4;
+		for (i=0; i<n; i++) {
+			pts[2*i]   = o->x + lx[i] * c - ly[i] * s;
+			pts[2*i+1] = o->y + lx[i] * s + ly[i] * c;
+		}
+	}
+
+	e->pts_len = n;
+	e->box.x0 = e->box.x1 = pts[0];
+	e->box.y0 = e->box.y1 = pts[1];
+	for (i=1; i<n; i++) {
+		if (pts[2*i]   < e->box.x0) e->box.x0 = pts[2*i];
+		if (pts[2*i]   > e->box.x1) e->box.x1 = pts[2*i];
+		if (pts[2*i+1] < e->box.y0) e->box.y0 = pts[2*i+1];
+		if (pts[2*i+1] > e->box.y1) e->box.y1 = pts[2*i+1];
+	}
+}
+
+void objgr_index_free(tmx_object_group *objgr) {
+	struct _tmx_obj_index *idx;
+	if (objgr && (idx = objgr->index)) {
+		idx->free_func(idx->entries);
+		idx->free_func(idx->points);
+		idx->free_func(idx->cells);
+		idx->free_func(idx->refs);
+		idx->free_func(idx);
+		objgr->index = NULL;
+	}
+}
+
+/* chooses a grid of about one cell per object, with cells at least as large as the average object */
+static void grid_size(struct _tmx_obj_index *idx, const rect *bounds) {
+	double w = bounds->x1 - bounds->x0, h = bounds->y1 - bounds->y0;
+	double avg_w = 0., avg_h = 0., side;
+	unsigned int i;
+
+	for (i=0; i<idx->count; i++) {
+		avg_w += idx->entries[i].box.x1 - idx->entries[i].box.x0;
+		avg_h += idx->entries[i].box.y1 - idx->entries[i].box.y0;
+	}
+	avg_w /= idx->count;
+	avg_h /= idx->count;
+
+	side = sqrt(w * h / idx->count);
+	idx->cell_w = side > avg_w? side: avg_w;
+	idx->cell_h = side > avg_h? side: avg_h;
+	if (idx->cell_w < 1.) idx->cell_w = 1.;
+	if (idx->cell_h < 1.) idx->cell_h = 1.;
+	if (w / idx->cell_w >= INDEX_MAX_SIDE) idx->cell_w = w / (INDEX_MAX_SIDE - 1);
+	if (h / idx->cell_h >= INDEX_MAX_SIDE) idx->cell_h = h / (INDEX_MAX_SIDE - 1);
+
+	idx->x0 = bounds->x0;
+	idx->y0 = bounds->y0;
+	idx->cols = (unsigned int)(w / idx->cell_w) + 1;
+	idx->rows = (unsigned int)(h / idx->cell_h) + 1;
+}
+
+int objgr_index_build(tmx_loader *ctx, tmx_object_group *objgr) {
+	struct _tmx_obj_index *idx;
+	tmx_object *o;
+	index_entry *e;
+	rect bounds;
+	size_t points = 0, refs;
+	unsigned int i, cx, cy, cx1, cy1, ncells;
+
+	objgr_index_free(objgr);
+
+	if (!(idx = (struct _tmx_obj_index*)ctx->alloc_func(NULL, sizeof(struct _tmx_obj_index)))) {
+		ctx->err = E_ALLOC;
+		return 0;
+	}
+	memset(idx, 0, sizeof(struct _tmx_obj_index));
+	idx->free_func = ctx->free_func;
+	objgr->index = idx;
+
+	for (o = objgr->head; o; o = o->next) {
+		idx->count++;
+		points += shape_points(o);
+	}
+	if (!idx->count) return 1;
+
+	if (!(idx->entries = (index_entry*)ctx->alloc_func(NULL, idx->count * sizeof(index_entry))) ||
+	    !(idx->points = (double*)ctx->alloc_func(NULL, points * 2 * sizeof(double)))) {
+		goto fail;
+	}
+
+	points = 0;
+	for (o = objgr->head, e = idx->entries; o; o = o->next, e++) {
+		make_entry(e, o, idx->points + points * 2);
+		points += shape_points(o);
+	}
+
+	bounds = idx->entries[0].box; /* idx->count > 0 */
+	for (i=1, e=idx->entries+1; i<idx->count; i++, e++) {
+		if (e->box.x0 < bounds.x0) bounds.x0 = e->box.x0;
+		if (e->box.y0 < bounds.y0) bounds.y0 = e->box.y0;
+		if (e->box.x1 > bounds.x1) bounds.x1 = e->box.x1;
+		if (e->box.y1 > bounds.y1) bounds.y1 = e->box.y1;
+	}
+
+	grid_size(idx, &bounds);
+	ncells = idx->cols * idx->rows;
+
+	/* counts the entries of each cell, turns the counts into offsets, then fills the cells */
+	if (!(idx->cells = (unsigned int*)ctx->alloc_func(NULL, (ncells + 1) * sizeof(unsigned int)))) goto fail;
+	memset(idx->cells, 0, (ncells + 1) * sizeof(unsigned int));
+	refs = 0;
+	for (i=0, e=idx->entries; i<idx->count; i++, e++) {
+		e->cx0 = cell_of(e->box.x0, idx->x0, idx->cell_w, idx->cols);
+		e->cy0 = cell_of(e->box.y0, idx->y0, idx->cell_h, idx->rows);
+		cx1 = cell_of(e->box.x1, idx->x0, idx->cell_w, idx->cols);
+		cy1 = cell_of(e->box.y1, idx->y0, idx->cell_h, idx->rows);
+		for (cy = e->cy0; cy <= cy1; cy++) {
+			for (cx = e->cx0; cx <= cx1; cx++) {
+				idx->cells[cy * idx->cols + cx + 1]++;
+			}
+		}
+		refs += (size_t)(cx1 - e->cx0 + 1) * (cy1 - e->cy0 + 1);
+	}
+	for (i=0; i<ncells; i++) {
+		idx->cells[i+1] += idx->cells[i];
+	}
+
+	if (!(idx->refs = (unsigned int*)ctx->alloc_func(NULL, refs * sizeof(unsigned int)))) goto fail;
+	/* cells[c] is the next free slot of cell c-1 while filling, then its end */
+	memmove(idx->cells + 1, idx->cells, ncells * sizeof(unsigned int));
+	for (i=0, e=idx->entries; i<idx->count; i++, e++) {
+		cx1 = cell_of(e->box.x1, idx->x0, idx->cell_w, idx->cols);
+		cy1 = cell_of(e->box.y1, idx->y0, idx->cell_h, idx->rows);
+		for (cy = e->cy0; cy <= cy1; cy++) {
+			for (cx = e->cx0; cx <= cx1; cx++) {
+				idx->refs[idx->cells[cy * idx->cols + cx + 1]++] = i;
+			}
+		}
+	}
+	return 1;
+
+fail:
+	ctx->err = E_ALLOC;
+	objgr_index_free(objgr);
+	return 0;
+}
+
+/*
+	Queries
+*/
+
+static int point_in_rect(double x, double y, const rect *r) {
+	return x >= r->x0 && x <= r->x1 && y >= r->y0 && y <= r->y1;
+}
+
+/* Liang-Barsky clipping of the segment (ax, ay)-(bx, by) by the rectangle */
+static int segment_hits_rect(double ax, double ay, double bx, double by, const rect *r) {
+	double p[4], q[4], t, t0 = 0., t1 = 1.;
+	int i;
+
+	p[0] = ax - bx; q[0] = ax - r->x0;
+	p[1] = bx - ax; q[1] = r->x1 - ax;
+	p[2] = ay - by; q[2] = ay - r->y0;
+	p[3] = by - ay; q[3] = r->y1 - ay;
+	for (i=0; i<4; i++) {
+		if (p[i] == 0.) {
+			if (q[i] < 0.) return 0; /* parallel and outside */
+		} else {
+			t = q[i] / p[i];
+			if (p[i] < 0.) {
+				if (t > t1) return 0;
+				if (t > t0) t0 = t;
+			} else {
+				if (t < t0) return 0;
+				if (t < t1) t1 = t;
+			}
+		}
+	}
+	return 1;
+}
+
+/* even-odd rule, `pts` is a list of `n` x,y pairs */
+static int point_in_polygon(double x, double y, const double *pts, int n) {
+	int i, j, in = 0;
+	for (i=0, j=n-1; i<n; j=i++) {
+		if ((pts[2*i+1] > y) != (pts[2*j+1] > y) &&
+		    x < (pts[2*j] - pts[2*i]) * (y - pts[2*i+1]) / (pts[2*j+1] - pts[2*i+1]) + pts[2*i]) {
+			in = !in;
+		}
+	}
+	return in;
+}
+
+static int polygon_hits_rect(const index_entry *e, const rect *r) {
+	const double *p = e->pts;
+	int i, n = e->pts_len;
+
+	if (n == 1) return point_in_rect(p[0], p[1], r);
+	/* an edge crosses the rectangle, or is inside it */
+	for (i=0; i<n-1; i++) {
+		if (segment_hits_rect(p[2*i], p[2*i+1], p[2*i+2], p[2*i+3], r)) return 1;
+	}
+	if (e->kind == K_POLYLINE) return 0;
+	if (segment_hits_rect(p[2*n-2], p[2*n-1], p[0], p[1], r)) return 1;
+	/* the rectangle is inside the polygon */
+	return n >= 3 && point_in_polygon(r->x0, r->y0, p, n);
+}
+
+/* squared distance between the origin and the segment (ax, ay)-(bx, by) */
+static double segment_dist2(double ax, double ay, double bx, double by) {
+	double dx = bx - ax, dy = by - ay, len2 = dx * dx + dy * dy, t = 0.;
+	if (len2 > 0.) {
+		t = -(ax * dx + ay * dy) / len2;
+		if (t < 0.) t = 0.;
+		else if (t > 1.) t = 1.;
+	}
+	ax += t * dx;
+	ay += t * dy;
+	return ax * ax + ay * ay;
+}
+
+/* the rectangle is moved in the space where the ellipse is the unit circle */
+static int ellipse_hits_rect(const index_entry *e, const rect *r) {
+	double q[8], dx, dy;
+	int i;
+
+	for (i=0; i<4; i++) {
+		dx = (i == 1 || i == 2? r->x1: r->x0) - e->cx;
+		dy = (i >= 2? r->y1: r->y0) - e->cy;
+		q[2*i]   = ( dx * e->cos_r + dy * e->sin_r) / e->rx;
+		q[2*i+1] = (-dx * e->sin_r + dy * e->cos_r) / e->ry;
+	}
+	if (point_in_polygon(0., 0., q, 4)) return 1; /* the center is in the rectangle */
+	for (i=0; i<4; i++) {
+		if (segment_dist2(q[2*i], q[2*i+1], q[(2*i+2)%8], q[(2*i+3)%8]) <= 1.) return 1;
+	}
+	return 0;
+}
+
+/* loader building the index on demand, with the allocator of the loader of the group */
+static void index_loader(tmx_loader *ctx, const tmx_object_group *objgr) {
+	memset(ctx, 0, sizeof(tmx_loader));
+	ctx->alloc_func = objgr->alloc_func? objgr->alloc_func: realloc;
+	ctx->free_func = objgr->free_func? objgr->free_func: free;
+}
+
+static int query(tmx_object_group *objgr, rect *r, tmx_object **out, int out_len, const char *func) {
+	struct _tmx_obj_index *idx;
+	tmx_loader ctx;
+	const index_entry *e;
+	unsigned int cx, cy, cx0, cy0, cx1, cy1, i, end;
+	int found = 0, hit;
+
+	if (!objgr || (out_len > 0 && !out)) {
+		tmx_err_global(E_INVAL, "%s: invalid argument: objgr or out is NULL", func);
+		return -1;
+	}
+
+	if (!objgr->index) { /* built on demand */
+		index_loader(&ctx, objgr);
+		if (!objgr_index_build(&ctx, objgr)) {
+			tmx_err_global(ctx.err, "%s: could not build the index", func);
+			return -1;
+		}
+	}
+	idx = objgr->index;
+
+	if (!idx->count || r->x1 < idx->x0 || r->y1 < idx->y0 ||
+	    r->x0 > idx->x0 + idx->cols * idx->cell_w || r->y0 > idx->y0 + idx->rows * idx->cell_h) {
+		return 0;
+	}
+	cx0 = cell_of(r->x0, idx->x0, idx->cell_w, idx->cols);
+	cy0 = cell_of(r->y0, idx->y0, idx->cell_h, idx->rows);
+	cx1 = cell_of(r->x1, idx->x0, idx->cell_w, idx->cols);
+	cy1 = cell_of(r->y1, idx->y0, idx->cell_h, idx->rows);
+
+	for (cy = cy0; cy <= cy1; cy++) {
+		for (cx = cx0; cx <= cx1; cx++) {
+			end = idx->cells[cy * idx->cols + cx + 1];
+			for (i = idx->cells[cy * idx->cols + cx]; i < end; i++) {
+				e = idx->entries + idx->refs[i];
+				/* reported by the first cell both cover */
+				if (cx != (e->cx0 > cx0? e->cx0: cx0) || cy != (e->cy0 > cy0? e->cy0: cy0)) continue;
+				if (e->box.x1 < r->x0 || e->box.x0 > r->x1 || e->box.y1 < r->y0 || e->box.y0 > r->y1) continue;
+
+				hit = e->kind == K_ELLIPSE? ellipse_hits_rect(e, r): polygon_hits_rect(e, r);
+				if (hit) {
+					if (found < out_len) out[found] = e->obj;
+					found++;
+				}
+			}
+		}
+	}
+	return found;
+}
+
+int tmx_objgr_query_rect(tmx_object_group *objgr, double x, double y, double w, double h, tmx_object **out, int out_len) {
+	rect r;
+	r.x0 = w < 0.? x + w: x;
+	r.x1 = w < 0.? x: x + w;
+	r.y0 = h < 0.? y + h: y;
+	r.y1 = h < 0.? y: y + h;
+	return query(objgr, &r, out, out_len, "tmx_objgr_query_rect");
+}
+
+int tmx_objgr_query_point(tmx_object_group *objgr, double x, double y, tmx_object **out, int out_len) {
+	rect r;
+	r.x0 = r.x1 = x;
+	r.y0 = r.y1 = y;
+	return query(objgr, &r, out, out_len, "tmx_objgr_query_point");
+}
+
+int tmx_objgr_index(tmx_object_group *objgr) {
+	tmx_loader ctx;
+
+	if (!objgr) {
+		tmx_err_global(E_INVAL, "tmx_objgr_index: invalid argument: objgr is NULL");
+		return 0;
+	}
+	index_loader(&ctx, objgr);
+	if (!objgr_index_build(&ctx, objgr)) {
+		tmx_err_global(ctx.err, "tmx_objgr_index: could not build the index");
+		return 0;
+	}
+	return 1;
+}
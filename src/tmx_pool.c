@@ -0,0 +1,239 @@
+/*
+	Parallel layer decoding
+
+	With TMX_LOAD_PARALLEL, parse_data copies the payload of each layer into
+	a job instead of decoding it, the jobs are decoded by a pool of threads
+	while the XML reader goes on. The gid arrays are allocated by the parser
+	thread (the map's arena is not thread-safe), the workers only use the
+	allocation functions of the loader for zlib's state.
+	Each job has a copy of the loader to report its error, decode_pool_join
+	reports the error of the first layer (in document order) that failed.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+struct _decode_job {
+	tmx_loader ctx; /* errors of this job */
+	data_decoder dec;
+	char *text;
+	size_t len, cap;
+	int ok;
+	decode_job *next;     /* in the queue */
+	decode_job *next_all; /* in submission order */
+};
+
+struct _tmx_pool {
+	tmx_mutex lock;
+	tmx_cond work, done;
+	decode_job *queue_head, *queue_tail;
+	decode_job *jobs, **jobs_tail;
+	unsigned int pending; /* submitted jobs not yet decoded */
+	int quit;
+
+	unsigned int threads_len, threads_max;
+	tmx_thread *threads;
+};
+
+static void run_job(decode_job *job) {
+	job->ok = data_decoder_feed(&(job->ctx), &(job->dec), job->text, job->len)
+	          && data_decoder_finish(&(job->ctx), &(job->dec));
+	data_decoder_release(&(job->dec));
+	job->ctx.free_func(job->text);
+	job->text = NULL;
+}
+
+/* the lock must be held */
+static decode_job* pop_job(struct _tmx_pool *pool) {
+	decode_job *job = pool->queue_head;
+	if (job) {
+		pool->queue_head = job->next;
+		if (!pool->queue_head) pool->queue_tail = NULL;
+	}
+	return job;
+}
+
+static THREAD_FUNC(worker, arg) {
+	struct _tmx_pool *pool = (struct _tmx_pool*)arg;
+	decode_job *job;
+
+	mutex_lock(&(pool->lock));
+	for (;;) {
+		while (!pool->queue_head && !pool->quit) {
+			cond_wait(&(pool->work), &(pool->lock));
+		}
+		if (!(job = pop_job(pool))) break; /* quit */
+		mutex_unlock(&(pool->lock));
+
+		run_job(job);
+
+		mutex_lock(&(pool->lock));
+		if (--(pool->pending) == 0) cond_signal(&(pool->done));
+	}
+	mutex_unlock(&(pool->lock));
+	THREAD_RETURN;
+}
+
+static struct _tmx_pool* create_pool(tmx_loader *ctx) {
+	struct _tmx_pool *res;
+	unsigned int max = ctx->threads? ctx->threads: cpu_count();
+
+	if (!(res = (struct _tmx_pool*)ctx->alloc_func(NULL, sizeof(struct _tmx_pool)))) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	memset(res, 0, sizeof(struct _tmx_pool));
+	if (!(res->threads = (tmx_thread*)ctx->alloc_func(NULL, max * sizeof(tmx_thread)))) {
+		ctx->err = E_ALLOC;
+		ctx->free_func(res);
+		return NULL;
+	}
+	if (!mutex_init(&(res->lock))) goto fail_mutex;
+	if (!cond_init(&(res->work))) goto fail_work;
+	if (!cond_init(&(res->done))) goto fail_done;
+	res->threads_max = max;
+	res->jobs_tail = &(res->jobs);
+	return res;
+
+fail_done:
+	cond_destroy(&(res->work));
+fail_work:
+	mutex_destroy(&(res->lock));
+fail_mutex:
+	tmx_err(ctx, E_UNKN, "parallel decoding: could not create the synchronisation objects");
+	ctx->free_func(res->threads);
+	ctx->free_func(res);
+	return NULL;
+}
+
+decode_job* decode_job_create(tmx_loader *ctx, enum enccmp_t type, tmx_layer *layer, long line) {
+	decode_job *res;
+
+	if (!(res = (decode_job*)ctx->alloc_func(NULL, sizeof(decode_job)))) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	memset(res, 0, sizeof(decode_job));
+	if (!data_decoder_init(ctx, &(res->dec), type, layer, line)) {
+		ctx->free_func(res);
+		return NULL;
+	}
+	res->ctx = *ctx;
+	res->ctx.arena = NULL;
+	res->ctx.images = NULL;
+	res->ctx.pool = NULL;
+	if (ctx->arena && (ctx->flags & TMX_LOAD_CHUNKED) && !(res->ctx.arena = arena_create(ctx))) {
+		data_decoder_release(&(res->dec));
+		ctx->free_func(res);
+		return NULL;
+	}
+	return res;
+}
+
+int decode_job_append(tmx_loader *ctx, decode_job *job, const char *text, size_t len) {
+	char *tmp;
+	size_t cap;
+
+	if (job->len + len > job->cap) {
+		cap = job->cap? job->cap: 4096;
+		while (cap < job->len + len) cap *= 2;
+		if (!(tmp = (char*)ctx->alloc_func(job->text, cap))) {
+			ctx->err = E_ALLOC;
+			return 0;
+		}
+		job->text = tmp;
+		job->cap = cap;
+	}
+	memcpy(job->text + job->len, text, len);
+	job->len += len;
+	return 1;
+}
+
+void decode_job_discard(tmx_loader *ctx, decode_job *job) {
+	data_decoder_release(&(job->dec));
+	arena_free(job->ctx.arena, ctx->free_func); /* nothing was decoded */
+	ctx->free_func(job->text);
+	ctx->free_func(job);
+}
+
+int decode_job_submit(tmx_loader *ctx, decode_job *job) {
+	struct _tmx_pool *pool;
+	int spawn;
+
+	if (!ctx->pool && !(ctx->pool = create_pool(ctx))) {
+		decode_job_discard(ctx, job);
+		return 0;
+	}
+	pool = ctx->pool;
+
+	mutex_lock(&(pool->lock));
+	if (pool->queue_tail) pool->queue_tail->next = job;
+	else pool->queue_head = job;
+	pool->queue_tail = job;
+	*(pool->jobs_tail) = job;
+	pool->jobs_tail = &(job->next_all);
+	pool->pending++;
+	spawn = pool->threads_len < pool->threads_max && pool->threads_len < pool->pending;
+	cond_signal(&(pool->work));
+	mutex_unlock(&(pool->lock));
+
+	/* the pool grows with the number of jobs waiting, up to threads_max
+	   if a thread cannot be created, decode_pool_join decodes the remaining jobs */
+	if (spawn && thread_create(pool->threads + pool->threads_len, worker, pool)) {
+		pool->threads_len++;
+	}
+	return 1;
+}
+
+int decode_pool_join(tmx_loader *ctx) {
+	struct _tmx_pool *pool = ctx->pool;
+	decode_job *job, *next;
+	unsigned int i;
+	int ret = 1;
+
+	if (!pool) return 1;
+
+	/* helps the workers */
+	mutex_lock(&(pool->lock));
+	while ((job = pop_job(pool))) {
+		mutex_unlock(&(pool->lock));
+		run_job(job);
+		mutex_lock(&(pool->lock));
+		pool->pending--;
+	}
+	while (pool->pending) {
+		cond_wait(&(pool->done), &(pool->lock));
+	}
+	pool->quit = 1;
+	cond_broadcast(&(pool->work));
+	mutex_unlock(&(pool->lock));
+
+	for (i=0; i<pool->threads_len; i++) {
+		thread_join(pool->threads[i]);
+	}
+
+	for (job = pool->jobs; job; job = next) {
+		next = job->next_all;
+		if (ret && !job->ok) {
+			ret = 0;
+			if (ctx->err == E_NONE) {
+				ctx->err = job->ctx.err;
+				memcpy(ctx->errmsg, job->ctx.errmsg, sizeof(ctx->errmsg));
+			}
+		}
+		if (job->ctx.arena) arena_merge(ctx->arena, job->ctx.arena);
+		ctx->free_func(job);
+	}
+
+	cond_destroy(&(pool->done));
+	cond_destroy(&(pool->work));
+	mutex_destroy(&(pool->lock));
+	ctx->free_func(pool->threads);
+	ctx->free_func(pool);
+	ctx->pool = NULL;
+	return ret;
+}
@@ -0,0 +1,434 @@
+/*
+	Quads of tile layers
+
+	Turns the cells of a tile layer into quads (destination rectangle,
+	source rectangle, flips) grouped in one batch per texture: the image of
+	a tileset, or the image of a tile of an image collection. A renderer
+	can then draw a layer with one call per texture.
+	The cells visible in a viewport are found without visiting the whole
+	layer, by inverting the placement of the cells.
+	The cells are visited in the render order of the map, and are placed
+	the way Tiled draws them for each orientation (staggered maps are
+	hexagonal maps without sides, see HexagonalRenderer in Tiled).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "tmx.h"
+#include "tmx_utils.h"
+
+#define NO_BATCH 0xFFFFFFFFU
+
+/* geometry of the cells of a map */
+typedef struct {
+	enum tmx_map_orient orient;
+	double tile_w, tile_h; /* of the cells */
+	/* hexagonal and staggered */
+	int stagger_x, stagger_even;
+	double side_x, side_y, column_w, row_h;
+} grid;
+
+typedef struct {
+	tmx_image *texture;
+	tmx_tileset *tileset;
+	unsigned int count;
+} batch_info;
+
+typedef struct {
+	const tmx_map *map;
+	const tmx_layer *layer;
+	grid g;
+	void* (*alloc_func)(void *address, size_t len);
+	void  (*free_func)(void *address);
+	gid_values gid_batch; /* batch of each gid, NO_BATCH if not seen yet */
+	batch_info *infos;
+	unsigned int info_count, info_cap;
+	tmx_layer_quads *res; /* NULL during the first pass, that counts the quads of each batch */
+	unsigned int order;
+	int failed;
+} quad_builder;
+
+static void grid_init(grid *g, const tmx_map *map) {
+	g->orient = map->orient;
+	g->tile_w = map->tile_width;
+	g->tile_h = map->tile_height;
+	if (map->orient == O_HEX || map->orient == O_STA) {
+		g->tile_w = map->tile_width & ~1U;
+		g->tile_h = map->tile_height & ~1U;
+		g->stagger_x = map->stagger_axis == SA_X;
+		g->stagger_even = map->stagger_index == SI_EVEN;
+		g->side_x = g->side_y = 0.;
+		if (map->orient == O_HEX) {
+			if (g->stagger_x) g->side_x = map->hexsidelength;
+			else g->side_y = map->hexsidelength;
+		}
+		g->column_w = (g->tile_w - g->side_x) / 2. + g->side_x;
+		g->row_h = (g->tile_h - g->side_y) / 2. + g->side_y;
+	}
+}
+
+/* is the column (stagger_x) or row shifted */
+static int staggered(const grid *g, unsigned int i) {
+	return (int)(i & 1) ^ g->stagger_even;
+}
+
+/* top-left corner of the cell (x, y), in pixels */
+static void cell_origin(const grid *g, const tmx_map *map, unsigned int x, unsigned int y, double *px, double *py) {
+	switch (g->orient) {
+		case O_ISO: /* the top corner of cell (0, 0) is at (map->height * tile_w/2, 0) */
+			*px = ((double)x - (double)y + (double)map->height - 1.) * g->tile_w / 2.;
+			*py = ((double)x + (double)y) * g->tile_h / 2.;
+			break;
+		case O_HEX:
+		case O_STA:
+			if (g->stagger_x) {
+				*px = x * g->column_w;
+				*py = y * (g->tile_h + g->side_y) + (staggered(g, x)? g->row_h: 0.);
+			} else {
+				*px = x * (g->tile_w + g->side_x) + (staggered(g, y)? g->column_w: 0.);
+				*py = y * g->row_h;
+			}
+			break;
+		default:
+			*px = x * g->tile_w;
+			*py = y * g->tile_h;
+	}
+}
+
+static unsigned int add_batch(quad_builder *b, tmx_image *texture, tmx_tileset *ts) {
+	unsigned int i;
+	batch_info *tmp;
+
+	for (i=0; i<b->info_count; i++) {
+		if (b->infos[i].texture == texture) return i;
+	}
+	if (b->info_count == b->info_cap) {
+		b->info_cap = b->info_cap? b->info_cap * 2: 8;
+		if (!(tmp = (batch_info*)b->alloc_func(b->infos, b->info_cap * sizeof(batch_info)))) {
+			b->failed = 1;
+			return NO_BATCH;
+		}
+		b->infos = tmp;
+	}
+	b->infos[i].texture = texture;
+	b->infos[i].tileset = ts;
+	b->infos[i].count = 0;
+	b->info_count++;
+	return i;
+}
+
+/* fills the quad of a cell, returns 0 if the cell is empty or its tile has no image */
+static int make_quad(const grid *g, const tmx_map *map, const tmx_layer *layer, unsigned int x, unsigned int y, tmx_quad *q) {
+	uint32_t raw = (uint32_t)tmx_layer_get_gid(layer, x, y);
+	uint32_t gid = raw & TMX_FLIP_BITS_REMOVAL;
+	tmx_tile *tile;
+	tmx_image *texture;
+	tmx_tileset *ts;
+	double px, py;
+
+	if (!gid || gid >= map->tilecount || !(tile = TMX_GID_TILE(map, gid))) return 0;
+	ts = tile->tileset;
+	texture = tile->image? tile->image: ts->image;
+	if (!texture) return 0;
+
+	q->cell_x = x;
+	q->cell_y = y;
+	q->gid = gid;
+	q->flips = raw & ~(uint32_t)TMX_FLIP_BITS_REMOVAL;
+	q->tile = tile;
+	if (tile->image) { /* image collection */
+		q->src_x = q->src_y = 0;
+		q->src_w = (unsigned int)texture->width;
+		q->src_h = (unsigned int)texture->height;
+	} else {
+		q->src_x = tile->ul_x;
+		q->src_y = tile->ul_y;
+		q->src_w = ts->tile_width;
+		q->src_h = ts->tile_height;
+	}
+	if (texture->width && texture->height) {
+		q->u0 = (float)q->src_x / texture->width;
+		q->v0 = (float)q->src_y / texture->height;
+		q->u1 = (float)(q->src_x + q->src_w) / texture->width;
+		q->v1 = (float)(q->src_y + q->src_h) / texture->height;
+	} else {
+		q->u0 = q->v0 = q->u1 = q->v1 = 0.f;
+	}
+
+	/* tiles are aligned on the bottom-left corner of their cell */
+	cell_origin(g, map, x, y, &px, &py);
+	q->w = (float)q->src_w;
+	q->h = (float)q->src_h;
+	q->x = (float)(px + ts->x_offset + layer->offsetx);
+	q->y = (float)(py + g->tile_h - q->src_h + ts->y_offset + layer->offsety);
+	return 1;
+}
+
+/* counts (first pass) or writes (second pass) the quad of a cell */
+static int emit(void *data, unsigned int x, unsigned int y) {
+	quad_builder *b = (quad_builder*)data;
+	unsigned int batch, *slot;
+	tmx_image *texture;
+	tmx_quad q;
+
+	if (!make_quad(&(b->g), b->map, b->layer, x, y, &q)) return 1;
+	texture = q.tile->image? q.tile->image: q.tile->tileset->image;
+
+	if ((batch = gid_values_get(&(b->gid_batch), q.gid)) == NO_BATCH) {
+		if ((batch = add_batch(b, texture, q.tile->tileset)) == NO_BATCH) return 0;
+		if (!(slot = gid_values_slot(&(b->gid_batch), q.gid, b->alloc_func))) {
+			b->failed = 1;
+			return 0;
+		}
+		*slot = batch;
+	}
+	if (!b->res) {
+		b->infos[batch].count++;
+		return 1;
+	}
+	q.order = b->order++;
+	b->res->batches[batch].quads[b->res->batches[batch].count++] = q;
+	return 1;
+}
+
+/* range of the cells whose origin (see cell_origin) is in (x0, x1) x (y0, y1) */
+typedef struct {
+	int all; /* all the cells of the layer */
+	double x0, y0, x1, y1;
+} cell_range;
+
+static long floor_l(double v) {
+	return (long)floor(v);
+}
+
+static long ceil_l(double v) {
+	return (long)ceil(v);
+}
+
+/* rows that may hold cells of the range, empty if *y0 > *y1 */
+static void range_rows(const grid *g, const tmx_map *map, const tmx_layer *l, const cell_range *r, long *y0, long *y1) {
+	double step;
+
+	*y0 = 0;
+	*y1 = (long)l->height - 1;
+	if (r->all) return;
+	switch (g->orient) {
+		case O_ISO: /* y = (v - u) / 2, see range_cols */
+			*y0 = (floor_l(2. * r->y0 / g->tile_h) - ceil_l(2. * r->x1 / g->tile_w - map->height + 1.)) / 2 - 1;
+			*y1 = (ceil_l(2. * r->y1 / g->tile_h) - floor_l(2. * r->x0 / g->tile_w - map->height + 1.)) / 2 + 1;
+			break;
+		case O_HEX:
+		case O_STA:
+			step = g->stagger_x? g->tile_h + g->side_y: g->row_h;
+			*y0 = floor_l((r->y0 - (g->stagger_x? g->row_h: 0.)) / step);
+			*y1 = ceil_l(r->y1 / step);
+			break;
+		default:
+			*y0 = floor_l(r->y0 / g->tile_h);
+			*y1 = ceil_l(r->y1 / g->tile_h);
+	}
+	if (*y0 < 0) *y0 = 0;
+	if (*y1 > (long)l->height - 1) *y1 = (long)l->height - 1;
+}
+
+/* cells of the row `y` that may be in the range, empty if *x0 > *x1 */
+static void range_cols(const grid *g, const tmx_map *map, const tmx_layer *l, const cell_range *r, long y, long *x0, long *x1) {
+	double step;
+	long u0, u1, v0, v1;
+
+	*x0 = 0;
+	*x1 = (long)l->width - 1;
+	if (r->all) return;
+	switch (g->orient) {
+		case O_ISO: /* u = x - y and v = x + y are the diagonals of the map */
+			u0 = floor_l(2. * r->x0 / g->tile_w - map->height + 1.);
+			u1 = ceil_l(2. * r->x1 / g->tile_w - map->height + 1.);
+			v0 = floor_l(2. * r->y0 / g->tile_h);
+			v1 = ceil_l(2. * r->y1 / g->tile_h);
+			*x0 = u0 + y > v0 - y? u0 + y: v0 - y;
+			*x1 = u1 + y < v1 - y? u1 + y: v1 - y;
+			break;
+		case O_HEX:
+		case O_STA:
+			step = g->stagger_x? g->column_w: g->tile_w + g->side_x;
+			*x0 = floor_l((r->x0 - (g->stagger_x? 0.: g->column_w)) / step);
+			*x1 = ceil_l(r->x1 / step);
+			break;
+		default:
+			*x0 = floor_l(r->x0 / g->tile_w);
+			*x1 = ceil_l(r->x1 / g->tile_w);
+	}
+	if (*x0 < 0) *x0 = 0;
+	if (*x1 > (long)l->width - 1) *x1 = (long)l->width - 1;
+}
+
+/* calls `f` on the cells of the range in render order, stops and returns 0 when `f` returns 0 */
+static int walk(const grid *g, const tmx_map *map, const tmx_layer *l, const cell_range *r, int (*f)(void*, unsigned int, unsigned int), void *data) {
+	enum tmx_map_renderorder ro = map->renderorder;
+	int up = ro == R_RIGHTUP || ro == R_LEFTUP;
+	int left = ro == R_LEFTDOWN || ro == R_LEFTUP;
+	long y0, y1, x0, x1, i, j, x, y;
+	int pass;
+
+	range_rows(g, map, l, r, &y0, &y1);
+	for (i=0; i<=y1-y0; i++) {
+		y = up? y1 - i: y0 + i;
+		range_cols(g, map, l, r, y, &x0, &x1);
+		/* staggered columns: the shifted columns overlap the row below, they are drawn last */
+		for (pass=0; pass<(g->stagger_x? 2: 1); pass++) {
+			for (j=0; j<=x1-x0; j++) {
+				x = left? x1 - j: x0 + j;
+				if (g->stagger_x && staggered(g, (unsigned int)x) != pass) continue;
+				if (!f(data, (unsigned int)x, (unsigned int)y)) return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+tmx_layer_quads* tmx_layer_build_quads(const tmx_map *map, tmx_layer *layer) {
+	quad_builder b;
+	cell_range all;
+	tmx_layer_quads *res = NULL;
+	tmx_quad *quads;
+	size_t total = 0, header;
+	unsigned int i;
+
+	if (!map || !layer || layer->type != L_LAYER) {
+		tmx_err_global(E_INVAL, "tmx_layer_build_quads: invalid argument: map is NULL or layer is not a tile layer");
+		return NULL;
+	}
+	if (layer->lazy && !layer->content.gids && !layer->chunks) {
+		if (!tmx_layer_gids(layer) && !layer->chunks) return NULL; /* tmx_errno set by tmx_layer_gids */
+	}
+
+	memset(&b, 0, sizeof(quad_builder));
+	b.map = map;
+	b.layer = layer;
+	b.alloc_func = map->alloc_func? map->alloc_func: realloc;
+	b.free_func = map->free_func? map->free_func: free;
+	grid_init(&(b.g), map);
+	all.all = 1;
+
+	if (!gid_values_init(&(b.gid_batch), map, NO_BATCH, b.alloc_func)) goto nomem;
+	walk(&(b.g), map, layer, &all, emit, &b);
+	if (b.failed) goto nomem;
+
+	/* one block: the result, the batches, then the quads */
+	for (i=0; i<b.info_count; i++) total += b.infos[i].count;
+	header = (sizeof(tmx_layer_quads) + b.info_count * sizeof(tmx_quad_batch) + 7) & ~(size_t)7;
+	if (!(res = (tmx_layer_quads*)b.alloc_func(NULL, header + total * sizeof(tmx_quad)))) goto nomem;
+	res->batch_count = b.info_count;
+	res->quad_count = (unsigned int)total;
+	res->free_func = b.free_func;
+	res->batches = (tmx_quad_batch*)(res + 1);
+	quads = (tmx_quad*)((char*)res + header);
+	for (i=0; i<b.info_count; i++) {
+		res->batches[i].texture = b.infos[i].texture;
+		res->batches[i].tileset = b.infos[i].tileset;
+		res->batches[i].count = 0; /* incremented by the second pass */
+		res->batches[i].quads = quads;
+		quads += b.infos[i].count;
+	}
+
+	b.res = res;
+	b.order = 0;
+	walk(&(b.g), map, layer, &all, emit, &b);
+
+	gid_values_free(&(b.gid_batch), b.free_func);
+	b.free_func(b.infos);
+	return res;
+
+nomem:
+	gid_values_free(&(b.gid_batch), b.free_func);
+	b.free_func(b.infos);
+	tmx_err_global(E_ALLOC, "tmx_layer_build_quads: not enough memory");
+	return NULL;
+}
+
+void tmx_layer_quads_free(tmx_layer_quads *quads) {
+	if (quads) {
+		quads->free_func(quads);
+	}
+}
+
+typedef struct {
+	const tmx_map *map;
+	const tmx_layer *layer;
+	grid g;
+	double x, y, w, h; /* the view */
+	tmx_cell_func func;
+	void *userdata;
+	int count;
+} cell_culler;
+
+static int cull(void *data, unsigned int x, unsigned int y) {
+	cell_culler *c = (cell_culler*)data;
+	tmx_quad q;
+
+	if (!make_quad(&(c->g), c->map, c->layer, x, y, &q)) return 1;
+	if (q.x >= c->x + c->w || q.x + q.w <= c->x || q.y >= c->y + c->h || q.y + q.h <= c->y) return 1;
+	q.order = (unsigned int)c->count++;
+	return c->func(&q, c->userdata);
+}
+
+int tmx_layer_visible_cells(const tmx_map *map, tmx_layer *layer, double x, double y, double w, double h, tmx_cell_func func, void *userdata) {
+	cell_culler c;
+	cell_range r;
+	tmx_tileset_list *tsl;
+	tmx_tileset *ts;
+	unsigned int i;
+	/* bounds of the tiles, relative to the origin of their cell */
+	double left, right, top, bottom, tw, th;
+
+	if (!map || !layer || layer->type != L_LAYER || !func) {
+		tmx_err_global(E_INVAL, "tmx_layer_visible_cells: invalid argument: map or func is NULL or layer is not a tile layer");
+		return -1;
+	}
+	if (layer->lazy && !layer->content.gids && !layer->chunks) {
+		if (!tmx_layer_gids(layer) && !layer->chunks) return -1; /* tmx_errno set by tmx_layer_gids */
+	}
+
+	memset(&c, 0, sizeof(cell_culler));
+	c.map = map;
+	c.layer = layer;
+	c.x = x; c.y = y;
+	c.w = w; c.h = h;
+	c.func = func;
+	c.userdata = userdata;
+	grid_init(&(c.g), map);
+	if (w <= 0. || h <= 0.) return 0;
+
+	/* tiles larger than the cells and tile offsets widen the range of the cells to check */
+	left = top = 0.;
+	right = c.g.tile_w;
+	bottom = c.g.tile_h;
+	for (tsl = map->ts_head; tsl; tsl = tsl->next) {
+		ts = tsl->tileset;
+		tw = ts->tile_width;
+		th = ts->tile_height;
+		if (!ts->image) { /* image collection, the tiles may have different sizes */
+			for (i=0; i<ts->tilecount; i++) {
+				if (ts->tiles[i].image) {
+					if (ts->tiles[i].image->width  > tw) tw = ts->tiles[i].image->width;
+					if (ts->tiles[i].image->height > th) th = ts->tiles[i].image->height;
+				}
+			}
+		}
+		if (ts->x_offset < left) left = ts->x_offset;
+		if (ts->x_offset + tw > right) right = ts->x_offset + tw;
+		if (c.g.tile_h - th + ts->y_offset < top) top = c.g.tile_h - th + ts->y_offset;
+		if (c.g.tile_h + ts->y_offset > bottom) bottom = c.g.tile_h + ts->y_offset;
+	}
+
+	r.all = 0;
+	r.x0 = x - layer->offsetx - right;
+	r.x1 = x + w - layer->offsetx - left;
+	r.y0 = y - layer->offsety - bottom;
+	r.y1 = y + h - layer->offsety - top;
+	walk(&(c.g), map, layer, &r, cull, &c);
+	return c.count;
+}
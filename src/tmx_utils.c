@@ -6,284 +6,628 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h> /* is */
+#include <errno.h>
+
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "tmx.h"
 #include "tmx_utils.h"
 
 /*
-	BASE 64
+	ZLib
 */
 
-static const char b64enc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ" "abcdefghijklmnopqrstuvwxyz" "0123456789" "+/";
+#ifdef WANT_ZLIB
 
-char* b64_encode(const char *source, unsigned int length) {
-	unsigned int i, mlen, r_pos;
-	unsigned short dif, j;
-	unsigned int frame = 0;
-	char out[5];
-	char *res;
+static void* z_alloc(void *opaque, unsigned int items, unsigned int size) {
+	tmx_loader *ctx = (tmx_loader*)opaque;
+	return ctx->alloc_func(NULL, items *size);
+}
 
-	mlen = 4 * length/3 + 1; /* +1 : returns a null-terminated string */
-	if (length%3) {
-		mlen += 4;
-	}
+static void z_free(void *opaque, void *address) {
+	tmx_loader *ctx = (tmx_loader*)opaque;
+	ctx->free_func(address);
+}
 
-	res = (char*) tmx_alloc_func(NULL, mlen);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
-	}
-	res[mlen-1] = '\0';
-	out[4] = '\0';
-
-	for (i=0; i<length; i+=3) {
-		/*frame = 0; clean frame not needed because '>>' inserts '0' */
-		dif = (length-i)/3 ? 3 : (length-i)%3; /* number of byte to read */
-		for (j=0; j<dif; j++) {
-			memcpy(((char*)&frame)+2-j, source+i+j, 1); /* copy 3 bytes in reverse order */
-		}
-		/*
-		now 3 cases :
-		. 3B red => 4chars
-		. 2B red => 3chars + "="
-		. 1B red => 2chars + "=="
-		*/
-		for (j=0; j<dif+1; j++) {
-			out[j] = (char)((frame & 0xFC0000) >> 18); /* first 6 bits */
-			out[j] = b64enc[(int)out[j]];
-			frame = frame << 6; /* next 6b word */
-		}
-		if (dif == 1) {
-			out[2] = out [3] = '=';
-		} else if (dif == 2) {
-			out [3] = '=';
-		}
-		r_pos = (i/3)*4;
-		strcpy(res+r_pos, out);
+/* the output of the decoder is `out`, the layer must be exactly `count` gids long */
+int b64z_init(tmx_loader *ctx, b64z_decoder *dec, const gid_output *out, size_t count) {
+	int ret;
+
+	dec->b64_len = dec->pad = 0;
+	dec->ended = dec->active = 0;
+	dec->out = *out;
+	dec->count = count;
+	dec->flushed = 0;
+
+	if (out->len * sizeof(int32_t) > 0xFFFFFFFFUL) {
+		tmx_err(ctx, E_INVAL, "zlib: layer too big");
+		return 0;
 	}
-	return res;
-}
 
-static char b64_value(char c) {
-	if (c>='A' && c<='Z') {
-		return c - 'A';
-	} else if (c>='a' && c<='z') {
-		return c - 'a' + 26;
-	} else if (c>='0' && c<='9') {
-		return c - '0' + 52;
-	} else if (c=='+') {
-		return 62;
-	} else if (c=='/') {
-		return 63;
-	} else if (c=='=') {
+	memset(&(dec->strm), 0, sizeof(z_stream));
+	dec->strm.zalloc = z_alloc;
+	dec->strm.zfree = z_free;
+	dec->strm.opaque = ctx;
+	dec->strm.next_out = (Bytef*)out->gids;
+	dec->strm.avail_out = (uInt)((out->len < count? out->len: count) * sizeof(int32_t));
+
+	/* 15+32 to enable zlib and gzip decoding with automatic header detection */
+	if ((ret=inflateInit2(&(dec->strm), 15 + 32)) != Z_OK) {
+		tmx_err(ctx, E_UNKN, "zlib: inflateInit2 returned %d", ret);
 		return 0;
 	}
-	return -1;
+	dec->active = 1;
+	return 1;
 }
 
-char* b64_decode(const char *source, unsigned int *rlength) { /* NULL terminated string */
-	char *res, v;
-	short j;
-	unsigned int i;
-	unsigned int in = 0;
-	unsigned int src_len = (unsigned int)(strlen(source));
+/* number of gids in the output buffer */
+static size_t b64z_pending(b64z_decoder *dec) {
+	return (size_t)(dec->strm.next_out - (Bytef*)dec->out.gids) / sizeof(int32_t);
+}
 
-	if (!source) {
-		tmx_err(E_INVAL, "Base64: invalid argument: source is NULL");
-		return NULL;
+/* the output buffer is full, hands it to out.flush if more gids are expected */
+static int b64z_next_buffer(tmx_loader *ctx, b64z_decoder *dec) {
+	size_t len = b64z_pending(dec);
+	if (!dec->out.flush || dec->flushed + len >= dec->count) {
+		return 1; /* inflate then fails with Z_BUF_ERROR if there are more tiles */
 	}
+	if (!dec->out.flush(ctx, dec->out.arg, len)) return 0;
+	dec->flushed += len;
+	len = dec->count - dec->flushed;
+	dec->strm.next_out = (Bytef*)dec->out.gids;
+	dec->strm.avail_out = (uInt)((dec->out.len < len? dec->out.len: len) * sizeof(int32_t));
+	return 1;
+}
 
-	if (src_len%4) {
-		tmx_err(E_BDATA, "Base64: invalid source");
-		return NULL; /* invalid source */
+void b64z_release(b64z_decoder *dec) {
+	if (dec->active) {
+		inflateEnd(&(dec->strm));
+		dec->active = 0;
 	}
+}
 
-	*rlength = (src_len/4)*3;
-	res = (char*) tmx_alloc_func(NULL, *rlength);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
-	}
+/* decodes the pending base64 characters and inflates them */
+static int b64z_flush(tmx_loader *ctx, b64z_decoder *dec) {
+	int ret;
 
-	for (i=0; i<src_len; i+=4) {
-		in = 0;
+	if (dec->b64_len % 4) {
+		tmx_err(ctx, E_BDATA, "Base64: invalid source");
+		return 0;
+	}
+	if (!b64_decode_into(ctx, dec->b64, dec->b64_len, (char*)dec->raw)) return 0;
+
+	dec->strm.next_in = dec->raw;
+	dec->strm.avail_in = dec->b64_len / 4 * 3 - dec->pad;
+	dec->b64_len = 0;
+
+	while (dec->strm.avail_in && !dec->ended) {
+		if (dec->strm.avail_out == 0 && !b64z_next_buffer(ctx, dec)) return 0;
+		ret = inflate(&(dec->strm), Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			dec->ended = 1; /* trailing bytes are ignored */
+		} else if (ret == Z_BUF_ERROR) { /* the output is full */
+			tmx_err(ctx, E_ZDATA, "zlib: layer contains too many tiles");
+			return 0;
+		} else if (ret != Z_OK) {
+			tmx_err(ctx, E_ZDATA, "zlib: inflate returned %d", ret);
+			return 0;
+		}
+	}
+	return 1;
+}
 
-		for (j=0; j<4; j++) {
-			v = b64_value(source[i+j]);
-			if (v == -1) {
-				tmx_err(E_BDATA, "Base64: invalid char '%c' in source", source[i+j]);
-				goto cleanup;
-			}
-			in = in << 6;
-			in += v; /* add 6b */
+int b64z_feed(tmx_loader *ctx, b64z_decoder *dec, const char *chunk, size_t len) {
+	const char *end = chunk + len;
+	char c;
+
+	for (; chunk < end; chunk++) {
+		c = *chunk;
+		if (c == ' ' || c == '\n' || c == '\r' || c == '\t') continue;
+		if (c == '=') {
+			dec->pad++;
+		} else if (dec->pad) { /* padding must be at the end */
+			dec->pad = 3;
 		}
-		for (j=0; j<3; j++) {
-			memcpy(res+(i/4)*3+j, ((char*)&in)+2-j, 1); /* copy 3 bytes in reverse order */
+		if (dec->pad > 2) {
+			tmx_err(ctx, E_BDATA, "Base64: invalid source");
+			b64z_release(dec);
+			return 0;
+		}
+		dec->b64[dec->b64_len++] = c;
+		if (dec->b64_len == B64Z_CHUNK) {
+			if (!b64z_flush(ctx, dec)) {
+				b64z_release(dec);
+				return 0;
+			}
+			dec->pad = dec->pad? 3: 0; /* nothing but blanks may follow */
 		}
 	}
+	return 1;
+}
 
-	if (source[src_len-1] == '=') {
-		(*rlength)--;
+int b64z_finish(tmx_loader *ctx, b64z_decoder *dec) {
+	int ret = 1;
+
+	if (dec->b64_len || dec->pad < 3) {
+		ret = b64z_flush(ctx, dec);
+	}
+	if (ret && (dec->strm.avail_out != 0 || dec->flushed + b64z_pending(dec) != dec->count)) {
+		tmx_err(ctx, E_ZDATA, "zlib: layer contains not enough tiles");
+		ret = 0;
 	}
-	if (source[src_len-2] == '=') {
-		(*rlength)--;
+	if (ret && !dec->ended) { /* the end of the stream (and its checksum) is missing */
+		tmx_err(ctx, E_ZDATA, "zlib: truncated data");
+		ret = 0;
 	}
+	b64z_release(dec);
+	if (ret && dec->out.flush) {
+		ret = dec->out.flush(ctx, dec->out.arg, b64z_pending(dec));
+	}
+	return ret;
+}
 
-	return res;
+#else
+
+int b64z_init(tmx_loader *ctx, b64z_decoder *dec, const gid_output *out UNUSED, size_t count UNUSED) {
+	dec->active = 0;
+	tmx_err(ctx, E_FONCT, "This library was not built with the zlib/gzip support");
+	return 0;
+}
+
+int b64z_feed(tmx_loader *ctx UNUSED, b64z_decoder *dec UNUSED, const char *chunk UNUSED, size_t len UNUSED) {
+	return 0;
+}
+
+int b64z_finish(tmx_loader *ctx UNUSED, b64z_decoder *dec UNUSED) {
+	return 0;
+}
 
-cleanup:
-	tmx_free_func(res);
-	return NULL;
+void b64z_release(b64z_decoder *dec UNUSED) {
 }
 
+#endif /* WANT_ZLIB */
+
 /*
-	ZLib
+	Chunked layers
 */
 
-#ifdef WANT_ZLIB
-#include <zlib.h>
-
-void* z_alloc(void *opaque UNUSED, unsigned int items, unsigned int size) {
-	return tmx_alloc_func(NULL, items *size);
+static int band_is_empty(const int32_t *band, size_t stride, unsigned int w, unsigned int h) {
+	unsigned int x, y;
+	for (y=0; y<h; y++) {
+		for (x=0; x<w; x++) {
+			if (band[x]) return 0;
+		}
+		band += stride;
+	}
+	return 1;
 }
 
-void z_free(void *opaque UNUSED, void *address) {
-	tmx_free_func(address);
+/* gid_output.flush: `len` gids of the band (a whole number of rows) are copied in the chunks */
+static int chunk_flush(tmx_loader *ctx, void *arg, size_t len) {
+	chunk_builder *cb = (chunk_builder*)arg;
+	tmx_layer_chunks *chunks = cb->layer->chunks;
+	unsigned int width = cb->layer->width;
+	unsigned int rows = (unsigned int)(len / width);
+	unsigned int cx, x, w, y;
+	int32_t *chunk, **slot;
+	const int32_t *src;
+
+	slot = chunks->chunks + (size_t)(cb->row / TMX_CHUNK_SIZE) * chunks->cols;
+	for (cx=0; cx<chunks->cols; cx++, slot++) {
+		x = cx * TMX_CHUNK_SIZE;
+		w = width - x < TMX_CHUNK_SIZE? width - x: TMX_CHUNK_SIZE;
+		src = cb->band + x;
+		if (band_is_empty(src, width, w, rows)) continue;
+
+		if (!(chunk = (int32_t*)map_alloc(ctx, TMX_CHUNK_SIZE * TMX_CHUNK_SIZE * sizeof(int32_t)))) return 0;
+		if (w < TMX_CHUNK_SIZE || rows < TMX_CHUNK_SIZE) { /* on the edges of the layer */
+			memset(chunk, 0, TMX_CHUNK_SIZE * TMX_CHUNK_SIZE * sizeof(int32_t));
+		}
+		for (y=0; y<rows; y++) {
+			memcpy(chunk + y * TMX_CHUNK_SIZE, src, w * sizeof(int32_t));
+			src += width;
+		}
+		*slot = chunk;
+		chunks->count++;
+	}
+	cb->row += rows;
+	return 1;
 }
 
-char* zlib_decompress(const char *source, unsigned int slength, unsigned int rlength) {
-	int ret;
-	char *res = NULL;
-	z_stream strm;
+/* allocates the (empty) chunks of the layer and the band */
+static int chunk_builder_init(tmx_loader *ctx, chunk_builder *cb, tmx_layer *layer) {
+	tmx_layer_chunks *chunks;
+	size_t len;
+
+	if (!(chunks = (tmx_layer_chunks*)map_alloc(ctx, sizeof(tmx_layer_chunks)))) return 0;
+	memset(chunks, 0, sizeof(tmx_layer_chunks));
+	layer->chunks = chunks;
+	chunks->cols = (layer->width + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE;
+	chunks->rows = (layer->height + TMX_CHUNK_SIZE - 1) / TMX_CHUNK_SIZE;
+
+	len = (size_t)chunks->cols * chunks->rows;
+	if (len) {
+		if (!(chunks->chunks = (int32_t**)map_alloc(ctx, len * sizeof(int32_t*)))) return 0;
+		memset(chunks->chunks, 0, len * sizeof(int32_t*));
+		if (!(cb->band = (int32_t*)ctx->alloc_func(NULL, (size_t)layer->width * TMX_CHUNK_SIZE * sizeof(int32_t)))) {
+			ctx->err = E_ALLOC;
+			return 0;
+		}
+	}
+	cb->layer = layer;
+	cb->row = 0;
+	cb->free_func = ctx->free_func;
+	return 1;
+}
 
-	if (!source) {
-		tmx_err(E_INVAL, "zlib_decompress: invalid argument: source is NULL");
-		return NULL;
+static void chunk_builder_release(chunk_builder *cb) {
+	if (cb->band) {
+		cb->free_func(cb->band);
+		cb->band = NULL;
 	}
+}
 
-	strm.zalloc = z_alloc;
-	strm.zfree = z_free;
-	strm.opaque = Z_NULL;
-	strm.next_in = (Bytef*)source;
-	strm.avail_in = slength;
+/*
+	Layer data decoders
+*/
 
-	res = (char*) tmx_alloc_func(NULL, rlength);
-	if (!res) {
-		tmx_errno = E_ALLOC;
-		return NULL;
-	}
+/* allocates the storage of the layer and prepares the decoder for the payload
+   `line` is the line of the payload in the source file, for error messages */
+int data_decoder_init(tmx_loader *ctx, data_decoder *dec, enum enccmp_t type, tmx_layer *layer, long line) {
+	size_t gids_count = (size_t)layer->width * layer->height;
+	gid_output out;
 
-	strm.next_out = (Bytef*)res;
-	strm.avail_out = rlength;
+	dec->type = type;
+	dec->active = 0;
+	memset(&(dec->chunks), 0, sizeof(chunk_builder));
+	memset(&out, 0, sizeof(gid_output));
 
-	/* 15+32 to enable zlib and gzip decoding with automatic header detection */
-	if ((ret=inflateInit2(&strm, 15 + 32)) != Z_OK) {
-		tmx_err(E_UNKN, "zlib_decompress: inflateInit2 returned %d\n", ret);
-		goto cleanup;
+	if (ctx->flags & TMX_LOAD_CHUNKED) {
+		if (!chunk_builder_init(ctx, &(dec->chunks), layer)) {
+			chunk_builder_release(&(dec->chunks));
+			return 0;
+		}
+		out.gids = dec->chunks.band;
+		out.len = gids_count? (size_t)layer->width * TMX_CHUNK_SIZE: 0;
+		out.flush = chunk_flush;
+		out.arg = &(dec->chunks);
+	}
+	else {
+		if (!(layer->content.gids = (int32_t*)map_alloc(ctx, gids_count * sizeof(int32_t)))) {
+			return 0;
+		}
+		out.gids = layer->content.gids;
+		out.len = gids_count;
 	}
 
-	ret = inflate(&strm, Z_FINISH);
-	inflateEnd(&strm);
+	if (type==CSV) {
+		csv_init(&(dec->dec.csv), &out, gids_count, line);
+	}
+	else if (type==B64Z) {
+		if (!b64z_init(ctx, &(dec->dec.b64z), &out, gids_count)) {
+			chunk_builder_release(&(dec->chunks));
+			return 0;
+		}
+	}
+	dec->active = 1;
+	return 1;
+}
 
-	if (ret != Z_OK && ret != Z_STREAM_END) {
-		tmx_err(E_ZDATA, "zlib_decompress: inflate returned %d\n", ret);
-		goto cleanup;
+int data_decoder_feed(tmx_loader *ctx, data_decoder *dec, const char *chunk, size_t len) {
+	int ret = 0;
+	if (dec->type==CSV) {
+		ret = csv_feed(ctx, &(dec->dec.csv), chunk, len);
 	}
+	else if (dec->type==B64Z) {
+		ret = b64z_feed(ctx, &(dec->dec.b64z), chunk, len);
+	}
+	if (!ret) data_decoder_release(dec); /* the decoders release their resources on failure */
+	return ret;
+}
 
-	if (strm.avail_out != 0) {
-		tmx_err(E_ZDATA, "layer contains not enough tiles");
-		goto cleanup;
+int data_decoder_finish(tmx_loader *ctx, data_decoder *dec) {
+	int ret = 0;
+	if (dec->type==CSV) {
+		ret = csv_finish(ctx, &(dec->dec.csv));
 	}
-	if (strm.avail_in != 0) {
-		/* FIXME There is remains in the source */
+	else if (dec->type==B64Z) {
+		ret = b64z_finish(ctx, &(dec->dec.b64z));
 	}
+	dec->active = 0;
+	chunk_builder_release(&(dec->chunks));
+	return ret;
+}
 
-	return res;
-cleanup:
-	tmx_free_func(res);
-	return NULL;
+void data_decoder_release(data_decoder *dec) {
+	if (dec->active && dec->type==B64Z) {
+		b64z_release(&(dec->dec.b64z));
+	}
+	dec->active = 0;
+	chunk_builder_release(&(dec->chunks));
 }
 
-#else
+/*
+	Lazy layers
+*/
+
+/* keeps the payload of the layer as it was read, with the allocation functions used to decode it later
+   the payload stays out of the arena, it is freed with the layer (see tmx_map_free) */
+lazy_data* lazy_data_create(tmx_loader *ctx, enum enccmp_t type, long line, char *text, size_t len) {
+	lazy_data *res;
 
-char* zlib_decompress(const char *source, unsigned int slength, unsigned int rlength) {
-	tmx_err(E_FONCT, "This library was not built with the zlib/gzip support");
-	return NULL;
+	if (!(res = (lazy_data*)map_alloc(ctx, sizeof(lazy_data)))) {
+		ctx->free_func(text);
+		return NULL;
+	}
+	res->alloc_func = ctx->alloc_func;
+	res->free_func = ctx->free_func;
+	res->flags = ctx->flags & TMX_LOAD_CHUNKED;
+	res->type = type;
+	res->line = line;
+	res->len = len;
+	res->text = text;
+	res->text[len] = '\0';
+	res->own_text = 1;
+	return res;
 }
 
-#endif /* WANT_ZLIB */
+/* decodes the payload of a lazy layer, `ctx` must not have an arena */
+int lazy_decode(tmx_loader *ctx, tmx_layer *layer) {
+	lazy_data *lz = layer->lazy;
+	data_decoder dec;
+	int ret;
 
-/*
-	Layer data decoders
-*/
+	if (!data_decoder_init(ctx, &dec, lz->type, layer, lz->line)) {
+		free_layer_data(layer, lz->free_func);
+		return 0;
+	}
+	ret = data_decoder_feed(ctx, &dec, lz->text, lz->len) && data_decoder_finish(ctx, &dec);
+	data_decoder_release(&dec);
+	if (!ret) free_layer_data(layer, lz->free_func);
+	return ret;
+}
 
-int data_decode(const char *source, enum enccmp_t type, size_t gids_count, int32_t **gids) {
-	char *b64dec;
-	unsigned int b64_len, i;
+/* rectangle of a layer being decoded by lazy_decode_region */
+typedef struct {
+	unsigned int width;       /* of the layer */
+	unsigned int x, y, w, h;  /* of the region */
+	int32_t *out;
+	int32_t *buf;             /* whole rows of the layer */
+	unsigned int row;         /* row of the first gid of `buf` */
+} region_window;
+
+/* gid_output.flush: copies the part of the rows in `buf` that is in the region */
+static int region_flush(tmx_loader *ctx UNUSED, void *arg, size_t len) {
+	region_window *rw = (region_window*)arg;
+	unsigned int rows = (unsigned int)(len / rw->width);
+	unsigned int i, r;
+
+	for (i=0; i<rows; i++) {
+		r = rw->row + i;
+		if (r >= rw->y && r < rw->y + rw->h) {
+			memcpy(rw->out + (size_t)(r - rw->y) * rw->w, rw->buf + (size_t)i * rw->width + rw->x, rw->w * sizeof(int32_t));
+		}
+	}
+	rw->row += rows;
+	return 1;
+}
 
-	if (type==CSV) {
-		if (!(*gids = (int32_t*)tmx_alloc_func(NULL, gids_count * sizeof(int32_t)))) {
-			tmx_errno = E_ALLOC;
-			return 0;
+#define REGION_FEED 16384 /* the payload is fed by slices, to stop once the region is decoded */
+
+/* decodes a region of a lazy layer, without decoding the whole layer:
+   CSV values before and after the region are skipped, base64/zlib data is
+   inflated in a buffer of a few rows and decoding stops after the last row */
+int lazy_decode_region(tmx_loader *ctx, const tmx_layer *layer, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int32_t *out) {
+	lazy_data *lz = layer->lazy;
+	region_window rw;
+	gid_output output;
+	csv_decoder csv;
+	b64z_decoder b64z;
+	size_t rows, start, end, pos, len;
+	long line = lz->line, end_line = 0;
+	int ret = 1;
+
+	if (!w || !h) return 1;
+
+	rw.width = layer->width;
+	rw.x = x; rw.y = y; rw.w = w; rw.h = h;
+	rw.out = out;
+	rows = 4096 / layer->width? 4096 / layer->width: 1;
+	if (!(rw.buf = (int32_t*)ctx->alloc_func(NULL, rows * layer->width * sizeof(int32_t)))) {
+		ctx->err = E_ALLOC;
+		return 0;
+	}
+	output.gids = rw.buf;
+	output.len = rows * layer->width;
+	output.flush = region_flush;
+	output.arg = &rw;
+
+	if (lz->type == CSV) {
+		/* the rows of the region, from the first value of row y to the last value of row y+h-1 */
+		start = csv_skip(lz->text, lz->len, (size_t)y * layer->width, &line);
+		end = start + csv_skip(lz->text + start, lz->len - start, (size_t)h * layer->width, &end_line);
+		if (end > start && end <= lz->len && lz->text[end-1] == ',') end--;
+		rw.row = y;
+		csv_init(&csv, &output, (size_t)(y + h) * layer->width, line);
+		csv.index = (size_t)y * layer->width; /* for the error messages */
+		ret = csv_feed(ctx, &csv, lz->text + start, end - start) && csv_finish(ctx, &csv);
+	}
+	else if (lz->type == B64Z) {
+		rw.row = 0;
+		ret = b64z_init(ctx, &b64z, &output, (size_t)layer->width * layer->height);
+		for (pos = 0; ret && pos < lz->len && rw.row < y + h; pos += len) {
+			len = lz->len - pos < REGION_FEED? lz->len - pos: REGION_FEED;
+			ret = b64z_feed(ctx, &b64z, lz->text + pos, len);
 		}
-		for (i=0; i<gids_count; i++) {
-			if (sscanf(source, "%d", (*gids)+i) != 1) {
-				tmx_err(E_CDATA, "error in CVS while reading tile #%d", i);
-				return 0;
-			}
-			if (!(source = strchr(source, ',')) && i!=gids_count-1) {
-				tmx_err(E_CDATA, "error in CVS after reading tile #%d", i);
-				return 0;
-			}
-			source++;
+		if (ret && rw.row < y + h) {
+			ret = b64z_finish(ctx, &b64z);
 		}
-	}
-	else if (type==B64Z) {
-		if (!(b64dec = b64_decode(source, &b64_len))) return 0;
-		*gids = (int32_t*)zlib_decompress(b64dec, b64_len, (unsigned int)(gids_count*sizeof(int32_t)));
-		tmx_free_func(b64dec);
-		if (!(*gids)) return 0;
+		b64z_release(&b64z); /* stopped after the region */
 	}
 
-	return 1;
+	ctx->free_func(rw.buf);
+	return ret;
 }
 
 /*
 	Node allocation
 */
 
-static void* node_alloc(size_t size) {
-	void *res = tmx_alloc_func(NULL, size);
+/*
+	The arena is a list of blocks, allocations are carved out of the head
+	block, bigger allocations get their own block.
+	Everything is released at once by arena_free.
+*/
+
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(s) (((s) + (ARENA_ALIGN-1)) & ~(size_t)(ARENA_ALIGN-1))
+#define ARENA_MIN_BLOCK ((size_t)64 * 1024)
+#define ARENA_MAX_BLOCK ((size_t)1024 * 1024)
+
+typedef struct _arena_block {
+	struct _arena_block *next;
+	size_t size, used; /* of the data following the header */
+} arena_block;
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(arena_block))
+
+struct _tmx_arena {
+	arena_block *head;
+	size_t next_size; /* size of the next block, doubles up to ARENA_MAX_BLOCK */
+};
+
+static arena_block* arena_new_block(tmx_loader *ctx, size_t size) {
+	arena_block *res = (arena_block*)ctx->alloc_func(NULL, ARENA_HEADER + size);
+	if (!res) {
+		ctx->err = E_ALLOC;
+		return NULL;
+	}
+	res->next = NULL;
+	res->size = size;
+	res->used = 0;
+	return res;
+}
+
+tmx_arena* arena_create(tmx_loader *ctx) {
+	tmx_arena *res;
+	arena_block *first;
+
+	if (!(first = arena_new_block(ctx, ARENA_MIN_BLOCK))) return NULL;
+	/* the arena lives in its first block */
+	res = (tmx_arena*)((char*)first + ARENA_HEADER);
+	first->used = ARENA_ROUND(sizeof(tmx_arena));
+	res->head = first;
+	res->next_size = ARENA_MIN_BLOCK * 2;
+	return res;
+}
+
+void* arena_alloc(tmx_loader *ctx, tmx_arena *arena, size_t size) {
+	arena_block *blk = arena->head;
+
+	size = ARENA_ROUND(size);
+	if (blk->size - blk->used >= size) {
+		blk->used += size;
+		return (char*)blk + ARENA_HEADER + blk->used - size;
+	}
+
+	if (size > arena->next_size / 4) {
+		/* dedicated block, inserted after the head to keep filling it */
+		if (!(blk = arena_new_block(ctx, size))) return NULL;
+		blk->used = size;
+		blk->next = arena->head->next;
+		arena->head->next = blk;
+		return (char*)blk + ARENA_HEADER;
+	}
+
+	if (!(blk = arena_new_block(ctx, arena->next_size))) return NULL;
+	if (arena->next_size < ARENA_MAX_BLOCK) arena->next_size *= 2;
+	blk->used = size;
+	blk->next = arena->head;
+	arena->head = blk;
+	return (char*)blk + ARENA_HEADER;
+}
+
+void arena_free(tmx_arena *arena, void (*free_func)(void*)) {
+	arena_block *blk, *next;
+	if (arena) {
+		/* the first block (holding the arena) is the last of the list */
+		for (blk = arena->head; blk; blk = next) {
+			next = blk->next;
+			free_func(blk);
+		}
+	}
+}
+
+/* moves the blocks of `other` in `arena`, they are released by arena_free(arena) */
+void arena_merge(tmx_arena *arena, tmx_arena *other) {
+	arena_block *last;
+	if (other) {
+		for (last = other->head; last->next; last = last->next);
+		/* after the head, which keeps being filled */
+		last->next = arena->head->next;
+		arena->head->next = other->head;
+	}
+}
+
+/* allocates memory owned by the map being loaded (in its arena if it has one) */
+void* map_alloc(tmx_loader *ctx, size_t size) {
+	void *res;
+	if (ctx->arena) {
+		return arena_alloc(ctx, ctx->arena, size);
+	}
+	if (!(res = ctx->alloc_func(NULL, size))) {
+		ctx->err = E_ALLOC;
+	}
+	return res;
+}
+
+static void* node_alloc(tmx_loader *ctx, size_t size) {
+	void *res = map_alloc(ctx, size);
 	if (res) {
 		memset(res, 0, size);
-	} else {
-		tmx_errno = E_ALLOC;
 	}
 	return res;
 }
 
-tmx_property* alloc_prop(void) {
-	return (tmx_property*)node_alloc(sizeof(tmx_property));
+tmx_property* alloc_prop(tmx_loader *ctx) {
+	return (tmx_property*)node_alloc(ctx, sizeof(tmx_property));
+}
+
+tmx_properties* alloc_props(tmx_loader *ctx) {
+	return (tmx_properties*)node_alloc(ctx, sizeof(tmx_properties));
 }
 
-tmx_image* alloc_image(void) {
-	return (tmx_image*)node_alloc(sizeof(tmx_image));
+tmx_image* alloc_image(tmx_loader *ctx) {
+	return (tmx_image*)node_alloc(ctx, sizeof(tmx_image));
 }
 
-tmx_object* alloc_object(void) {
-	tmx_object *res = (tmx_object*)node_alloc(sizeof(tmx_object));
+tmx_object* alloc_object(tmx_loader *ctx) {
+	tmx_object *res = (tmx_object*)node_alloc(ctx, sizeof(tmx_object));
 	if (res) {
 		res->visible = 1;
 	}
 	return res;
 }
 
-tmx_object_group* alloc_objgr(void) {
-	return (tmx_object_group*)node_alloc(sizeof(tmx_object_group));
+tmx_object_group* alloc_objgr(tmx_loader *ctx) {
+	tmx_object_group *res = (tmx_object_group*)node_alloc(ctx, sizeof(tmx_object_group));
+	if (res) {
+		res->alloc_func = ctx->alloc_func;
+		res->free_func = ctx->free_func;
+	}
+	return res;
 }
 
-tmx_layer* alloc_layer(void) {
-	tmx_layer *res = (tmx_layer*)node_alloc(sizeof(tmx_layer));
+tmx_layer* alloc_layer(tmx_loader *ctx) {
+	tmx_layer *res = (tmx_layer*)node_alloc(ctx, sizeof(tmx_layer));
 	if (res) {
 		res->opacity = 1.0f;
 		res->visible = 1;
@@ -291,39 +635,426 @@ tmx_layer* alloc_layer(void) {
 	return res;
 }
 
-tmx_tile* alloc_tiles(int count) {
-	return (tmx_tile*)node_alloc(count * sizeof(tmx_tile));
+tmx_tile* alloc_tiles(tmx_loader *ctx, int count) {
+	return (tmx_tile*)node_alloc(ctx, count * sizeof(tmx_tile));
 }
 
-tmx_tileset* alloc_tileset(void) {
-	return (tmx_tileset*)node_alloc(sizeof(tmx_tileset));
+tmx_tileset* alloc_tileset(tmx_loader *ctx) {
+	return (tmx_tileset*)node_alloc(ctx, sizeof(tmx_tileset));
 }
 
-tmx_map* alloc_map(void) {
-	return (tmx_map*)node_alloc(sizeof(tmx_map));
+tmx_tileset_list* alloc_tileset_list(tmx_loader *ctx) {
+	return (tmx_tileset_list*)node_alloc(ctx, sizeof(tmx_tileset_list));
+}
+
+/* with TMX_LOAD_ARENA the map creates the arena all its nodes will be allocated from */
+tmx_map* alloc_map(tmx_loader *ctx) {
+	tmx_map *res;
+	ctx->arena = NULL;
+	if ((ctx->flags & TMX_LOAD_ARENA) && !(ctx->arena = arena_create(ctx))) return NULL;
+	res = (tmx_map*)node_alloc(ctx, sizeof(tmx_map));
+	if (res) {
+		res->arena = ctx->arena;
+		res->alloc_func = ctx->alloc_func;
+		res->free_func = ctx->free_func;
+		res->img_free_func = ctx->img_free_func;
+		ctx->images = &(res->images);
+	}
+	return res;
 }
 
 /*
-	Misc
+	String pool
+	Set of the strings of a map, open addressing table (never more than half full)
+	The table is allocated with the functions of the loader, the strings with
+	map_alloc: they are in the arena of the map if it has one
 */
 
-/* Sets tile->tileset and tile->ul_x,y */
-int set_tiles_runtime_props(tmx_tileset *ts) {
-	unsigned int i, j;
-	unsigned int tiles_x_count, ts_w, tx, ty;
+struct _tmx_str_pool {
+	unsigned int count, mask;
+	char **table;
+};
 
-	if (ts == NULL) {
-		tmx_err(E_INVAL, "set_tiles_runtime_props: invalid argument: ts is NULL");
+/* FNV-1a */
+unsigned int str_hash(const char *str) {
+	uint32_t h = 2166136261U;
+	while (*str) {
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	}
+	return (unsigned int)h;
+}
+
+static unsigned int str_slot(char **table, unsigned int mask, const char *str) {
+	unsigned int i = str_hash(str) & mask;
+	while (table[i] && strcmp(table[i], str)) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static int str_pool_grow(tmx_loader *ctx, str_pool *pool) {
+	unsigned int mask = pool->table? pool->mask * 2 + 1: 255, i;
+	char **table;
+
+	if (!(table = (char**)ctx->alloc_func(NULL, ((size_t)mask + 1) * sizeof(char*)))) {
+		tmx_err(ctx, E_ALLOC, "str_intern: unable to allocate the string pool");
 		return 0;
 	}
+	memset(table, 0, ((size_t)mask + 1) * sizeof(char*));
+	for (i=0; pool->table && i<=pool->mask; i++) {
+		if (pool->table[i]) {
+			table[str_slot(table, mask, pool->table[i])] = pool->table[i];
+		}
+	}
+	ctx->free_func(pool->table);
+	pool->table = table;
+	pool->mask = mask;
+	return 1;
+}
+
+/* returns the string of the pool of the map being loaded (ctx->strings) equal to `str`, adds it if needed */
+char* str_intern(tmx_loader *ctx, const char *str) {
+	str_pool *pool = ctx->strings;
+	unsigned int slot;
+	size_t len;
+
+	if (!pool) {
+		if (!(pool = (str_pool*)ctx->alloc_func(NULL, sizeof(str_pool)))) {
+			tmx_err(ctx, E_ALLOC, "str_intern: unable to allocate the string pool");
+			return NULL;
+		}
+		memset(pool, 0, sizeof(str_pool));
+		ctx->strings = pool;
+	}
+	if ((pool->count + 1) * 2 > (pool->table? pool->mask + 1: 0) && !str_pool_grow(ctx, pool)) return NULL;
+
+	slot = str_slot(pool->table, pool->mask, str);
+	if (!pool->table[slot]) {
+		len = strlen(str) + 1;
+		if (!(pool->table[slot] = (char*)map_alloc(ctx, len))) {
+			tmx_err(ctx, E_ALLOC, "str_intern: unable to allocate a string");
+			return NULL;
+		}
+		memcpy(pool->table[slot], str, len);
+		pool->count++;
+	}
+	return pool->table[slot];
+}
+
+/* frees the pool, and the strings if they are not in an arena */
+void str_pool_free(str_pool *pool, void (*free_func)(void*), int free_strings) {
+	unsigned int i;
+	if (pool) {
+		for (i=0; free_strings && pool->table && i<=pool->mask; i++) {
+			free_func(pool->table[i]);
+		}
+		free_func(pool->table);
+		free_func(pool);
+	}
+}
+
+/*
+	Properties
+*/
+
+
+/* slot of the property named `name` in the table of `props`, or of the empty slot where it goes
+   (linear probing, the table is never more than half full) */
+unsigned int props_slot(const tmx_properties *props, const char *name) {
+	unsigned int i = str_hash(name) & props->table_mask;
+	while (props->table[i] && strcmp(props->table[i]->name, name)) {
+		i = (i + 1) & props->table_mask;
+	}
+	return i;
+}
+
+/* (re)builds the hash table of `props` from its list, the last of several properties with the same name wins */
+int props_index(tmx_loader *ctx, tmx_properties *props) {
+	unsigned int len = 2;
+	tmx_property *p;
+
+	if (props->table && !ctx->arena) {
+		ctx->free_func(props->table);
+	}
+	props->table = NULL;
+	props->table_mask = 0;
+	if (!props->count) return 1;
+
+	while (len < props->count * 2) len *= 2;
+	if (!(props->table = (tmx_property**)map_alloc(ctx, len * sizeof(tmx_property*)))) return 0;
+	memset(props->table, 0, len * sizeof(tmx_property*));
+	props->table_mask = len - 1;
+	for (p = props->head; p; p = p->next) {
+		props->table[props_slot(props, p->name)] = p;
+	}
+	return 1;
+}
 
-	/* reindex tiles (tiles are sorted, but not indexed correctly) */
-	for (i=ts->tilecount-1, j=0; j<ts->tilecount; j++, i--) {
-		if (ts->tiles[i].id > 0L && ts->tiles[i].id != i) {
-			memcpy(ts->tiles+(ts->tiles[i].id), ts->tiles+i, sizeof(tmx_tile));
+/*
+	Object arrays
+*/
+
+#define ARRAYS_ROUND(s) (((s) + 7) & ~(size_t)7)
+
+/* builds objgr->arrays, doubles first then pointers then 32 bits values, all in one block */
+int objgr_arrays_build(tmx_loader *ctx, tmx_object_group *objgr) {
+	tmx_object_arrays *a;
+	tmx_object *o;
+	size_t count = 0, points = 0, size;
+	unsigned int i;
+	int j;
+	char *p;
+
+	for (o = objgr->head; o; o = o->next) {
+		count++;
+		if ((o->shape == S_POLYGON || o->shape == S_POLYLINE) && o->points) points += (size_t)o->points_len;
+	}
+	if (count > 0xFFFFFFFFUL || points > 0xFFFFFFFFUL) {
+		tmx_err(ctx, E_INVAL, "objgr_arrays_build: too many objects");
+		return 0;
+	}
+
+	size = ARRAYS_ROUND(sizeof(tmx_object_arrays)) +
+	       count * (5 * sizeof(double) + sizeof(tmx_object*)) + points * 2 * sizeof(double) +
+	       ARRAYS_ROUND(count * (sizeof(unsigned int) + sizeof(enum tmx_shape) + 2 * sizeof(int)) + (count + 1) * sizeof(unsigned int));
+	if (!(p = (char*)map_alloc(ctx, size))) return 0;
+
+	a = (tmx_object_arrays*)p;    p += ARRAYS_ROUND(sizeof(tmx_object_arrays));
+	a->count = (unsigned int)count;
+	a->x = (double*)p;            p += count * sizeof(double);
+	a->y = (double*)p;            p += count * sizeof(double);
+	a->width = (double*)p;        p += count * sizeof(double);
+	a->height = (double*)p;       p += count * sizeof(double);
+	a->rotation = (double*)p;     p += count * sizeof(double);
+	a->points = (double*)p;       p += points * 2 * sizeof(double);
+	a->objects = (tmx_object**)p; p += count * sizeof(tmx_object*);
+	a->ids = (unsigned int*)p;    p += count * sizeof(unsigned int);
+	a->shapes = (enum tmx_shape*)p; p += count * sizeof(enum tmx_shape);
+	a->gids = (int*)p;            p += count * sizeof(int);
+	a->visible = (int*)p;         p += count * sizeof(int);
+	a->points_start = (unsigned int*)p;
+
+	points = 0;
+	for (o = objgr->head, i = 0; o; o = o->next, i++) {
+		a->objects[i] = o;
+		a->ids[i] = o->id;
+		a->shapes[i] = o->shape;
+		a->gids[i] = o->gid;
+		a->visible[i] = o->visible;
+		a->x[i] = o->x;
+		a->y[i] = o->y;
+		a->width[i] = o->width;
+		a->height[i] = o->height;
+		a->rotation[i] = o->rotation;
+		a->points_start[i] = (unsigned int)points;
+		if ((o->shape == S_POLYGON || o->shape == S_POLYLINE) && o->points) {
+			for (j=0; j<o->points_len; j++) {
+				a->points[2 * points] = o->points[j][0];
+				a->points[2 * points + 1] = o->points[j][1];
+				points++;
+			}
+		}
+	}
+	a->points_start[count] = (unsigned int)points;
+
+	objgr->arrays = a;
+	return 1;
+}
+
+/*
+	Gid indexed values
+*/
+
+int gid_values_init(gid_values *v, const tmx_map *map, unsigned int fill, void* (*alloc_func)(void*, size_t)) {
+	v->dir_count = map->dir_count;
+	v->fill = fill;
+	if (!(v->dirs = (unsigned int***)alloc_func(NULL, v->dir_count * sizeof(unsigned int**)))) return 0;
+	memset(v->dirs, 0, v->dir_count * sizeof(unsigned int**));
+	return 1;
+}
+
+unsigned int* gid_values_slot(gid_values *v, unsigned int gid, void* (*alloc_func)(void*, size_t)) {
+	unsigned int i, ***dir = v->dirs + (gid >> (TMX_GID_PAGE_BITS + TMX_GID_DIR_BITS)), **page;
+	if (!*dir) {
+		if (!(*dir = (unsigned int**)alloc_func(NULL, TMX_GID_DIR_SIZE * sizeof(unsigned int*)))) return NULL;
+		memset(*dir, 0, TMX_GID_DIR_SIZE * sizeof(unsigned int*));
+	}
+	page = *dir + ((gid >> TMX_GID_PAGE_BITS) & (TMX_GID_DIR_SIZE - 1));
+	if (!*page) {
+		if (!(*page = (unsigned int*)alloc_func(NULL, TMX_GID_PAGE_SIZE * sizeof(unsigned int)))) return NULL;
+		for (i=0; i<TMX_GID_PAGE_SIZE; i++) (*page)[i] = v->fill;
+	}
+	return *page + (gid & (TMX_GID_PAGE_SIZE - 1));
+}
+
+unsigned int gid_values_get(const gid_values *v, unsigned int gid) {
+	unsigned int **dir = v->dirs[gid >> (TMX_GID_PAGE_BITS + TMX_GID_DIR_BITS)], *page;
+	if (!dir || !(page = dir[(gid >> TMX_GID_PAGE_BITS) & (TMX_GID_DIR_SIZE - 1)])) return v->fill;
+	return page[gid & (TMX_GID_PAGE_SIZE - 1)];
+}
+
+void gid_values_free(gid_values *v, void (*free_func)(void*)) {
+	unsigned int d, p;
+	if (v->dirs) {
+		for (d=0; d<v->dir_count; d++) {
+			if (!v->dirs[d]) continue;
+			for (p=0; p<TMX_GID_DIR_SIZE; p++) free_func(v->dirs[d][p]);
+			free_func(v->dirs[d]);
+		}
+		free_func(v->dirs);
+		v->dirs = NULL;
+	}
+}
+
+/*
+	Tile planes
+*/
+
+#define PLANES_ROUND(s) (((s) + 15) & ~(size_t)15)
+
+/* builds layer->planes: the palette (pointers, then gids), then the index plane and the flip plane, in one block */
+int layer_planes_build(tmx_loader *ctx, const tmx_map *map, tmx_layer *layer) {
+	tmx_tile_planes *pl;
+	tmx_chunk chunk;
+	gid_values remap; /* palette index of each gid, 0 if not used yet */
+	size_t cells = (size_t)layer->width * layer->height, size, i;
+	unsigned int d, x, y, len = 1, *slot, idx;
+	uint32_t gid;
+	char *p;
+
+	if (!gid_values_init(&remap, map, 0, ctx->alloc_func)) {
+		tmx_err(ctx, E_ALLOC, "layer_planes_build: not enough memory");
+		return 0;
+	}
+
+	/* the palette holds the tiles used by the layer, in the order of their first cell */
+	memset(&chunk, 0, sizeof(tmx_chunk));
+	while (tmx_layer_next_chunk(layer, &chunk)) {
+		for (y=0; y<chunk.height; y++) {
+			for (x=0; x<chunk.width; x++) {
+				gid = (uint32_t)chunk.gids[y * chunk.stride + x] & TMX_FLIP_BITS_REMOVAL;
+				if (gid && gid < map->tilecount && TMX_GID_TILE(map, gid) && !gid_values_get(&remap, gid)) {
+					if (len == 0x10000) {
+						gid_values_free(&remap, ctx->free_func);
+						tmx_err(ctx, E_INVAL, "layer_planes_build: more than 65535 different tiles in layer '%s'", layer->name);
+						return 0;
+					}
+					if (!(slot = gid_values_slot(&remap, gid, ctx->alloc_func))) {
+						gid_values_free(&remap, ctx->free_func);
+						tmx_err(ctx, E_ALLOC, "layer_planes_build: not enough memory");
+						return 0;
+					}
+					*slot = len++;
+				}
+			}
+		}
+	}
+
+	size = PLANES_ROUND(sizeof(tmx_tile_planes)) + PLANES_ROUND(len * (sizeof(tmx_tile*) + sizeof(uint32_t))) +
+	       PLANES_ROUND(cells * sizeof(uint16_t)) + cells;
+	if (!(p = (char*)map_alloc(ctx, size))) {
+		gid_values_free(&remap, ctx->free_func);
+		return 0;
+	}
+	pl = (tmx_tile_planes*)p;    p += PLANES_ROUND(sizeof(tmx_tile_planes));
+	pl->palette_len = len;
+	pl->palette = (tmx_tile**)p; p += len * sizeof(tmx_tile*);
+	pl->palette_gids = (uint32_t*)p;
+	p = (char*)pl + PLANES_ROUND(sizeof(tmx_tile_planes)) + PLANES_ROUND(len * (sizeof(tmx_tile*) + sizeof(uint32_t)));
+	pl->tiles = (uint16_t*)p;    p += PLANES_ROUND(cells * sizeof(uint16_t));
+	pl->flips = (uint8_t*)p;
+
+	pl->palette[0] = NULL;
+	pl->palette_gids[0] = 0;
+	for (d=0; d<remap.dir_count; d++) {
+		for (x=0; remap.dirs[d] && x<TMX_GID_DIR_SIZE; x++) {
+			for (y=0; remap.dirs[d][x] && y<TMX_GID_PAGE_SIZE; y++) {
+				if ((idx = remap.dirs[d][x][y])) {
+					gid = (((d << TMX_GID_DIR_BITS) + x) << TMX_GID_PAGE_BITS) + y;
+					pl->palette[idx] = TMX_GID_TILE(map, gid);
+					pl->palette_gids[idx] = gid;
+				}
+			}
+		}
+	}
+
+	/* the cells of the chunks that are not allocated are empty */
+	memset(pl->tiles, 0, cells * sizeof(uint16_t));
+	memset(pl->flips, 0, cells);
+	memset(&chunk, 0, sizeof(tmx_chunk));
+	while (tmx_layer_next_chunk(layer, &chunk)) {
+		for (y=0; y<chunk.height; y++) {
+			const int32_t *src = chunk.gids + y * chunk.stride;
+			i = (size_t)(chunk.y + y) * layer->width + chunk.x;
+			for (x=0; x<chunk.width; x++) {
+				gid = (uint32_t)src[x] & TMX_FLIP_BITS_REMOVAL;
+				if (gid < map->tilecount && (idx = gid_values_get(&remap, gid))) { /* gid 0 and unknown gids are empty cells */
+					pl->tiles[i + x] = (uint16_t)idx;
+					pl->flips[i + x] = (uint8_t)((uint32_t)src[x] >> TMX_FLIP_SHIFT);
+				}
+			}
+		}
+	}
+
+	gid_values_free(&remap, ctx->free_func);
+	layer->planes = pl;
+	return 1;
+}
+
+/*
+	Misc
+*/
+
+static int cmp_tile_id(const void *a, const void *b) {
+	unsigned int ia = ((const tmx_tile*)a)->id, ib = ((const tmx_tile*)b)->id;
+	return (ia > ib) - (ia < ib);
+}
+
+/* Puts the `count` first tiles of a tileset (in document order) in their final slot:
+   tiles of tilesets with an image go to ts->tiles[id], tiles of image collections are sorted by id.
+   Sorts only if the ids are not in increasing order (Tiled writes them in order) */
+int sort_tiles(tmx_loader *ctx, tmx_tileset *ts, unsigned int count) {
+	unsigned int i, id;
+
+	for (i=1; i<count && ts->tiles[i-1].id < ts->tiles[i].id; i++);
+	if (i < count) {
+		qsort(ts->tiles, count, sizeof(tmx_tile), cmp_tile_id);
+		for (i=1; i<count; i++) {
+			if (ts->tiles[i-1].id == ts->tiles[i].id) {
+				tmx_err(ctx, E_XDATA, "xml parser: tile %u of tileset '%s' is defined twice", ts->tiles[i].id, ts->name);
+				return 0;
+			}
+		}
+	}
+
+	if (!ts->image) {
+		ts->tilecount = count; /* the slots after the last tile are unused */
+		return 1;
+	}
+	if (count && ts->tiles[count-1].id >= ts->tilecount) {
+		tmx_err(ctx, E_XDATA, "xml parser: tile %u of tileset '%s' is out of the tileset (tilecount %u)", ts->tiles[count-1].id, ts->name, ts->tilecount);
+		return 0;
+	}
+	/* the ids are increasing, so tiles[id] is free or already moved when tile i moves there */
+	for (i=count; i-- > 0;) {
+		id = ts->tiles[i].id;
+		if (id != i) {
+			ts->tiles[id] = ts->tiles[i];
 			memset(ts->tiles+i, 0, sizeof(tmx_tile));
 		}
 	}
+	return 1;
+}
+
+/* Sets tile->tileset and tile->ul_x,y */
+int set_tiles_runtime_props(tmx_loader *ctx, tmx_tileset *ts) {
+	unsigned int i;
+	unsigned int tiles_x_count, ts_w, tx, ty;
+
+	if (ts == NULL) {
+		tmx_err(ctx, E_INVAL, "set_tiles_runtime_props: invalid argument: ts is NULL");
+		return 0;
+	}
 
 	for (i=0; i<ts->tilecount; i++) {
 		ts->tiles[i].id = i;
@@ -344,47 +1075,137 @@ int set_tiles_runtime_props(tmx_tileset *ts) {
 	return 1;
 }
 
-/* Creates the array at map->tiles */
-int mk_map_tile_array(tmx_map *map) {
-	unsigned int i;
-	tmx_tileset *ts, *max_ts;
+/* sets the start of the frames of an animation, and its total duration */
+void set_anim_timeline(tmx_tile *tile) {
+	unsigned int i, t = 0;
+	for (i=0; i<tile->animation_len; i++) {
+		tile->animation[i].start = t;
+		t += tile->animation[i].duration;
+	}
+	tile->animation_duration = t;
+}
+
+/* writes the gids of the animated tiles in `out` (if not NULL) in increasing order, returns their count */
+static unsigned int list_anim_gids(const tmx_map *map, unsigned int *out) {
+	tmx_tile ***null_dir = (tmx_tile***)(map->tile_dirs + map->dir_count);
+	tmx_tile *tile;
+	unsigned int d, p, i, res = 0;
+
+	for (d=0; d<map->dir_count; d++) {
+		if (map->tile_dirs[d] == null_dir) continue;
+		for (p=0; p<TMX_GID_DIR_SIZE; p++) {
+			if (map->tile_dirs[d][p] == null_dir[0]) continue; /* the page of NULLs */
+			for (i=0; i<TMX_GID_PAGE_SIZE; i++) {
+				tile = map->tile_dirs[d][p][i];
+				if (tile && tile->animation_len) {
+					if (out) out[res] = (((d << TMX_GID_DIR_BITS) + p) << TMX_GID_PAGE_BITS) + i;
+					res++;
+				}
+			}
+		}
+	}
+	return res;
+}
+
+static int cmp_uint(const void *a, const void *b) {
+	unsigned int ia = *(const unsigned int*)a, ib = *(const unsigned int*)b;
+	return (ia > ib) - (ia < ib);
+}
+
+/* Creates the directories at map->tile_dirs, in one block: the top directory, the directory of NULLs,
+   the directories holding pages, the page of NULLs, then the pages holding tiles.
+   Memory use follows the number of pages holding tiles, not the highest gid */
+int mk_map_tile_array(tmx_loader *ctx, tmx_map *map) {
+	unsigned int i, d, count = 0, tiles = 0, pages = 0, dirs = 0;
+	unsigned long gid, end = 1; /* GIDs start from 1 */
+	unsigned int *used; /* numbers of the pages holding tiles */
+	tmx_tileset_list *tsl;
+	tmx_tileset *ts;
+	tmx_tile ***null_dir, ***dir = NULL, **null_page, **page;
 
 	if (!map) {
-		tmx_err(E_INVAL, "mk_map_tile_array: invalid argument: map is NULL");
+		tmx_err(ctx, E_INVAL, "mk_map_tile_array: invalid argument: map is NULL");
 		return 0;
 	}
 
-	/* Counts total tile count */
-	ts = max_ts = map->ts_head;
-	while (ts != NULL) {
-		if (ts->firstgid > max_ts->firstgid) {
-			max_ts = ts;
+	/* Gets the highest gid, the ids of the tiles of image collections may have gaps */
+	for (tsl = map->ts_head; tsl; tsl = tsl->next) {
+		ts = tsl->tileset;
+		for (i=0; i<ts->tilecount; i++) {
+			gid = (unsigned long)tsl->firstgid + ts->tiles[i].id;
+			if (gid > TMX_FLIP_BITS_REMOVAL) {
+				tmx_err(ctx, E_INVAL, "mk_map_tile_array: the gid of tile %u of tileset '%s' is too large", ts->tiles[i].id, ts->name);
+				return 0;
+			}
+			if (gid + 1 > end) end = gid + 1;
 		}
-		ts = ts->next;
+		tiles += ts->tilecount;
 	}
-	if (max_ts->image) {
-		map->tilecount = max_ts->firstgid + max_ts->tilecount;
+	map->tilecount = (unsigned int)end;
+	map->dir_count = ((map->tilecount - 1) >> (TMX_GID_PAGE_BITS + TMX_GID_DIR_BITS)) + 1;
+
+	/* Lists the pages holding tiles (consecutive tiles are mostly in the same page) */
+	if (!(used = (unsigned int*)ctx->alloc_func(NULL, (tiles + 1) * sizeof(unsigned int)))) {
+		tmx_err(ctx, E_ALLOC, "mk_map_tile_array: not enough memory");
+		return 0;
 	}
-	else {
-		/* Gets the last id, ts->tiles is sorted by id */
-		map->tilecount = max_ts->firstgid + max_ts->tiles[max_ts->tilecount - 1].id + 1;
+	for (tsl = map->ts_head; tsl; tsl = tsl->next) {
+		ts = tsl->tileset;
+		for (i=0; i<ts->tilecount; i++) {
+			used[count] = (tsl->firstgid + ts->tiles[i].id) >> TMX_GID_PAGE_BITS;
+			if (!count || used[count] != used[count-1]) count++;
+		}
+	}
+	qsort(used, count, sizeof(unsigned int), cmp_uint);
+	for (i=0; i<count; i++) {
+		if (i && used[i] == used[i-1]) continue;
+		used[pages++] = used[i];
+		if (pages == 1 || used[pages-1] >> TMX_GID_DIR_BITS != used[pages-2] >> TMX_GID_DIR_BITS) dirs++;
 	}
 
-	/* Allocates the GID indexed tile array */
-	if (!(map->tiles = tmx_alloc_func(NULL, map->tilecount * sizeof(void*)))) {
-		tmx_errno = E_ALLOC;
+	/* Allocates the directories and the pages */
+	if (!(map->tile_dirs = (tmx_tile****)map_alloc(ctx, (map->dir_count + (dirs + 1) * TMX_GID_DIR_SIZE) * sizeof(tmx_tile***) +
+	                                                    (pages + 1) * TMX_GID_PAGE_SIZE * sizeof(tmx_tile*)))) {
+		ctx->free_func(used);
 		return 0;
 	}
-	memset(map->tiles, 0, map->tilecount * sizeof(void*));
+	null_dir = (tmx_tile***)(map->tile_dirs + map->dir_count);
+	null_page = (tmx_tile**)(null_dir + (dirs + 1) * TMX_GID_DIR_SIZE);
+	memset(null_page, 0, (pages + 1) * TMX_GID_PAGE_SIZE * sizeof(tmx_tile*));
+	for (d=0; d<map->dir_count; d++) {
+		map->tile_dirs[d] = null_dir;
+	}
+	for (i=0; i<TMX_GID_DIR_SIZE; i++) {
+		null_dir[i] = null_page;
+	}
+	page = null_page;
+	for (i=0; i<pages; i++) {
+		d = used[i] >> TMX_GID_DIR_BITS;
+		if (map->tile_dirs[d] == null_dir) {
+			dir = (dir? dir: null_dir) + TMX_GID_DIR_SIZE;
+			memcpy(dir, null_dir, TMX_GID_DIR_SIZE * sizeof(tmx_tile**));
+			map->tile_dirs[d] = dir;
+		}
+		page += TMX_GID_PAGE_SIZE;
+		map->tile_dirs[d][used[i] & (TMX_GID_DIR_SIZE - 1)] = page;
+	}
+	ctx->free_func(used);
 
-	/* Populates the array */
-	map->tiles[0] = NULL; /* GIDs start from 1 */
-	ts = map->ts_head;
-	while (ts != NULL) {
+	/* Populates the pages */
+	for (tsl = map->ts_head; tsl; tsl = tsl->next) {
+		ts = tsl->tileset;
 		for (i=0; i<ts->tilecount; i++) {
-			map->tiles[ts->firstgid + ts->tiles[i].id] = &(ts->tiles[i]);
+			TMX_GID_TILE(map, tsl->firstgid + ts->tiles[i].id) = &(ts->tiles[i]);
 		}
-		ts = ts->next;
+	}
+
+	/* Registers the animated tiles */
+	map->anim_gids = NULL;
+	if ((map->anim_count = list_anim_gids(map, NULL))) {
+		if (!(map->anim_gids = (unsigned int*)map_alloc(ctx, map->anim_count * sizeof(unsigned int)))) {
+			return 0;
+		}
+		list_anim_gids(map, map->anim_gids);
 	}
 
 	return 1;
@@ -398,7 +1219,7 @@ enum tmx_map_orient parse_orient(const char *orient_str) {
 	if (!strcmp(orient_str, "isometric")) {
 		return O_ISO;
 	}
-	if (!strcmp(orient_str, "stagging")) {
+	if (!strcmp(orient_str, "staggered") || !strcmp(orient_str, "stagging")) {
 		return O_STA;
 	}
 	if (!strcmp(orient_str, "hexagonal")) {
@@ -451,12 +1272,38 @@ enum tmx_stagger_axis parse_stagger_axis(const char *staggeraxis) {
 	if (staggeraxis == NULL || !strcmp(staggeraxis, "y")) {
 		return SA_Y;
 	}
-	if (!strcmp(staggeraxis, "columns")) {
+	if (!strcmp(staggeraxis, "x") || !strcmp(staggeraxis, "columns")) {
 		return SA_X;
 	}
 	return SA_NONE;
 }
 
+/* "int" -> PT_INT, PT_NONE for unknown types (and for "class") */
+enum tmx_property_type parse_property_type(const char *type) {
+	if (!strcmp(type, "string")) {
+		return PT_STRING;
+	}
+	if (!strcmp(type, "int")) {
+		return PT_INT;
+	}
+	if (!strcmp(type, "float")) {
+		return PT_FLOAT;
+	}
+	if (!strcmp(type, "bool")) {
+		return PT_BOOL;
+	}
+	if (!strcmp(type, "color")) {
+		return PT_COLOR;
+	}
+	if (!strcmp(type, "file")) {
+		return PT_FILE;
+	}
+	if (!strcmp(type, "object")) {
+		return PT_OBJECT;
+	}
+	return PT_NONE;
+}
+
 /* "#337FA2" -> 0x337FA2 */
 int get_color_rgb(const char *c) {
 	if (*c == '#') c++;
@@ -483,8 +1330,11 @@ char* str_trim(char *str) {
 }
 
 /* duplicate a string */
-char* tmx_strdup(const char *str) {
-	char *res =  (char*)tmx_alloc_func(NULL, strlen(str)+1);
+char* tmx_strdup(tmx_loader *ctx, const char *str) {
+	char *res =  (char*)map_alloc(ctx, strlen(str)+1);
+	if (!res) {
+		return NULL;
+	}
 	strcpy(res, str);
 	return res;
 }
@@ -501,15 +1351,15 @@ size_t dirpath_len(const char *str) {
 }
 
 /* ("C:\Maps\map.tmx", "tilesets\ts1.tsx") => "C:\Maps\tilesets\ts1.tsx" */
-char* mk_absolute_path(const char *base_path, const char *rel_path) {
+char* mk_absolute_path(tmx_loader *ctx, const char *base_path, const char *rel_path) {
 	/* if base_path is a directory, it MUST have a trailing path separator */
 	size_t dp_len = dirpath_len(base_path);
 	size_t rp_len = strlen(rel_path);
 	size_t ap_len = dp_len + rp_len;
 
-	char* res = (char*)tmx_alloc_func(NULL, ap_len+1);
+	char* res = (char*)ctx->alloc_func(NULL, ap_len+1);
 	if (!res) {
-		tmx_errno = E_ALLOC;
+		ctx->err = E_ALLOC;
 		return NULL;
 	}
 
@@ -521,14 +1371,225 @@ char* mk_absolute_path(const char *base_path, const char *rel_path) {
 }
 
 /* resolves the path to the image, and delegates to the client code */
-void* load_image(void **ptr, const char *base_path, const char *rel_path) {
+void* load_image(tmx_loader *ctx, void **ptr, const char *base_path, const char *rel_path) {
 	char *ap_img;
-	if (tmx_img_load_func) {
-		ap_img = mk_absolute_path(base_path, rel_path);
+	if (ctx->img_load_func) {
+		ap_img = mk_absolute_path(ctx, base_path, rel_path);
 		if (!ap_img) return 0;
-		*ptr = tmx_img_load_func(ap_img);
-		tmx_free_func(ap_img);
+		*ptr = image_res_load(ctx, ap_img);
+		ctx->free_func(ap_img);
 		return(*ptr);
 	}
 	return (void*)1;
 }
+
+/* sets the loader's error from the errno set by a failed open(2) */
+static void file_err(tmx_loader *ctx, const char *path) {
+	if (errno == ENOENT) {
+		tmx_err(ctx, E_NOENT, "%s: file not found", path);
+	} else if (errno == EACCES) {
+		tmx_err(ctx, E_ACCESS, "%s: permission denied", path);
+	} else {
+		tmx_err(ctx, E_UNKN, "%s: %s", path, strerror(errno));
+	}
+}
+
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+
+/* maps the whole file read-only in memory, returns 0 on failure */
+int map_file(tmx_loader *ctx, const char *path, mapped_file *mf) {
+	HANDLE file, mapping;
+	LARGE_INTEGER size;
+	FILETIME write_time;
+
+	memset(mf, 0, sizeof(mapped_file));
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		errno = (GetLastError() == ERROR_ACCESS_DENIED)? EACCES: ENOENT;
+		file_err(ctx, path);
+		return 0;
+	}
+	if (!GetFileTime(file, NULL, NULL, &write_time)) {
+		write_time.dwHighDateTime = write_time.dwLowDateTime = 0;
+	}
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || (unsigned long long)size.QuadPart > (size_t)-1) {
+		tmx_err(ctx, E_FORMAT, "%s: empty or too large file", path);
+		CloseHandle(file);
+		return 0;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); /* the mapping keeps a reference on the file */
+	if (!mapping) {
+		tmx_err(ctx, E_UNKN, "%s: CreateFileMapping failed (%lu)", path, GetLastError());
+		return 0;
+	}
+	if (!(mf->data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0))) {
+		tmx_err(ctx, E_UNKN, "%s: MapViewOfFile failed (%lu)", path, GetLastError());
+		CloseHandle(mapping);
+		return 0;
+	}
+	mf->len = (size_t)size.QuadPart;
+	mf->mtime = (long long)(((unsigned long long)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime);
+	mf->handle = mapping;
+	return 1;
+}
+
+void unmap_file(mapped_file *mf) {
+	if (mf->data) {
+		UnmapViewOfFile(mf->data);
+		CloseHandle((HANDLE)mf->handle);
+		mf->data = NULL;
+	}
+}
+
+#else
+
+/* maps the whole file read-only in memory, returns 0 on failure */
+int map_file(tmx_loader *ctx, const char *path, mapped_file *mf) {
+	int fd;
+	struct stat st;
+	void *addr;
+
+	memset(mf, 0, sizeof(mapped_file));
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		file_err(ctx, path);
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		tmx_err(ctx, E_FORMAT, "%s: empty or unreadable file", path);
+		close(fd);
+		return 0;
+	}
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); /* the mapping keeps a reference on the file */
+	if (addr == MAP_FAILED) {
+		tmx_err(ctx, E_UNKN, "%s: mmap failed: %s", path, strerror(errno));
+		return 0;
+	}
+	mf->data = (const char*)addr;
+	mf->len = (size_t)st.st_size;
+	mf->mtime = (long long)st.st_mtime;
+	return 1;
+}
+
+void unmap_file(mapped_file *mf) {
+	if (mf->data) {
+		munmap((void*)mf->data, mf->len);
+		mf->data = NULL;
+	}
+}
+
+#endif
+
+/*
+	Threads
+*/
+
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+
+int mutex_init(tmx_mutex *m) {
+	InitializeCriticalSection(m);
+	return 1;
+}
+
+void mutex_lock(tmx_mutex *m) {
+	EnterCriticalSection(m);
+}
+
+void mutex_unlock(tmx_mutex *m) {
+	LeaveCriticalSection(m);
+}
+
+void mutex_destroy(tmx_mutex *m) {
+	DeleteCriticalSection(m);
+}
+
+int cond_init(tmx_cond *c) {
+	InitializeConditionVariable(c);
+	return 1;
+}
+
+void cond_wait(tmx_cond *c, tmx_mutex *m) {
+	SleepConditionVariableCS(c, m, INFINITE);
+}
+
+void cond_signal(tmx_cond *c) {
+	WakeConditionVariable(c);
+}
+
+void cond_broadcast(tmx_cond *c) {
+	WakeAllConditionVariable(c);
+}
+
+void cond_destroy(tmx_cond *c UNUSED) {
+}
+
+int thread_create(tmx_thread *t, thread_func func, void *arg) {
+	return (*t = CreateThread(NULL, 0, func, arg, 0, NULL)) != NULL;
+}
+
+void thread_join(tmx_thread t) {
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+unsigned int cpu_count(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0? (unsigned int)info.dwNumberOfProcessors: 1;
+}
+
+#else
+
+int mutex_init(tmx_mutex *m) {
+	return pthread_mutex_init(m, NULL) == 0;
+}
+
+void mutex_lock(tmx_mutex *m) {
+	pthread_mutex_lock(m);
+}
+
+void mutex_unlock(tmx_mutex *m) {
+	pthread_mutex_unlock(m);
+}
+
+void mutex_destroy(tmx_mutex *m) {
+	pthread_mutex_destroy(m);
+}
+
+int cond_init(tmx_cond *c) {
+	return pthread_cond_init(c, NULL) == 0;
+}
+
+void cond_wait(tmx_cond *c, tmx_mutex *m) {
+	pthread_cond_wait(c, m);
+}
+
+void cond_signal(tmx_cond *c) {
+	pthread_cond_signal(c);
+}
+
+void cond_broadcast(tmx_cond *c) {
+	pthread_cond_broadcast(c);
+}
+
+void cond_destroy(tmx_cond *c) {
+	pthread_cond_destroy(c);
+}
+
+int thread_create(tmx_thread *t, thread_func func, void *arg) {
+	return pthread_create(t, NULL, func, arg) == 0;
+}
+
+void thread_join(tmx_thread t) {
+	pthread_join(t, NULL);
+}
+
+unsigned int cpu_count(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0? (unsigned int)n: 1;
+}
+
+#endif
@@ -12,48 +12,285 @@
 #define UNUSED
 #endif
 
+#ifdef WANT_ZLIB
+#include <zlib.h>
+#endif
+
 /*
 	Parser implementations
 */
 enum enccmp_t {CSV, B64Z};
-int data_decode(const char *source, enum enccmp_t type, size_t gids_count, int32_t **gids);
-tmx_map* parse_xml(const char *filename); /* tmx_xml.c */
+char* b64_encode(tmx_loader *ctx, const char *source, unsigned int length); /* tmx_b64.c */
+char* b64_decode(tmx_loader *ctx, const char *source, unsigned int *rlength); /* tmx_b64.c */
+int b64_decode_into(tmx_loader *ctx, const char *source, size_t len, char *dest); /* tmx_b64.c */
+
+/* destination of the decoded gids: a buffer of `len` gids
+   without `flush`, the buffer is the whole layer (`len` gids are expected)
+   otherwise `flush` is called to consume the buffer each time it is full, and
+   with the remaining gids when the payload ends (see chunk_builder) */
+typedef struct {
+	int32_t *gids;
+	size_t len;
+	int (*flush)(tmx_loader *ctx, void *arg, size_t len);
+	void *arg;
+} gid_output;
+
+/* tmx_csv.c */
+typedef struct {
+	gid_output out;
+	size_t pos;           /* in out.gids */
+	size_t count, index;  /* expected and decoded number of gids */
+	unsigned long line;   /* for error messages */
+	uint32_t value;       /* number being read */
+	int state;
+} csv_decoder;
+void csv_init(csv_decoder *dec, const gid_output *out, size_t count, long line);
+int  csv_feed(tmx_loader *ctx, csv_decoder *dec, const char *chunk, size_t len);
+int  csv_finish(tmx_loader *ctx, csv_decoder *dec);
+size_t csv_skip(const char *text, size_t len, size_t n, long *line);
+
+/* streaming base64 + zlib/gzip decoder (tmx_utils.c)
+   the payload is decoded by chunks of B64Z_CHUNK characters and inflated
+   straight into the gid array, no intermediary buffer holds the whole layer */
+#define B64Z_CHUNK 4096 /* multiple of 4 */
+typedef struct {
+	char b64[B64Z_CHUNK];              /* pending base64 characters, blanks removed */
+	unsigned char raw[B64Z_CHUNK/4*3]; /* decoded bytes, input of inflate */
+	unsigned int b64_len, pad;         /* pad: number of '=' in `b64` */
+	int ended, active;                 /* ended: the zlib stream is complete */
+	gid_output out;
+	size_t count, flushed;             /* expected and flushed number of gids */
+#ifdef WANT_ZLIB
+	z_stream strm;
+#endif
+} b64z_decoder;
+int  b64z_init(tmx_loader *ctx, b64z_decoder *dec, const gid_output *out, size_t count);
+int  b64z_feed(tmx_loader *ctx, b64z_decoder *dec, const char *chunk, size_t len);
+int  b64z_finish(tmx_loader *ctx, b64z_decoder *dec);
+void b64z_release(b64z_decoder *dec); /* only needed to abort a decode */
+
+/* fills the chunks of a sparse layer from bands of TMX_CHUNK_SIZE rows (tmx_utils.c) */
+typedef struct {
+	tmx_layer *layer;
+	unsigned int row; /* first row of the next band */
+	int32_t *band;    /* width * TMX_CHUNK_SIZE gids */
+	void (*free_func)(void *address);
+} chunk_builder;
+
+/* layer data decoder, the payload is fed in as many chunks as the XML
+   reader returns text nodes (tmx_utils.c) */
+typedef struct {
+	enum enccmp_t type;
+	int active; /* between init and finish, see data_decoder_release */
+	union {
+		csv_decoder csv;
+		b64z_decoder b64z;
+	} dec;
+	chunk_builder chunks; /* with TMX_LOAD_CHUNKED */
+} data_decoder;
+/* allocates the storage of the tile layer (dense or chunked, see TMX_LOAD_CHUNKED), sized by layer->width and height */
+int  data_decoder_init(tmx_loader *ctx, data_decoder *dec, enum enccmp_t type, tmx_layer *layer, long line);
+int  data_decoder_feed(tmx_loader *ctx, data_decoder *dec, const char *chunk, size_t len);
+int  data_decoder_finish(tmx_loader *ctx, data_decoder *dec);
+void data_decoder_release(data_decoder *dec);
+
+/* encoded payload of a layer loaded with TMX_LOAD_LAZY (tmx_utils.c)
+   the decoded data is allocated with `alloc_func`, never in the map's arena */
+typedef struct _tmx_lazy_data {
+	void* (*alloc_func)(void *address, size_t len);
+	void  (*free_func)(void *address);
+	unsigned int flags; /* TMX_LOAD_CHUNKED */
+	enum enccmp_t type;
+	long line;
+	size_t len;
+	char *text; /* nul terminated, freed with free_func if own_text, else in the map's memory */
+	int own_text;
+} lazy_data;
+/* takes `text` (allocated with ctx->alloc_func, holding len + 1 chars), frees it if that fails */
+lazy_data* lazy_data_create(tmx_loader *ctx, enum enccmp_t type, long line, char *text, size_t len);
+int  lazy_decode(tmx_loader *ctx, tmx_layer *layer);
+/* `out` receives w*h gids, the region must be in the layer */
+int  lazy_decode_region(tmx_loader *ctx, const tmx_layer *layer, unsigned int x, unsigned int y, unsigned int w, unsigned int h, int32_t *out);
+void free_layer_data(tmx_layer *layer, void (*free_func)(void*)); /* tmx.c */
+
+void init_xml_parser(void); /* tmx_xml.c */
+tmx_map* parse_xml(tmx_loader *ctx, const char *filename); /* tmx_xml.c */
+tmx_map* parse_xml_buffer(tmx_loader *ctx, const char *buffer, size_t len, const char *filename); /* tmx_xml.c */
+int      compile_map(tmx_loader *ctx, const tmx_map *map, const char *path); /* tmx_bin.c */
+tmx_map* load_compiled(tmx_loader *ctx, const char *path); /* tmx_bin.c */
 
 /*
 	Node allocation
 */
-tmx_property*     alloc_prop(void);
-tmx_image*        alloc_image(void);
-tmx_object*       alloc_object(void);
-tmx_object_group* alloc_objgr(void);
-tmx_layer*        alloc_layer(void);
-tmx_tile*         alloc_tiles(int count);
-tmx_tileset*      alloc_tileset(void);
-tmx_map*          alloc_map(void);
-tmx_tile*         alloc_tile(void);
+tmx_arena* arena_create(tmx_loader *ctx);
+void*      arena_alloc(tmx_loader *ctx, tmx_arena *arena, size_t size);
+void       arena_free(tmx_arena *arena, void (*free_func)(void*));
+void       arena_merge(tmx_arena *arena, tmx_arena *other); /* `other` is freed with `arena` */
+void*      map_alloc(tmx_loader *ctx, size_t size);
+
+tmx_property*     alloc_prop(tmx_loader *ctx);
+tmx_properties*   alloc_props(tmx_loader *ctx);
+tmx_image*        alloc_image(tmx_loader *ctx);
+tmx_object*       alloc_object(tmx_loader *ctx);
+tmx_object_group* alloc_objgr(tmx_loader *ctx);
+tmx_layer*        alloc_layer(tmx_loader *ctx);
+tmx_tile*         alloc_tiles(tmx_loader *ctx, int count);
+tmx_tileset*      alloc_tileset(tmx_loader *ctx);
+tmx_tileset_list* alloc_tileset_list(tmx_loader *ctx);
+tmx_map*          alloc_map(tmx_loader *ctx);
+
+/*
+	String pool
+*/
+typedef struct _tmx_str_pool str_pool;
+unsigned int str_hash(const char *str); /* FNV-1a */
+char* str_intern(tmx_loader *ctx, const char *str);
+void  str_pool_free(str_pool *pool, void (*free_func)(void*), int free_strings);
+
+/*
+	Properties
+*/
+unsigned int props_slot(const tmx_properties *props, const char *name);
+int props_index(tmx_loader *ctx, tmx_properties *props);
+
+/*
+	Object arrays
+*/
+int objgr_arrays_build(tmx_loader *ctx, tmx_object_group *objgr); /* in the map's memory, see map_alloc */
+
+/*
+	Gid indexed values
+	for the gids of a map (see map->tile_dirs), only the directories and pages that are used are allocated
+*/
+typedef struct {
+	unsigned int dir_count, fill;
+	unsigned int ***dirs; /* dirs[d] (TMX_GID_DIR_SIZE pages) and dirs[d][p] are NULL if no value was set there */
+} gid_values;
+int gid_values_init(gid_values *v, const tmx_map *map, unsigned int fill, void* (*alloc_func)(void*, size_t));
+/* the value of `gid` (lower than map->tilecount), allocates its page (set to `fill`), returns NULL if that failed */
+unsigned int* gid_values_slot(gid_values *v, unsigned int gid, void* (*alloc_func)(void*, size_t));
+unsigned int gid_values_get(const gid_values *v, unsigned int gid); /* `fill` if it was not set */
+void gid_values_free(gid_values *v, void (*free_func)(void*));
+
+/*
+	Tile planes
+*/
+int layer_planes_build(tmx_loader *ctx, const tmx_map *map, tmx_layer *layer); /* in the map's memory, see map_alloc */
 
 /*
 	Misc
 */
 #define MAX(a,b) (a<b) ? b: a;
-int set_tiles_runtime_props(tmx_tileset *ts);
-int mk_map_tile_array(tmx_map *map);
+int sort_tiles(tmx_loader *ctx, tmx_tileset *ts, unsigned int count);
+int set_tiles_runtime_props(tmx_loader *ctx, tmx_tileset *ts);
+void set_anim_timeline(tmx_tile *tile);
+int mk_map_tile_array(tmx_loader *ctx, tmx_map *map);
 enum tmx_map_orient parse_orient(const char *orient_str);
 enum tmx_map_renderorder parse_renderorder(const char *renderorder);
 enum tmx_objgr_draworder parse_objgr_draworder(const char *draworder);
 enum tmx_stagger_index parse_stagger_index(const char *staggerindex);
 enum tmx_stagger_axis parse_stagger_axis(const char *staggeraxis);
+enum tmx_property_type parse_property_type(const char *type);
 int get_color_rgb(const char *c);
 int count_char_occurences(const char *str, char c);
 char* str_trim(char *str);
-char* tmx_strdup(const char *str);
+char* tmx_strdup(tmx_loader *ctx, const char *str);
 
 /*
 	FS
 */
 size_t dirpath_len(const char *str);
-char* mk_absolute_path(const char *base_path, const char *rel_path);
-void* load_image(void **ptr, const char *base_path, const char *rel_path);
+char* mk_absolute_path(tmx_loader *ctx, const char *base_path, const char *rel_path);
+void* load_image(tmx_loader *ctx, void **ptr, const char *base_path, const char *rel_path);
+
+/* read-only view of a whole file, see map_file() */
+typedef struct {
+	const char *data;
+	size_t len;
+	long long mtime; /* last modification, platform specific unit */
+	void *handle; /* platform specific (mapping handle on win32) */
+} mapped_file;
+int  map_file(tmx_loader *ctx, const char *path, mapped_file *mf);
+void unmap_file(mapped_file *mf);
+
+/*
+	Threads
+*/
+#if defined(WIN32) || defined(__WIN32__) || defined(_WIN32)
+#include <windows.h>
+typedef CRITICAL_SECTION tmx_mutex;
+typedef CONDITION_VARIABLE tmx_cond;
+typedef HANDLE tmx_thread;
+#define THREAD_FUNC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+typedef DWORD (WINAPI *thread_func)(LPVOID);
+#else
+#include <pthread.h>
+typedef pthread_mutex_t tmx_mutex;
+typedef pthread_cond_t tmx_cond;
+typedef pthread_t tmx_thread;
+#define THREAD_FUNC(name, arg) void* name(void *arg)
+#define THREAD_RETURN return NULL
+typedef void* (*thread_func)(void*);
+#endif
+int  mutex_init(tmx_mutex *m);
+void mutex_lock(tmx_mutex *m);
+void mutex_unlock(tmx_mutex *m);
+void mutex_destroy(tmx_mutex *m);
+int  cond_init(tmx_cond *c);
+void cond_wait(tmx_cond *c, tmx_mutex *m);
+void cond_signal(tmx_cond *c);
+void cond_broadcast(tmx_cond *c);
+void cond_destroy(tmx_cond *c);
+int  thread_create(tmx_thread *t, thread_func func, void *arg);
+void thread_join(tmx_thread t);
+unsigned int cpu_count(void);
+
+/*
+	Parallel layer decoding (tmx_pool.c), see TMX_LOAD_PARALLEL
+	jobs are decoded by a pool of threads created by the first submitted job,
+	decode_pool_join must be called before the map is returned or freed
+*/
+typedef struct _decode_job decode_job;
+/* allocates the storage of the layer and a job to receive the payload */
+decode_job* decode_job_create(tmx_loader *ctx, enum enccmp_t type, tmx_layer *layer, long line);
+int  decode_job_append(tmx_loader *ctx, decode_job *job, const char *text, size_t len);
+/* hands the job over to the pool (and frees it on failure) */
+int  decode_job_submit(tmx_loader *ctx, decode_job *job);
+void decode_job_discard(tmx_loader *ctx, decode_job *job);
+/* waits for all the jobs, sets ctx->err if one failed and ctx->err was not already set */
+int  decode_pool_join(tmx_loader *ctx);
+
+/*
+	Spatial index of object groups (tmx_index.c)
+	allocated with the functions of `ctx`, not in the arena of the map
+*/
+int  objgr_index_build(tmx_loader *ctx, tmx_object_group *objgr);
+void objgr_index_free(tmx_object_group *objgr);
+
+typedef struct _tmx_img_res img_res;
+
+/*
+	Tileset cache (tmx_cache.c)
+	get and put return a reference on the entry, released by tmx_map_free
+*/
+typedef struct _ts_cache_entry ts_cache_entry;
+ts_cache_entry* ts_cache_get(tmx_tileset_cache *cache, const char *path, const mapped_file *mf);
+/* adds `ts` (allocated in `arena` and using `images`, which are taken over in any case) to the cache */
+ts_cache_entry* ts_cache_put(tmx_loader *ctx, tmx_tileset_cache *cache, const char *path, const mapped_file *mf, tmx_tileset *ts, tmx_arena *arena, img_res *images);
+void            ts_cache_release(ts_cache_entry *entry);
+tmx_tileset*    ts_cache_tileset(ts_cache_entry *entry);
+/* frees the arena and images of a tileset that could not be loaded */
+void            ts_cache_discard(tmx_loader *ctx, tmx_arena *arena, img_res *images);
+
+/*
+	Image resources (tmx_cache.c)
+	Each image file is loaded once per map (or cached tileset), the resources
+	are listed in *ctx->images, and taken from ctx->img_cache if it is set
+*/
+void* image_res_load(tmx_loader *ctx, const char *path);
+/* `free_func` is NULL if the list was allocated in an arena */
+void  image_res_free(img_res *list, void (*free_func)(void*), void (*img_free_func)(void*));
 
 /*
 	Error handling
@@ -62,7 +299,11 @@ void* load_image(void **ptr, const char *base_path, const char *rel_path);
 #define snprintf _snprintf
 #endif
 
-char custom_msg[256];
-#define tmx_err(code, ...) tmx_errno = code; snprintf(custom_msg, 256, __VA_ARGS__)
+/* message of the global `tmx_errno` (see tmx_err.c) */
+extern char custom_msg[256];
+/* sets the global `tmx_errno` and its message, for the public functions that have no loader */
+#define tmx_err_global(code, ...) (tmx_errno = (code), snprintf(custom_msg, sizeof(custom_msg), __VA_ARGS__))
+/* sets the error code and message of the given loader */
+#define tmx_err(ctx, code, ...) ((ctx)->err = (code), snprintf((ctx)->errmsg, sizeof((ctx)->errmsg), __VA_ARGS__))
 
 #endif /* TMXUTILS_H */
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 
 #include <libxml/xmlreader.h>
 #include <libxml/xmlmemory.h>
@@ -14,64 +16,163 @@
 #include "tmx.h"
 #include "tmx_utils.h"
 
-static void* tmx_malloc(size_t len) {
-	return tmx_alloc_func(NULL, len);
-}
-
 /*
 	 - Parsers -
 	Each function is called when the XML reader is on an element
 	with the same name.
 	Each function return 1 on succes and 0 on failure.
 	This parser is strict, the entry file MUST respect the file format.
-	On failure tmx_errno is set and and an error message is generated.
+	On failure the loader's error is set and and an error message is generated.
+	Strings kept in the map are copied with the loader's allocator, libxml2
+	keeps its own allocator (xmlMemSetup is process-wide, thus not reentrant).
 */
 
-static void error_handler(void *arg UNUSED, const char *msg, xmlParserSeverities severity, xmlTextReaderLocatorPtr locator) {
+/* moves a string returned by libxml2 into the loader's allocator */
+static char* xml_strdup(tmx_loader *ctx, char *str) {
+	char *res = tmx_strdup(ctx, str);
+	xmlFree(str);
+	return res;
+}
+
+/* same as xml_strdup, the result is interned (see str_intern) */
+static char* xml_intern(tmx_loader *ctx, char *str) {
+	char *res = str_intern(ctx, str);
+	xmlFree(str);
+	return res;
+}
+
+static void error_handler(void *arg, const char *msg, xmlParserSeverities severity, xmlTextReaderLocatorPtr locator) {
+	tmx_loader *ctx = (tmx_loader*)arg;
 	if (severity == XML_PARSER_SEVERITY_ERROR) {
-		tmx_err(E_XDATA, "xml parser: error at line %d: %s", xmlTextReaderLocatorLineNumber(locator), msg);
+		tmx_err(ctx, E_XDATA, "xml parser: error at line %d: %s", xmlTextReaderLocatorLineNumber(locator), msg);
+	}
+}
+
+/* layer payloads are single text nodes, they can exceed libxml's 10MB limit */
+#define READER_OPTIONS XML_PARSE_HUGE
+
+static xmlTextReaderPtr create_parser(tmx_loader *ctx, const char *filename) {
+	xmlTextReaderPtr reader = NULL;
+	if ((reader = xmlReaderForFile(filename, NULL, READER_OPTIONS))) {
+
+		xmlTextReaderSetErrorHandler(reader, error_handler, ctx);
+
+		if (xmlTextReaderRead(reader) != 1) {
+			xmlFreeTextReader(reader);
+			reader = NULL;
+		}
+	} else {
+		tmx_err(ctx, E_UNKN, "xml parser: unable to open %s", filename);
 	}
+	return reader;
 }
 
-static xmlTextReaderPtr create_parser(const char *filename) {
+/* same as create_parser, reads from a buffer that must outlive the reader (it is not copied) */
+static xmlTextReaderPtr create_parser_from_memory(tmx_loader *ctx, const char *buffer, size_t len, const char *filename) {
 	xmlTextReaderPtr reader = NULL;
-	if ((reader = xmlReaderForFile(filename, NULL, 0))) {
+	if (len > INT_MAX) {
+		tmx_err(ctx, E_INVAL, "xml parser: buffer too large (%lu bytes)", (unsigned long)len);
+		return NULL;
+	}
+	if ((reader = xmlReaderForMemory(buffer, (int)len, filename, NULL, READER_OPTIONS))) {
 
-		xmlTextReaderSetErrorHandler(reader, error_handler, NULL);
+		xmlTextReaderSetErrorHandler(reader, error_handler, ctx);
 
 		if (xmlTextReaderRead(reader) != 1) {
 			xmlFreeTextReader(reader);
 			reader = NULL;
 		}
 	} else {
-		tmx_err(E_UNKN, "xml parser: unable to open %s", filename);
+		tmx_err(ctx, E_UNKN, "xml parser: unable to read the buffer");
 	}
 	return reader;
 }
 
-static int parse_property(xmlTextReaderPtr reader, tmx_property *prop) {
+/* converts the value of a typed property, see union tmx_property_value
+   a value that does not match its type is kept as a PT_STRING property */
+static void parse_property_value(tmx_property *prop) {
+	const char *v = prop->value;
+	char *end = NULL;
+	long l;
+	unsigned long ul;
+	size_t len;
+
+	errno = 0;
+	switch (prop->type) {
+		case PT_INT:
+			l = strtol(v, &end, 10);
+			if (errno == ERANGE || l < INT_MIN || l > INT_MAX) end = NULL;
+			else prop->parsed.integer = (int)l;
+			break;
+		case PT_FLOAT:
+			prop->parsed.decimal = strtod(v, &end);
+			break;
+		case PT_OBJECT:
+			ul = strtoul(v, &end, 10);
+			if (errno == ERANGE || ul > UINT_MAX || strchr(v, '-')) end = NULL;
+			else prop->parsed.object_id = (unsigned int)ul;
+			break;
+		case PT_BOOL:
+			if (!strcmp(v, "true")) prop->parsed.boolean = 1;
+			else if (!strcmp(v, "false")) prop->parsed.boolean = 0;
+			else break;
+			return;
+		case PT_COLOR: /* "#AARRGGBB", "#RRGGBB" or "" (no color) */
+			if (*v == '#') v++;
+			if (!(len = strlen(v))) return;
+			prop->parsed.color = (unsigned int)strtoul(v, &end, 16);
+			if (len == 6) prop->parsed.color |= 0xFF000000;
+			else if (len != 8 || strchr(v, '-')) end = NULL;
+			break;
+		default:
+			return;
+	}
+	if (end && end != v && *end == '\0') return;
+
+	prop->type = PT_STRING;
+	memset(&(prop->parsed), 0, sizeof(prop->parsed));
+}
+
+static int parse_property(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_property *prop) {
 	char *value;
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		prop->name = value;
+		if (!(prop->name = xml_intern(ctx, value))) return 0;
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'property' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'name' attribute in the 'property' element");
 		return 0;
 	}
 
+	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"type"))) { /* type */
+		prop->type = parse_property_type(value);
+		xmlFree(value);
+	} else {
+		prop->type = PT_STRING;
+	}
+
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"value"))) { /* source */
-		prop->value = value;
+		if (!(prop->value = xml_strdup(ctx, value))) return 0;
+	} else if (prop->type == PT_STRING && (value = (char*)xmlTextReaderReadString(reader))) { /* multi-line string */
+		if (!(prop->value = xml_strdup(ctx, value))) return 0;
+	} else if (prop->type == PT_NONE) { /* class or unknown type, nothing to keep */
+		if (!(prop->value = tmx_strdup(ctx, ""))) return 0;
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'value' attribute in the 'property' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'value' attribute in the 'property' element");
 		return 0;
 	}
+	parse_property_value(prop);
 	return 1;
 }
 
-static int parse_properties(xmlTextReaderPtr reader, tmx_property **prop_headadr) {
-	tmx_property *res;
+static int parse_properties(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_properties **props_adr) {
+	tmx_properties *props;
+	tmx_property *res, **tail;
 	int curr_depth;
 	const char *name;
 
+	if (!*props_adr && !(*props_adr = alloc_props(ctx))) return 0;
+	props = *props_adr;
+	for (tail = &(props->head); *tail; tail = &((*tail)->next));
+
 	curr_depth = xmlTextReaderDepth(reader);
 
 	/* Parse each child */
@@ -81,11 +182,12 @@ static int parse_properties(xmlTextReaderPtr reader, tmx_property **prop_headadr
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 			name = (char*)xmlTextReaderConstName(reader);
 			if (!strcmp(name, "property")) {
-				if (!(res = alloc_prop())) return 0;
-				res->next = *prop_headadr;
-				*prop_headadr = res;
+				if (!(res = alloc_prop(ctx))) return 0;
+				*tail = res;
+				tail = &(res->next);
+				props->count++;
 
-				if (!parse_property(reader, res)) return 0;
+				if (!parse_property(ctx, reader, res)) return 0;
 
 			} else { /* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -93,30 +195,29 @@ static int parse_properties(xmlTextReaderPtr reader, tmx_property **prop_headadr
 		}
 	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 	         xmlTextReaderDepth(reader) != curr_depth);
-	return 1;
+	return props_index(ctx, props);
 }
 
-static int parse_points(xmlTextReaderPtr reader, double ***ptsarrayadr, int *ptslenadr) {
+static int parse_points(tmx_loader *ctx, xmlTextReaderPtr reader, double ***ptsarrayadr, int *ptslenadr) {
 	char *value, *v;
 	int i;
 
 	if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"points"))) { /* points */
-		tmx_err(E_MISSEL, "xml parser: missing 'points' attribute in the 'object' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'points' attribute in the 'object' element");
 		return 0;
 	}
 
 	*ptslenadr = 1 + count_char_occurences(value, ' ');
 
-	*ptsarrayadr = (double**)tmx_alloc_func(NULL, *ptslenadr * sizeof(double*)); /* points[i][x,y] */
+	*ptsarrayadr = (double**)map_alloc(ctx, *ptslenadr * sizeof(double*)); /* points[i][x,y] */
 	if (!(*ptsarrayadr)) {
-		tmx_errno = E_ALLOC;
+		xmlFree(value);
 		return 0;
 	}
 
-	(*ptsarrayadr)[0] = (double*)tmx_alloc_func(NULL, *ptslenadr * 2 * sizeof(double));
-	if (!(*ptsarrayadr)[0]) {
-		tmx_free_func(*ptsarrayadr);
-		tmx_errno = E_ALLOC;
+	/* on failure the (NULL) coordinate buffer is freed with the object */
+	if (!((*ptsarrayadr)[0] = (double*)map_alloc(ctx, *ptslenadr * 2 * sizeof(double)))) {
+		xmlFree(value);
 		return 0;
 	}
 
@@ -127,17 +228,18 @@ static int parse_points(xmlTextReaderPtr reader, double ***ptsarrayadr, int *pts
 	v = value;
 	for (i=0; i<*ptslenadr; i++) {
 		if (sscanf(v, "%lf,%lf", (*ptsarrayadr)[i], (*ptsarrayadr)[i]+1) != 2) {
-			tmx_err(E_XDATA, "xml parser: corrupted point list");
+			tmx_err(ctx, E_XDATA, "xml parser: corrupted point list");
+			xmlFree(value);
 			return 0;
 		}
 		v = 1 + strchr(v, ' ');
 	}
 
-	tmx_free_func(value);
+	xmlFree(value);
 	return 1;
 }
 
-static int parse_object(xmlTextReaderPtr reader, tmx_object *obj) {
+static int parse_object(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_object *obj) {
 	int curr_depth;
 	const char *name;
 	char *value;
@@ -145,61 +247,61 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj) {
 	/* parses each attribute */
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"id"))) { /* id */
 		obj->id = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'id' attribute in the 'object' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'id' attribute in the 'object' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"x"))) { /* x */
 		obj->x = atof(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'x' attribute in the 'object' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'x' attribute in the 'object' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"y"))) { /* y */
 		obj->y = atof(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'y' attribute in the 'object' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'y' attribute in the 'object' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		obj->name = value;
+		if (!(obj->name = xml_intern(ctx, value))) return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"type"))) { /* type */
-		obj->type = value;
+		if (!(obj->type = xml_intern(ctx, value))) return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"visible"))) { /* visible */
 		obj->visible = (char)atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
 		obj->shape = S_SQUARE;
 		obj->height = atof(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
 		obj->width = atof(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"gid"))) { /* gid */
 		obj->shape = S_TILE;
 		obj->gid = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"rotation"))) { /* rotation */
 		obj->rotation = atof(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	/* If it has a child, then it's a polygon or a polyline or an ellipse */
@@ -211,7 +313,7 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj) {
 			if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 				name = (char*)xmlTextReaderConstName(reader);
 				if (!strcmp(name, "properties")) {
-					if (!parse_properties(reader, &(obj->properties))) return 0;
+					if (!parse_properties(ctx, reader, &(obj->properties))) return 0;
 				} else if (!strcmp(name, "ellipse")) {
 					obj->shape = S_ELLIPSE;
 				} else {
@@ -222,7 +324,7 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj) {
 					}
 					/* Unknow element, skip its tree */
 					else if (xmlTextReaderNext(reader) != 1) return 0;
-					if (!parse_points(reader, &(obj->points), &(obj->points_len))) return 0;
+					if (!parse_points(ctx, reader, &(obj->points), &(obj->points_len))) return 0;
 				}
 			}
 		} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
@@ -231,96 +333,183 @@ static int parse_object(xmlTextReaderPtr reader, tmx_object *obj) {
 	return 1;
 }
 
-static int parse_data(xmlTextReaderPtr reader, int32_t **gidsadr, size_t gidscount) {
-	char *value, *inner_xml;
+typedef int (*data_sink)(tmx_loader *ctx, void *sink, const char *text, size_t len);
 
-	if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"encoding"))) { /* encoding */
-		tmx_err(E_MISSEL, "xml parser: missing 'encoding' attribute in the 'data' element");
-		return 0;
+static int feed_decoder(tmx_loader *ctx, void *sink, const char *text, size_t len) {
+	return data_decoder_feed(ctx, (data_decoder*)sink, text, len);
+}
+
+static int append_job(tmx_loader *ctx, void *sink, const char *text, size_t len) {
+	return decode_job_append(ctx, (decode_job*)sink, text, len);
+}
+
+/* payload of a lazy layer being read */
+typedef struct {
+	char *text;
+	size_t len, cap;
+} text_buffer;
+
+static int append_text(tmx_loader *ctx, void *sink, const char *text, size_t len) {
+	text_buffer *buf = (text_buffer*)sink;
+	char *tmp;
+	size_t cap;
+
+	if (buf->len + len > buf->cap) {
+		cap = buf->cap? buf->cap: 4096;
+		while (cap < buf->len + len) cap *= 2;
+		if (!(tmp = (char*)ctx->alloc_func(buf->text, cap))) {
+			ctx->err = E_ALLOC;
+			return 0;
+		}
+		buf->text = tmp;
+		buf->cap = cap;
+	}
+	memcpy(buf->text + buf->len, text, len);
+	buf->len += len;
+	return 1;
+}
+
+/* passes the text content of the 'data' element to `sink`, as the reader produces it */
+static int parse_data_content(tmx_loader *ctx, xmlTextReaderPtr reader, data_sink func, void *sink) {
+	int curr_depth, type;
+	const char *text;
+
+	if (xmlTextReaderIsEmptyElement(reader)) {
+		return 1;
 	}
 
-	if (!(inner_xml = (char*)xmlTextReaderReadInnerXml(reader))) {
-		tmx_err(E_XDATA, "xml parser: missing content in the 'data' element");
-		tmx_free_func(value);
+	curr_depth = xmlTextReaderDepth(reader);
+	for (;;) {
+		if (xmlTextReaderRead(reader) != 1) {
+			if (!ctx->err) tmx_err(ctx, E_XDATA, "xml parser: unexpected end of the 'data' element");
+			return 0;
+		}
+		type = xmlTextReaderNodeType(reader);
+		if (type == XML_READER_TYPE_END_ELEMENT && xmlTextReaderDepth(reader) == curr_depth) {
+			break;
+		}
+		if (type == XML_READER_TYPE_TEXT || type == XML_READER_TYPE_CDATA ||
+		    type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE || type == XML_READER_TYPE_WHITESPACE) {
+			if ((text = (const char*)xmlTextReaderConstValue(reader))) {
+				if (!func(ctx, sink, text, strlen(text))) return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+static int parse_data(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_layer *layer) {
+	char *value;
+	data_decoder dec;
+	decode_job *job;
+	text_buffer buf;
+	enum enccmp_t type;
+	int ret;
+	long line = xmlGetLineNo(xmlTextReaderCurrentNode(reader));
+
+	if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"encoding"))) { /* encoding */
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'encoding' attribute in the 'data' element");
 		return 0;
 	}
 
 	if (!strcmp(value, "base64")) {
-		tmx_free_func(value);
+		xmlFree(value);
 		if (!(value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"compression"))) { /* compression */
-			tmx_err(E_MISSEL, "xml parser: missing 'compression' attribute in the 'data' element");
-			goto cleanup;
+			tmx_err(ctx, E_MISSEL, "xml parser: missing 'compression' attribute in the 'data' element");
+			return 0;
 		}
 		if (strcmp(value, "zlib") && strcmp(value, "gzip")) {
-			tmx_err(E_ENCCMP, "xml parser: unsupported data compression: '%s'", value); /* unsupported compression */
-			goto cleanup;
+			tmx_err(ctx, E_ENCCMP, "xml parser: unsupported data compression: '%s'", value); /* unsupported compression */
+			xmlFree(value);
+			return 0;
 		}
-		if (!data_decode(str_trim(inner_xml), B64Z, gidscount, gidsadr)) goto cleanup;
-
+		type = B64Z;
 	} else if (!strcmp(value, "xml")) {
-		tmx_err(E_ENCCMP, "xml parser: unimplemented data encoding: XML");
-		goto cleanup;
+		tmx_err(ctx, E_ENCCMP, "xml parser: unimplemented data encoding: XML");
+		xmlFree(value);
+		return 0;
 	} else if (!strcmp(value, "csv")) {
-		if (!data_decode(str_trim(inner_xml), CSV, gidscount, gidsadr)) goto cleanup;
+		type = CSV;
 	} else {
-		tmx_err(E_ENCCMP, "xml parser: unknown data encoding: %s", value);
-		goto cleanup;
+		tmx_err(ctx, E_ENCCMP, "xml parser: unknown data encoding: %s", value);
+		xmlFree(value);
+		return 0;
 	}
-	tmx_free_func(value);
-	tmx_free_func(inner_xml);
-	return 1;
+	xmlFree(value);
 
-cleanup:
-	tmx_free_func(value);
-	tmx_free_func(inner_xml);
-	return 0;
+	if (ctx->flags & TMX_LOAD_LAZY) { /* decoded by tmx_layer_gids */
+		memset(&buf, 0, sizeof(text_buffer));
+		if (!parse_data_content(ctx, reader, append_text, &buf) || !append_text(ctx, &buf, "", 1)) { /* room for the nul */
+			ctx->free_func(buf.text);
+			return 0;
+		}
+		if (buf.cap - buf.len > 4096 && (value = (char*)ctx->alloc_func(buf.text, buf.len))) { /* trims the buffer */
+			buf.text = value;
+		}
+		return (layer->lazy = lazy_data_create(ctx, type, line, buf.text, buf.len - 1)) != NULL;
+	}
+
+	if (ctx->flags & TMX_LOAD_PARALLEL) { /* decoded by a worker, see tmx_pool.c */
+		if (!(job = decode_job_create(ctx, type, layer, line))) return 0;
+		if (!parse_data_content(ctx, reader, append_job, job)) {
+			decode_job_discard(ctx, job);
+			return 0;
+		}
+		return decode_job_submit(ctx, job);
+	}
+
+	if (!data_decoder_init(ctx, &dec, type, layer, line)) return 0;
+	ret = parse_data_content(ctx, reader, feed_decoder, &dec) && data_decoder_finish(ctx, &dec);
+	data_decoder_release(&dec); /* in case of error */
+	return ret;
 }
 
-static int parse_image(xmlTextReaderPtr reader, tmx_image **img_adr, short strict, const char *filename) {
+static int parse_image(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_image **img_adr, short strict, const char *filename) {
 	tmx_image *res;
 	char *value;
 
-	if (!(res = alloc_image())) return 0;
+	if (!(res = alloc_image(ctx))) return 0;
 	*img_adr = res;
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"source"))) { /* source */
-		res->source = value;
-		if (!(load_image(&(res->resource_image), filename, value))) {
-			tmx_err(E_UNKN, "xml parser: an error occured in the delegated image loading function");
+		if (!(res->source = xml_strdup(ctx, value))) return 0;
+		if (!(load_image(ctx, &(res->resource_image), filename, res->source))) {
+			tmx_err(ctx, E_UNKN, "xml parser: an error occured in the delegated image loading function");
 			return 0;
 		}
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'source' attribute in the 'image' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'source' attribute in the 'image' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
 		res->height = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else if (strict) {
-		tmx_err(E_MISSEL, "xml parser: missing 'height' attribute in the 'image' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'height' attribute in the 'image' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
 		res->width = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else if (strict) {
-		tmx_err(E_MISSEL, "xml parser: missing 'width' attribute in the 'image' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'width' attribute in the 'image' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"trans"))) { /* trans */
 		res->trans = get_color_rgb(value);
 		res->uses_trans = 1;
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	return 1;
 }
 
 /* parse layers and objectgroups */
-static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int map_h, int map_w, enum tmx_layer_type type, const char *filename) {
+static int parse_layer(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_layer **layer_headadr, int map_h, int map_w, enum tmx_layer_type type, const char *filename) {
 	tmx_layer *res;
 	tmx_object *obj;
 	int curr_depth;
@@ -329,8 +518,12 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 
 	curr_depth = xmlTextReaderDepth(reader);
 
-	if (!(res = alloc_layer())) return 0;
+	if (!(res = alloc_layer(ctx))) return 0;
 	res->type = type;
+	if (type == L_LAYER) {
+		res->width = map_w;
+		res->height = map_h;
+	}
 	while(*layer_headadr) {
 		layer_headadr = &((*layer_headadr)->next);
 	}
@@ -338,45 +531,45 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 
 	/* parses each attribute */
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		res->name = value;
+		if (!(res->name = xml_strdup(ctx, value))) return 0;
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'layer' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'name' attribute in the 'layer' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"visible"))) { /* visible */
 		res->visible = (char)atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"opacity"))) { /* opacity */
 		res->opacity = (float)strtod(value, NULL);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"offsetx"))) { /* offsetx */
 		res->offsetx = (int)atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"offsety"))) { /* offsety */
 		res->offsety = (int)atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	/* objectgroups have more properties */
 	if (type == L_OBJGR) {
-		tmx_object_group *objgr = alloc_objgr();
+		tmx_object_group *objgr = alloc_objgr(ctx);
 		res->content.objgr = objgr;
 
 		if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"color"))) { /* color */
 			objgr->color = get_color_rgb(value);
-			tmx_free_func(value);
+			xmlFree(value);
 		}
 
 		value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"draworder"); /* draworder */
 		objgr->draworder = parse_objgr_draworder(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if (type == L_OBJGR && xmlTextReaderIsEmptyElement(reader)) {
@@ -389,18 +582,18 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 			name = (char*)xmlTextReaderConstName(reader);
 			if (!strcmp(name, "properties")) {
-				if (!parse_properties(reader, &(res->properties))) return 0;
+				if (!parse_properties(ctx, reader, &(res->properties))) return 0;
 			} else if (!strcmp(name, "data")) {
-				if (!parse_data(reader, &(res->content.gids), map_h * map_w)) return 0;
+				if (!parse_data(ctx, reader, res)) return 0;
 			} else if (!strcmp(name, "image")) {
-				if (!parse_image(reader, &(res->content.image), 0, filename)) return 0;
+				if (!parse_image(ctx, reader, &(res->content.image), 0, filename)) return 0;
 			} else if (!strcmp(name, "object")) {
-				if (!(obj = alloc_object())) return 0;
+				if (!(obj = alloc_object(ctx))) return 0;
 
 				obj->next = res->content.objgr->head;
 				res->content.objgr->head = obj;
 
-				if (!parse_object(reader, obj)) return 0;
+				if (!parse_object(ctx, reader, obj)) return 0;
 			} else {
 				/* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -412,21 +605,21 @@ static int parse_layer(xmlTextReaderPtr reader, tmx_layer **layer_headadr, int m
 	return 1;
 }
 
-static int parse_tileoffset(xmlTextReaderPtr reader, int *x, int *y) {
+static int parse_tileoffset(tmx_loader *ctx, xmlTextReaderPtr reader, int *x, int *y) {
 	char *value;
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"x"))) { /* x offset */
 		*x = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'x' attribute in the 'tileoffset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'x' attribute in the 'tileoffset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"y"))) { /* y offset */
 		*y = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'y' attribute in the 'tileoffset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'y' attribute in the 'tileoffset' element");
 		return 0;
 	}
 
@@ -434,7 +627,7 @@ static int parse_tileoffset(xmlTextReaderPtr reader, int *x, int *y) {
 }
 
 /* recursive function that alloc tmx_anim_frames on the stack and then move them to the heap */
-static tmx_anim_frame* parse_animation(xmlTextReaderPtr reader, int frame_count, unsigned int *length) {
+static tmx_anim_frame* parse_animation(tmx_loader *ctx, xmlTextReaderPtr reader, int frame_count, unsigned int *length) {
 	char *value;
 	int curr_depth;
 	tmx_anim_frame frame;
@@ -444,25 +637,25 @@ static tmx_anim_frame* parse_animation(xmlTextReaderPtr reader, int frame_count,
 
 	value = (char*)xmlTextReaderConstName(reader);
 	if (strcmp(value, "frame")) {
-		tmx_err(E_XDATA, "xml parser: invalid element '%s' within an 'animation'", value);
+		tmx_err(ctx, E_XDATA, "xml parser: invalid element '%s' within an 'animation'", value);
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileid"))) { /* tileid */
 		frame.tile_id = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 	else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tileid' attribute in the 'frame' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tileid' attribute in the 'frame' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"duration"))) { /* duration */
 		frame.duration = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 	else {
-		tmx_err(E_MISSEL, "xml parser: missing 'duration' attribute in the 'frame' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'duration' attribute in the 'frame' element");
 		return 0;
 	}
 
@@ -476,9 +669,9 @@ static tmx_anim_frame* parse_animation(xmlTextReaderPtr reader, int frame_count,
 
 	/* no more frames, alloc on the heap and returns */
 	if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT && xmlTextReaderDepth(reader) < curr_depth) {
-		res = (tmx_anim_frame*)tmx_alloc_func(NULL, (frame_count+1) * sizeof(tmx_anim_frame));
+		res = (tmx_anim_frame*)map_alloc(ctx, (frame_count+1) * sizeof(tmx_anim_frame));
 		if (res == NULL) {
-			tmx_err(E_ALLOC, "xml parser: failed to alloc %d animation frames", frame_count+1);
+			tmx_err(ctx, E_ALLOC, "xml parser: failed to alloc %d animation frames", frame_count+1);
 			return NULL;
 		}
 		res[frame_count] = frame;
@@ -487,55 +680,40 @@ static tmx_anim_frame* parse_animation(xmlTextReaderPtr reader, int frame_count,
 	}
 	/* recurse */
 	else if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
-		res = parse_animation(reader, frame_count+1, length);
+		res = parse_animation(ctx, reader, frame_count+1, length);
 		if (res != NULL) {
 			res[frame_count] = frame;
 		}
 		return res;
 	}
 
-	tmx_err(E_XDATA, "xml parser: unexpected element '%s' within 'animation'", (char*)xmlTextReaderConstName(reader));
+	tmx_err(ctx, E_XDATA, "xml parser: unexpected element '%s' within 'animation'", (char*)xmlTextReaderConstName(reader));
 	return NULL;
 }
 
-static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, const char *filename) {
+/* appends the tile at tileset->tiles[*count], see sort_tiles */
+static int parse_tile(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_tileset *tileset, unsigned int *count, const char *filename) {
 	tmx_tile *res = NULL;
 	tmx_object *obj;
-	unsigned int id;
 	int curr_depth;
-	int len, to_move;
 	const char *name;
 	char *value;
 
 	curr_depth = xmlTextReaderDepth(reader);
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"id"))) { /* id */
-		id = atoi(value);
-		/* Insertion sort */
-		len = tileset->user_data.integer;
-		for (to_move=0; (len-1)-to_move >= 0; to_move++) {
-			if (tileset->tiles[(len-1)-to_move].id < id) {
-				break;
-			}
-		}
-		if (to_move > 0) {
-			memmove((tileset->tiles)+(len-to_move+1), (tileset->tiles)+(len-to_move), to_move * sizeof(tmx_tile));
-		}
-		res = &(tileset->tiles[len-to_move]);
-
-		if ((unsigned int)(tileset->user_data.integer) == tileset->tilecount) {
-			tileset->user_data.integer = 0;
-		}
-		else {
-			tileset->user_data.integer += 1;
+		if (*count == tileset->tilecount) {
+			tmx_err(ctx, E_XDATA, "xml parser: tileset '%s' has more 'tile' elements than its tilecount (%u)", tileset->name, tileset->tilecount);
+			xmlFree(value);
+			return 0;
 		}
-		/* --- */
-		res->id = id;
+		res = &(tileset->tiles[(*count)++]);
+		res->id = atoi(value);
 		res->tileset = tileset;
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 	else {
-		tmx_err(E_MISSEL, "xml parser: missing 'id' attribute in the 'tile' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'id' attribute in the 'tile' element");
 		return 0;
 	}
 
@@ -545,22 +723,22 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, const char
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 			name = (char*)xmlTextReaderConstName(reader);
 			if (!strcmp(name, "properties")) {
-				if (!parse_properties(reader, &(res->properties))) return 0;
+				if (!parse_properties(ctx, reader, &(res->properties))) return 0;
 			}
 			else if (!strcmp(name, "image")) {
-				if (!parse_image(reader, &(res->image), 0, filename)) return 0;
+				if (!parse_image(ctx, reader, &(res->image), 0, filename)) return 0;
 			}
 			else if (!strcmp(name, "objectgroup")) { /* tile collision */
 				do {
 					if (xmlTextReaderRead(reader) != 1) return 0; /* error_handler has been called */
 					name = (char*)xmlTextReaderConstName(reader);
 					if (!strcmp(name, "object")) {
-						if (!(obj = alloc_object())) return 0;
+						if (!(obj = alloc_object(ctx))) return 0;
 
 						obj->next = res->collision;
 						res->collision = obj;
 
-						if (!parse_object(reader, obj)) return 0;
+						if (!parse_object(ctx, reader, obj)) return 0;
 					}
 					/* else: ignore */
 				} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
@@ -572,8 +750,9 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, const char
 					if (xmlTextReaderRead(reader) != 1) return 0;
 					name = (char*)xmlTextReaderConstName(reader);
 					if (!strcmp(name, "frame")) {
-						res->animation = parse_animation(reader, 0, &(res->animation_len));
+						res->animation = parse_animation(ctx, reader, 0, &(res->animation_len));
 						if (!(res->animation)) return 0;
+						set_anim_timeline(res);
 					}
 					/* else: ignore */
 				} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
@@ -591,8 +770,9 @@ static int parse_tile(xmlTextReaderPtr reader, tmx_tileset *tileset, const char
 }
 
 /* parses a tileset within the tmx file or in a dedicated tsx file */
-static int parse_tileset_sub(xmlTextReaderPtr reader, tmx_tileset *ts_addr, const char *filename) {
+static int parse_tileset_sub(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_tileset *ts_addr, const char *filename) {
 	int curr_depth;
+	unsigned int tiles = 0; /* number of 'tile' elements */
 	const char *name;
 	char *value;
 
@@ -600,47 +780,47 @@ static int parse_tileset_sub(xmlTextReaderPtr reader, tmx_tileset *ts_addr, cons
 
 	/* parses each attribute */
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"name"))) { /* name */
-		ts_addr->name = value;
+		if (!(ts_addr->name = xml_strdup(ctx, value))) return 0;
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'name' attribute in the 'tileset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'name' attribute in the 'tileset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilecount"))) { /* tilecount */
 		ts_addr->tilecount = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tilecount' attribute in the 'tileset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tilecount' attribute in the 'tileset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilewidth"))) { /* tile_width */
 		ts_addr->tile_width = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'tileset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'tileset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileheight"))) { /* tile_height */
 		ts_addr->tile_height = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'tileset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'tileset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"spacing"))) { /* spacing */
 		ts_addr->spacing = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"margin"))) { /* margin */
 		ts_addr->margin = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
-	if (!(ts_addr->tiles = alloc_tiles(ts_addr->tilecount))) return 0;
+	if (!(ts_addr->tiles = alloc_tiles(ctx, ts_addr->tilecount))) return 0;
 
 	/* Parse each child */
 	do {
@@ -649,13 +829,13 @@ static int parse_tileset_sub(xmlTextReaderPtr reader, tmx_tileset *ts_addr, cons
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 			name = (char*)xmlTextReaderConstName(reader);
 			if (!strcmp(name, "image")) {
-				if (!parse_image(reader, &(ts_addr->image), 1, filename)) return 0;
+				if (!parse_image(ctx, reader, &(ts_addr->image), 1, filename)) return 0;
 			} else if (!strcmp(name, "tileoffset")) {
-				if (!parse_tileoffset(reader, &(ts_addr->x_offset), &(ts_addr->y_offset))) return 0;
+				if (!parse_tileoffset(ctx, reader, &(ts_addr->x_offset), &(ts_addr->y_offset))) return 0;
 			} else if (!strcmp(name, "properties")) {
-				if (!parse_properties(reader, &(ts_addr->properties))) return 0;
+				if (!parse_properties(ctx, reader, &(ts_addr->properties))) return 0;
 			} else if (!strcmp(name, "tile")) {
-				if (!parse_tile(reader, ts_addr, filename)) return 0;
+				if (!parse_tile(ctx, reader, ts_addr, &tiles, filename)) return 0;
 			} else {
 				/* Unknown element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) return 0;
@@ -664,44 +844,100 @@ static int parse_tileset_sub(xmlTextReaderPtr reader, tmx_tileset *ts_addr, cons
 	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 	         xmlTextReaderDepth(reader) != curr_depth);
 
-	if (ts_addr->image && !set_tiles_runtime_props(ts_addr)) return 0;
+	if (!sort_tiles(ctx, ts_addr, tiles)) return 0;
+	if (ts_addr->image && !set_tiles_runtime_props(ctx, ts_addr)) return 0;
 
 	return 1;
 }
 
-static int parse_tileset(xmlTextReaderPtr reader, tmx_tileset **ts_headadr, const char *filename) {
-	tmx_tileset *res = NULL;
+/* parses a tsx file */
+static int parse_tsx(tmx_loader *ctx, const mapped_file *tsx, const char *path, tmx_tileset **ts_adr) {
+	xmlTextReaderPtr sub_reader;
+	int ret;
+
+	if (!(*ts_adr = alloc_tileset(ctx))) return 0;
+	if (!(sub_reader = create_parser_from_memory(ctx, tsx->data, tsx->len, path))) return 0;
+	ret = parse_tileset_sub(ctx, sub_reader, *ts_adr, path);
+	xmlFreeTextReader(sub_reader);
+	return ret;
+}
+
+/* gets the tileset from the cache, or parses it in its own arena and adds it to the cache */
+static int parse_cached_tsx(tmx_loader *ctx, const mapped_file *tsx, const char *path, tmx_tileset_list *tsl) {
+	ts_cache_entry *entry;
+	tmx_arena *map_arena = ctx->arena;
+	img_res **map_images = ctx->images;
+	str_pool *map_strings = ctx->strings;
+	img_res *images = NULL;
+	tmx_tileset *ts = NULL;
+	int ret;
+
+	if (!(entry = ts_cache_get(ctx->ts_cache, path, tsx))) {
+		if (!(ctx->arena = arena_create(ctx))) {
+			ctx->arena = map_arena;
+			return 0;
+		}
+		ctx->images = &images;
+		ctx->strings = NULL; /* the strings of the tileset go in its arena */
+		ret = parse_tsx(ctx, tsx, path, &ts);
+		if (ret) {
+			entry = ts_cache_put(ctx, ctx->ts_cache, path, tsx, ts, ctx->arena, images);
+		} else {
+			ts_cache_discard(ctx, ctx->arena, images);
+		}
+		str_pool_free(ctx->strings, ctx->free_func, 0);
+		ctx->arena = map_arena;
+		ctx->images = map_images;
+		ctx->strings = map_strings;
+		if (!entry) return 0;
+	}
+
+	tsl->cache_ref = entry;
+	tsl->tileset = ts_cache_tileset(entry);
+	return 1;
+}
+
+static int parse_tileset(tmx_loader *ctx, xmlTextReaderPtr reader, tmx_tileset_list **ts_headadr, const char *filename) {
+	tmx_tileset_list *res = NULL;
 	int ret;
 	char *value, *ab_path;
-	xmlTextReaderPtr sub_reader;
+	mapped_file tsx;
 
-	if (!(res = alloc_tileset())) return 0;
+	if (!(res = alloc_tileset_list(ctx))) return 0;
 	res->next = *ts_headadr;
 	*ts_headadr = res;
 
 	/* parses each attribute */
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"firstgid"))) { /* fisrtgid */
 		res->firstgid = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'firstgid' attribute in the 'tileset' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'firstgid' attribute in the 'tileset' element");
 		return 0;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"source"))) { /* source */
-		if (!(ab_path = mk_absolute_path(filename, value))) return 0;
-		tmx_free_func(value);
-		if (!(sub_reader = create_parser(ab_path))) return 0; /* opens */
-		ret = parse_tileset_sub(sub_reader, res, ab_path); /* and parses the tsx file */
-		xmlFreeTextReader(sub_reader);
-		tmx_free_func(ab_path);
+		if (!(res->source = xml_strdup(ctx, value))) return 0;
+		if (!(ab_path = mk_absolute_path(ctx, filename, res->source))) return 0;
+		ret = 0;
+		if (map_file(ctx, ab_path, &tsx)) { /* maps */
+			if (ctx->ts_cache) {
+				ret = parse_cached_tsx(ctx, &tsx, ab_path, res);
+			} else {
+				ret = parse_tsx(ctx, &tsx, ab_path, &(res->tileset)); /* and parses the tsx file */
+			}
+			unmap_file(&tsx);
+		}
+		ctx->free_func(ab_path);
 		return ret;
 	}
 
-	return parse_tileset_sub(reader, res, filename);
+	res->is_embedded = 1;
+	if (!(res->tileset = alloc_tileset(ctx))) return 0;
+	return parse_tileset_sub(ctx, reader, res->tileset, filename);
 }
 
-static tmx_map *parse_root_map(xmlTextReaderPtr reader, const char *filename) {
+static tmx_map *parse_root_map(tmx_loader *ctx, xmlTextReaderPtr reader, const char *filename) {
 	tmx_map *res = NULL;
 	int curr_depth;
 	const char *name;
@@ -711,85 +947,85 @@ static tmx_map *parse_root_map(xmlTextReaderPtr reader, const char *filename) {
 	curr_depth = xmlTextReaderDepth(reader);
 
 	if (strcmp(name, "map")) {
-		tmx_err(E_XDATA, "xml parser: root is not a 'map' element");
+		tmx_err(ctx, E_XDATA, "xml parser: root is not a 'map' element");
 		return NULL;
 	}
 
-	if (!(res = alloc_map())) return NULL;
+	if (!(res = alloc_map(ctx))) return NULL;
 
 	/* parses each attribute */
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"orientation"))) { /* orientation */
 		if (res->orient = parse_orient(value), res->orient == O_NONE) {
-			tmx_err(E_XDATA, "xml parser: unsupported 'orientation' '%s'", value);
+			tmx_err(ctx, E_XDATA, "xml parser: unsupported 'orientation' '%s'", value);
 			goto cleanup;
 		}
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'orientation' attribute in the 'map' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'orientation' attribute in the 'map' element");
 		goto cleanup;
 	}
 
 	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"staggerindex"); /* staggerindex */
 	if (value != NULL && (res->stagger_index = parse_stagger_index(value), res->stagger_index == SI_NONE)) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'staggerindex' '%s'", value);
+		tmx_err(ctx, E_XDATA, "xml parser: unsupported 'staggerindex' '%s'", value);
 		goto cleanup;
 	}
-	tmx_free_func(value);
+	xmlFree(value);
 
 	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"staggeraxis"); /* staggeraxis */
 	if (res->stagger_axis = parse_stagger_axis(value), res->stagger_axis == SA_NONE) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'staggeraxis' '%s'", value);
+		tmx_err(ctx, E_XDATA, "xml parser: unsupported 'staggeraxis' '%s'", value);
 		goto cleanup;
 	}
-	tmx_free_func(value);
+	xmlFree(value);
 
 	value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"renderorder"); /* renderorder */
 	if (res->renderorder = parse_renderorder(value), res->renderorder == R_NONE) {
-		tmx_err(E_XDATA, "xml parser: unsupported 'renderorder' '%s'", value);
+		tmx_err(ctx, E_XDATA, "xml parser: unsupported 'renderorder' '%s'", value);
 		goto cleanup;
 	}
-	tmx_free_func(value);
+	xmlFree(value);
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"height"))) { /* height */
 		res->height = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'height' attribute in the 'map' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'height' attribute in the 'map' element");
 		goto cleanup;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"width"))) { /* width */
 		res->width = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'width' attribute in the 'map' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'width' attribute in the 'map' element");
 		goto cleanup;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tileheight"))) { /* tileheight */
 		res->tile_height = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'map' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tileheight' attribute in the 'map' element");
 		goto cleanup;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"tilewidth"))) { /* tilewidth */
 		res->tile_width = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	} else {
-		tmx_err(E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'map' element");
+		tmx_err(ctx, E_MISSEL, "xml parser: missing 'tilewidth' attribute in the 'map' element");
 		goto cleanup;
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"backgroundcolor"))) { /* backgroundcolor */
 		res->backgroundcolor = get_color_rgb(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	if ((value = (char*)xmlTextReaderGetAttribute(reader, (xmlChar*)"hexsidelength"))) { /* hexsidelength */
 		res->hexsidelength = atoi(value);
-		tmx_free_func(value);
+		xmlFree(value);
 	}
 
 	/* Parse each child */
@@ -799,15 +1035,15 @@ static tmx_map *parse_root_map(xmlTextReaderPtr reader, const char *filename) {
 		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
 			name = (char*)xmlTextReaderConstName(reader);
 			if (!strcmp(name, "tileset")) {
-				if (!parse_tileset(reader, &(res->ts_head), filename)) goto cleanup;
+				if (!parse_tileset(ctx, reader, &(res->ts_head), filename)) goto cleanup;
 			} else if (!strcmp(name, "layer")) {
-				if (!parse_layer(reader, &(res->ly_head), res->height, res->width, L_LAYER, filename)) goto cleanup;
+				if (!parse_layer(ctx, reader, &(res->ly_head), res->height, res->width, L_LAYER, filename)) goto cleanup;
 			} else if (!strcmp(name, "objectgroup")) {
-				if (!parse_layer(reader, &(res->ly_head), res->height, res->width, L_OBJGR, filename)) goto cleanup;
+				if (!parse_layer(ctx, reader, &(res->ly_head), res->height, res->width, L_OBJGR, filename)) goto cleanup;
 			} else if (!strcmp(name, "imagelayer")) {
-				if (!parse_layer(reader, &(res->ly_head), res->height, res->width, L_IMAGE, filename)) goto cleanup;
+				if (!parse_layer(ctx, reader, &(res->ly_head), res->height, res->width, L_IMAGE, filename)) goto cleanup;
 			} else if (!strcmp(name, "properties")) {
-				if (!parse_properties(reader, &(res->properties))) goto cleanup;
+				if (!parse_properties(ctx, reader, &(res->properties))) goto cleanup;
 			} else {
 				/* Unknow element, skip its tree */
 				if (xmlTextReaderNext(reader) != 1) goto cleanup;
@@ -815,20 +1051,38 @@ static tmx_map *parse_root_map(xmlTextReaderPtr reader, const char *filename) {
 		}
 	} while (xmlTextReaderNodeType(reader) != XML_READER_TYPE_END_ELEMENT ||
 	         xmlTextReaderDepth(reader) != curr_depth);
+
+	if (!decode_pool_join(ctx)) goto cleanup;
 	return res;
 cleanup:
+	decode_pool_join(ctx); /* the workers may still write in the map */
 	tmx_map_free(res);
 	return NULL;
 }
 
-tmx_map *parse_xml(const char *filename) {
+/* libxml2 must be initialised once, from the main thread, before readers are used concurrently */
+void init_xml_parser(void) {
+	xmlInitParser();
+}
+
+tmx_map *parse_xml(tmx_loader *ctx, const char *filename) {
 	xmlTextReaderPtr reader;
 	tmx_map *res = NULL;
 
-	xmlMemSetup((xmlFreeFunc)tmx_free_func, (xmlMallocFunc)tmx_malloc, (xmlReallocFunc)tmx_alloc_func, (xmlStrdupFunc)tmx_strdup);
+	if ((reader = create_parser(ctx, filename))) {
+		res = parse_root_map(ctx, reader, filename);
+		xmlFreeTextReader(reader);
+	}
+
+	return res;
+}
+
+tmx_map *parse_xml_buffer(tmx_loader *ctx, const char *buffer, size_t len, const char *filename) {
+	xmlTextReaderPtr reader;
+	tmx_map *res = NULL;
 
-	if ((reader = create_parser(filename))) {
-		res = parse_root_map(reader, filename);
+	if ((reader = create_parser_from_memory(ctx, buffer, len, filename))) {
+		res = parse_root_map(ctx, reader, filename);
 		xmlFreeTextReader(reader);
 	}
 
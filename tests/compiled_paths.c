@@ -0,0 +1,85 @@
+/*
+	Regression test: the images of an external tileset in another directory
+	are found from its tsx file, in the parsed map and in the compiled map
+	usage: compiled_paths <directory holding an empty ts/ directory>
+*/
+#include <stdio.h>
+#include <string.h>
+#include <tmx.h>
+
+static const char map_tmx[] = "<?xml version=\"1.0\"?>\n"
+	"<map version=\"1.0\" orientation=\"orthogonal\" width=\"1\" height=\"1\" tilewidth=\"32\" tileheight=\"32\">\n"
+	" <tileset firstgid=\"1\" source=\"ts/t.tsx\"/>\n"
+	" <layer name=\"l\" width=\"1\" height=\"1\"><data encoding=\"csv\">1</data></layer>\n"
+	"</map>\n";
+
+static const char ts_tsx[] = "<?xml version=\"1.0\"?>\n"
+	"<tileset name=\"t\" tilewidth=\"32\" tileheight=\"32\" tilecount=\"1\" columns=\"1\">\n"
+	" <image source=\"numbers.png\" width=\"32\" height=\"32\"/>\n"
+	"</tileset>\n";
+
+/* the content of the image does not matter, the file must exist */
+static void* img_load(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		printf("FAIL image not found: %s\n", path);
+		return NULL;
+	}
+	fclose(file);
+	return (void*)1;
+}
+
+static void img_free(void *address) {
+	(void)address;
+}
+
+static int write_file(const char *dir, const char *name, const char *content) {
+	char path[1024];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(file = fopen(path, "wb"))) {
+		printf("FAIL cannot write %s\n", path);
+		return 0;
+	}
+	fputs(content, file);
+	fclose(file);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	char map_path[1024], bin_path[1024];
+	tmx_map *map;
+	int failures = 0;
+
+	if (argc != 2) return 1;
+	if (!write_file(argv[1], "map.tmx", map_tmx) || !write_file(argv[1], "ts/t.tsx", ts_tsx) ||
+	    !write_file(argv[1], "ts/numbers.png", "")) {
+		return 1;
+	}
+	snprintf(map_path, sizeof(map_path), "%s/map.tmx", argv[1]);
+	snprintf(bin_path, sizeof(bin_path), "%s/map.tmxb", argv[1]);
+	tmx_img_load_func = img_load;
+	tmx_img_free_func = img_free;
+
+	if (!(map = tmx_load(map_path))) {
+		printf("FAIL load: %s\n", tmx_strerr());
+		return 1;
+	}
+	if (!tmx_compile(map, bin_path)) {
+		printf("FAIL compile: %s\n", tmx_strerr());
+		failures++;
+	}
+	tmx_map_free(map);
+
+	if (!failures && !(map = tmx_load_compiled(bin_path))) {
+		printf("FAIL load_compiled: %s\n", tmx_strerr());
+		failures++;
+	}
+	if (!failures && (!map->ts_head->tileset->image || !map->ts_head->tileset->image->resource_image)) {
+		printf("FAIL load_compiled: image not loaded\n");
+		failures++;
+	}
+	tmx_map_free(map);
+	return failures? 1: 0;
+}
@@ -0,0 +1,93 @@
+/*
+	Regression test: the structures built on demand after the load use the
+	allocator of the loader that loaded the map, not the global one
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tmx.h>
+
+static const char map_xml[] = "<?xml version=\"1.0\"?>\n"
+	"<map version=\"1.0\" orientation=\"orthogonal\" width=\"2\" height=\"2\" tilewidth=\"32\" tileheight=\"32\">\n"
+	" <layer name=\"l\" width=\"2\" height=\"2\"><data encoding=\"csv\">0,0,0,0</data></layer>\n"
+	" <objectgroup name=\"o\">\n"
+	"  <object id=\"1\" x=\"0\" y=\"0\" width=\"10\" height=\"10\"/>\n"
+	"  <object id=\"2\" x=\"40\" y=\"40\" width=\"10\" height=\"10\"/>\n"
+	" </objectgroup>\n"
+	"</map>\n";
+
+static long loader_blocks, global_blocks;
+
+static void* loader_alloc(void *address, size_t len) {
+	if (!address) loader_blocks++;
+	return realloc(address, len);
+}
+
+static void loader_free(void *address) {
+	if (address) loader_blocks--;
+	free(address);
+}
+
+static void* global_alloc(void *address, size_t len) {
+	if (!address) global_blocks++;
+	return realloc(address, len);
+}
+
+static void global_free(void *address) {
+	if (address) global_blocks--;
+	free(address);
+}
+
+int main(void) {
+	static const unsigned int flags[] = {0, TMX_LOAD_ARENA};
+	tmx_loader ctx;
+	tmx_map *map;
+	tmx_layer *layer;
+	tmx_object *found[2];
+	tmx_layer_quads *quads;
+	unsigned int i;
+	long before;
+	int failures = 0;
+
+	tmx_alloc_func = global_alloc;
+	tmx_free_func = global_free;
+
+	for (i=0; i<sizeof(flags)/sizeof(flags[0]); i++) {
+		memset(&ctx, 0, sizeof(tmx_loader));
+		ctx.alloc_func = loader_alloc;
+		ctx.free_func = loader_free;
+		ctx.flags = flags[i];
+		if (!(map = tmx_load_buffer_ex(&ctx, map_xml, strlen(map_xml), NULL))) {
+			printf("FAIL load (flags 0x%x): %s\n", flags[i], ctx.errmsg);
+			return 1;
+		}
+		before = loader_blocks;
+		if (!(quads = tmx_layer_build_quads(map, map->ly_head))) {
+			printf("FAIL quads (flags 0x%x): %s\n", flags[i], tmx_strerr());
+			failures++;
+		} else if (loader_blocks == before) {
+			printf("FAIL quads (flags 0x%x): not allocated by the loader\n", flags[i]);
+			failures++;
+		}
+		tmx_layer_quads_free(quads);
+
+		for (layer = map->ly_head; layer && layer->type != L_OBJGR; layer = layer->next);
+
+		before = loader_blocks;
+		if (tmx_objgr_query_point(layer->content.objgr, 5, 5, found, 2) != 1) {
+			printf("FAIL query (flags 0x%x)\n", flags[i]);
+			failures++;
+		}
+		if (loader_blocks == before) {
+			printf("FAIL index (flags 0x%x): not allocated by the loader\n", flags[i]);
+			failures++;
+		}
+
+		tmx_map_free(map);
+		if (loader_blocks || global_blocks) {
+			printf("FAIL free (flags 0x%x): %ld blocks of the loader, %ld global blocks left\n", flags[i], loader_blocks, global_blocks);
+			failures++;
+		}
+	}
+	return failures? 1: 0;
+}
@@ -0,0 +1,67 @@
+/*
+	Regression test: typed property values that do not match their type
+	(or that do not fit it) are kept as PT_STRING instead of failing the load
+*/
+#include <stdio.h>
+#include <string.h>
+#include <tmx.h>
+
+static const char map_xml[] = "<?xml version=\"1.0\"?>\n"
+	"<map version=\"1.0\" orientation=\"orthogonal\" width=\"1\" height=\"1\" tilewidth=\"32\" tileheight=\"32\">\n"
+	" <properties>\n"
+	"  <property name=\"int\" type=\"int\" value=\"-42\"/>\n"
+	"  <property name=\"int suffix\" type=\"int\" value=\"12abc\"/>\n"
+	"  <property name=\"int range\" type=\"int\" value=\"99999999999\"/>\n"
+	"  <property name=\"float\" type=\"float\" value=\"1.5\"/>\n"
+	"  <property name=\"float empty\" type=\"float\" value=\"\"/>\n"
+	"  <property name=\"object negative\" type=\"object\" value=\"-1\"/>\n"
+	"  <property name=\"bool\" type=\"bool\" value=\"yes\"/>\n"
+	"  <property name=\"color\" type=\"color\" value=\"#ff00ff\"/>\n"
+	" </properties>\n"
+	" <layer name=\"l\" width=\"1\" height=\"1\"><data encoding=\"csv\">0</data></layer>\n"
+	"</map>\n";
+
+struct test_case {
+	const char *name;
+	enum tmx_property_type type;
+};
+
+static const struct test_case cases[] = {
+	{"int",             PT_INT},
+	{"int suffix",      PT_STRING},
+	{"int range",       PT_STRING},
+	{"float",           PT_FLOAT},
+	{"float empty",     PT_STRING},
+	{"object negative", PT_STRING},
+	{"bool",            PT_STRING},
+	{"color",           PT_COLOR},
+};
+
+int main(void) {
+	unsigned int i, failures = 0;
+	tmx_property *prop;
+	tmx_map *map;
+
+	if (!(map = tmx_load_buffer(map_xml, strlen(map_xml), NULL))) {
+		printf("FAIL load: %s\n", tmx_strerr());
+		return 1;
+	}
+	for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+		if (!(prop = tmx_get_property(map->properties, cases[i].name)) || prop->type != cases[i].type) {
+			printf("FAIL %s: type %d\n", cases[i].name, prop? (int)prop->type: -1);
+			failures++;
+		}
+	}
+	prop = tmx_get_property(map->properties, "int");
+	if (prop && prop->parsed.integer != -42) {
+		printf("FAIL int: %d\n", prop->parsed.integer);
+		failures++;
+	}
+	prop = tmx_get_property(map->properties, "color");
+	if (prop && prop->parsed.color != 0xFFFF00FF) {
+		printf("FAIL color: %08x\n", prop->parsed.color);
+		failures++;
+	}
+	tmx_map_free(map);
+	return failures? 1: 0;
+}
@@ -0,0 +1,56 @@
+/*
+	Regression test: zlib and gzip layer data without the end of the
+	stream (adler32, crc32 and isize trailers) must fail to load
+*/
+#include <stdio.h>
+#include <string.h>
+#include <tmx.h>
+
+#define MAP_HEAD "<?xml version=\"1.0\"?>\n" \
+	"<map version=\"1.0\" orientation=\"orthogonal\" width=\"2\" height=\"2\" tilewidth=\"32\" tileheight=\"32\">\n" \
+	" <layer name=\"l\" width=\"2\" height=\"2\"><data encoding=\"base64\" compression=\"%s\">%s</data></layer>\n" \
+	"</map>\n"
+
+struct test_case {
+	const char *name, *compression, *data;
+	int valid;
+};
+
+/* gids 1, 2, 3, 4 */
+static const struct test_case cases[] = {
+	{"zlib",              "zlib", "eJxjZGBgYAJiZiBmAWIAAGAACw==", 1},
+	{"zlib, no adler32",  "zlib", "eJxjZGBgYAJiZiBmAWIA", 0},
+	{"gzip",              "gzip", "H4sIAAAAAAACA2NkYGBgAmJmIGYBYgDv1AWvEAAAAA==", 1},
+	{"gzip, no trailer",  "gzip", "H4sIAAAAAAACA2NkYGBgAmJmIGYBYgA=", 0},
+	{"gzip, no isize",    "gzip", "H4sIAAAAAAACA2NkYGBgAmJmIGYBYgDv1AWv", 0},
+};
+
+static const unsigned int flags[] = {0, TMX_LOAD_ARENA, TMX_LOAD_PARALLEL, TMX_LOAD_CHUNKED, TMX_LOAD_LAZY};
+
+int main(void) {
+	char buffer[1024];
+	unsigned int i, j, failures = 0;
+	tmx_loader ctx;
+	tmx_map *map;
+	int loaded;
+
+	for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+		for (j=0; j<sizeof(flags)/sizeof(flags[0]); j++) {
+			snprintf(buffer, sizeof(buffer), MAP_HEAD, cases[i].compression, cases[i].data);
+			tmx_loader_init(&ctx);
+			ctx.flags = flags[j];
+			map = tmx_load_buffer_ex(&ctx, buffer, strlen(buffer), NULL);
+			loaded = map != NULL;
+			if (map && (flags[j] & TMX_LOAD_LAZY)) { /* decoded on demand */
+				loaded = tmx_layer_gids(map->ly_head) != NULL;
+			}
+			if (loaded && tmx_layer_get_gid(map->ly_head, 1, 1) != 4) loaded = 0;
+			if (loaded != cases[i].valid) {
+				printf("FAIL %s (flags 0x%x): %s\n", cases[i].name, flags[j], loaded? "loaded": "not loaded");
+				failures++;
+			}
+			tmx_map_free(map);
+		}
+	}
+	return failures? 1: 0;
+}